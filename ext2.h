@@ -9,17 +9,29 @@
 #define EXT2_ROOT_INO		 	2	/* Root inode */
 #define EXT2_BOOT_LOADER_INO	5	/* Boot loader inode */
 #define EXT2_UNDEL_DIR_INO	 	6	/* Undelete directory inode */
+#define EXT2_RESIZE_INO		 	7	/* Reserved group descriptors inode */
 
 #define EXT2_GOOD_OLD_FIRST_INO	11
 
-#define EXT2_BLOCK_SIZE     1024
-#define	EXT2_ADDR_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof (unsigned int))
-#define EXT2_BLOCKS_PER_BG	128
+/*
+ * The superblock always lives 1024 bytes into the image; the real
+ * block size is read from it when the image is opened.
+ */
+#define EXT2_SUPERBLOCK_OFFSET	1024
+#define EXT2_SUPER_MAGIC	0xEF53
+#define EXT2_MIN_BLOCK_SIZE	1024
 
-#define EXT2_NUM_INODES	32
+extern unsigned long ext2_block_size;
+
+#define EXT2_BLOCK_SIZE     ext2_block_size
+#define	EXT2_ADDR_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof (unsigned int))
+#define EXT2_SECTORS_PER_BLOCK	(EXT2_BLOCK_SIZE / 512)	/* i_blocks units */
 
 #define EXT2_INODE_PTR_LEN 	15
 #define EXT2_NUM_DIR_PTRS	12
+#define EXT2_IND_BLOCK		EXT2_NUM_DIR_PTRS	/* Single indirect */
+#define EXT2_DIND_BLOCK		(EXT2_IND_BLOCK + 1)	/* Double indirect */
+#define EXT2_TIND_BLOCK		(EXT2_DIND_BLOCK + 1)	/* Triple indirect */
 
 /*
  * Macro-instructions used to manage fragments
@@ -45,6 +57,13 @@ struct ext2_group_desc
 	unsigned int	bg_reserved[3];
 };
 
+/*
+ * Inode flags (i_flags)
+ */
+#define EXT2_INDEX_FL	0x00001000	/* hash-indexed directory */
+
+#define EXT2_S_IFMT	0xF000	/* format mask */
+#define EXT2_S_IFLNK	0xA000	/* symbolic link */
 #define EXT2_S_IFREG	0x8000	/* regular file */
 #define EXT2_S_IFDIR	0x4000	/* directory */
 
@@ -108,7 +127,7 @@ struct ext2_super_block {
 	unsigned int	s_inodes_per_group;	/* # Inodes per group */
 	unsigned int	s_mtime;		/* Mount time */
 	unsigned int	s_wtime;		/* Write time */
-	unsigned int	s_mnt_count;		/* Mount count */
+	unsigned short	s_mnt_count;		/* Mount count */
 	unsigned short	s_max_mnt_count;	/* Maximal mount count */
 	unsigned short	s_magic;		/* Magic signature */
 	unsigned short	s_state;		/* File system state */
@@ -149,7 +168,7 @@ struct ext2_super_block {
 	 */
 	unsigned char	s_prealloc_blocks;	/* Nr of blocks to try to preallocate*/
 	unsigned char	s_prealloc_dir_blocks;	/* Nr to preallocate for dirs */
-	unsigned short	s_padding1;
+	unsigned short	s_reserved_gdt_blocks;	/* Per group desc for online growth */
 	/*
 	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
 	 */
@@ -161,10 +180,56 @@ struct ext2_super_block {
 	unsigned char	s_def_hash_version;	/* Default hash version to use */
 	unsigned char	s_reserved_char_pad;
 	unsigned short	s_reserved_word_pad;
+	unsigned int	s_default_mount_opts;
  	unsigned int	s_first_meta_bg; 	/* First metablock block group */
-	unsigned int	s_reserved[190];	/* Padding to the end of the block */
+	unsigned int	s_mkfs_time;		/* When the filesystem was created */
+	unsigned int	s_jnl_blocks[17]; 	/* Backup of the journal inode */
+	unsigned int	s_blocks_count_hi;	/* (64bit support only) */
+	unsigned int	s_r_blocks_count_hi;
+	unsigned int	s_free_blocks_hi;
+	unsigned short	s_min_extra_isize;
+	unsigned short	s_want_extra_isize;
+	unsigned int	s_flags;		/* Miscellaneous flags */
+	unsigned int	s_reserved[167];	/* Padding to the end of the block */
 };
 
+/*
+ * Miscellaneous superblock flags (s_flags)
+ */
+#define EXT2_FLAGS_SIGNED_HASH		0x0001	/* Signed dirhash in use */
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002	/* Unsigned dirhash in use */
+
+/*
+ * Hash versions for hashed (htree) directory indexes
+ */
+#define DX_HASH_LEGACY			0
+#define DX_HASH_HALF_MD4		1
+#define DX_HASH_TEA			2
+#define DX_HASH_LEGACY_UNSIGNED		3
+#define DX_HASH_HALF_MD4_UNSIGNED	4
+#define DX_HASH_TEA_UNSIGNED		5
+
+/*
+ * Revision levels
+ */
+#define EXT2_GOOD_OLD_REV	0	/* The good old (original) format */
+#define EXT2_DYNAMIC_REV	1	/* V2 format w/ dynamic inode sizes */
+
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+
+#define EXT2_INODE_SIZE(s)	(((s)->s_rev_level == EXT2_GOOD_OLD_REV) ? \
+				 EXT2_GOOD_OLD_INODE_SIZE : (s)->s_inode_size)
+
+/*
+ * Feature set definitions
+ */
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL		0x0004
+#define EXT2_FEATURE_COMPAT_RESIZE_INO		0x0010
+#define EXT2_FEATURE_COMPAT_DIR_INDEX		0x0020
+#define EXT3_FEATURE_INCOMPAT_RECOVER		0x0004	/* Journal needs replay */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE	0x0002
+
 /*
  * Codes for operating systems
  */
@@ -0,0 +1,123 @@
+/*
+ * ============================================================================================
+ * File Name : ext2_batch.c
+ * Description  : This program takes the name of an ext2 formatted virtual disk, and 
+ *                optionally a script file (standard input otherwise) of commands for it,
+ *                one per line:
+ *                    cp [-r] <path on native file system> <absolute path on the disk>
+ *                    mkdir <absolute path on the disk>
+ *                    ln <link target> <link storage location>
+ *                    rm <absolute path on the disk>
+ *                    ls <absolute path on the disk>
+ *                    cat <absolute path on the disk>
+ *                    sync
+ *                Each works like the ext2_* program of the same name. Blank lines and 
+ *                lines starting with '#' are skipped. The image is opened once for the 
+ *                whole script, and changes are written back at the end, at each 'sync',
+ *                and (given -c N) after every N commands. Stops at the first command 
+ *                that fails, keeping the changes made before it.
+ * ============================================================================================
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2_utils.h"
+#include "ext2_ops.h"
+
+#define MAX_ARGS    4   // Command name included
+
+unsigned char *disk;
+
+static void usage (void) {
+    fprintf(stderr, "Usage: ext2_batch [-c <commands per checkpoint>] "
+                    "<image file name> [<script file>]\n");
+    exit(1);
+}
+
+/* Runs the command split into 'argc' words at 'argv'. Returns 0, or an
+ * errno value if it failed (EINVAL for an unknown or malformed one). */
+static int run_command (int argc, char** argv) {
+    if(!strcmp(argv[0], "cp") && argc == 3)
+        return do_cp(disk, argv[1], argv[2]);
+    if(!strcmp(argv[0], "cp") && argc == 4 && !strcmp(argv[1], "-r"))
+        return do_cp_tree(disk, argv[2], argv[3], 
+                          sysconf(_SC_NPROCESSORS_ONLN));
+    if(!strcmp(argv[0], "mkdir") && argc == 2)
+        return do_mkdir(disk, argv[1]);
+    if(!strcmp(argv[0], "ln") && argc == 3)
+        return do_ln(disk, argv[1], argv[2]);
+    if(!strcmp(argv[0], "rm") && argc == 2)
+        return do_rm(disk, argv[1]);
+    if(!strcmp(argv[0], "ls") && argc == 2)
+        return do_ls(disk, argv[1], stdout);
+    if(!strcmp(argv[0], "cat") && argc == 2) {
+        fflush(stdout);     // Keeps it in order with what ls printed
+        return do_cat(disk, argv[1], 0, (unsigned long)-1, STDOUT_FILENO);
+    }
+    if(!strcmp(argv[0], "sync") && argc == 1) {
+        flush_image(disk);
+        return 0;
+    }
+    return EINVAL;
+}
+
+int main(int argc, char **argv) {
+    unsigned long every = 0, since = 0, line_no = 0;
+    char *script_name = "<stdin>", *line = NULL, *word;
+    char *words[MAX_ARGS];
+    FILE *script = stdin;
+    size_t line_cap = 0;
+    int opt, nwords, err;
+
+    while((opt = getopt(argc, argv, "c:")) != -1) {
+        if(opt != 'c')
+            usage();
+        every = strtoul(optarg, NULL, 10);
+    }
+    if(argc - optind < 1 || argc - optind > 2)
+        usage();
+
+    if(argc - optind == 2) {
+        script_name = argv[optind + 1];
+        script = fopen(script_name, "r");
+        exit_if(!script, ENOENT); // Script not found
+    }
+    disk = open_image(argv[optind], O_RDWR);
+
+    while(getline(&line, &line_cap, script) != -1) {
+        line_no++;
+
+        // Splits the line into words
+        nwords = 0;
+        for(word = strtok(line, " \t\r\n"); word && nwords < MAX_ARGS; 
+            word = strtok(NULL, " \t\r\n"))
+            words[nwords++] = word;
+        if(!nwords || words[0][0] == '#')
+            continue;
+
+        err = word ? EINVAL : run_command(nwords, words); // Too many words?
+        if(err) {
+            fprintf(stderr, "%s:%lu: %s: %s\n", script_name, line_no, 
+                    words[0], strerror(err));
+            close_image(disk);
+            exit(err);
+        }
+
+        // Checkpoint: writes back what the last 'every' commands changed
+        if(every && ++since == every) {
+            flush_image(disk);
+            since = 0;
+        }
+    }
+    free(line);
+    if(script != stdin)
+        fclose(script);
+
+    // Writes all changes back into the .img file
+    close_image(disk);
+    return 0;
+}
@@ -0,0 +1,760 @@
+/*
+ * ============================================================================================
+ * File Name : ext2_bench.c
+ * Description  : Micro-benchmarks for the helpers in ext2_utils.c. Takes no arguments.
+ *                Compares the word-at-a-time bitmap scan against the original
+ *                bit-at-a-time scan on full and fragmented bitmaps, and the in-place
+ *                path resolver against the original strtok/extract_name one on deep
+ *                paths through large directories (in a scratch image it formats
+ *                itself), linear directories against hash-indexed ones, and
+ *                cold lookups against ones answered by the dentry cache, and
+ *                the original free-run scan against the free-space summary,
+ *                and lookups on one thread against several, beside a writer,
+ *                and cold reads of a file through the mmap block I/O backend
+ *                against the io_uring one, and lookups through churned
+ *                directories before and after compacting them.
+ *                Checks that both versions agree before reporting timings.
+ * ============================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ext2_utils.h"
+
+#define NBITS       (8 * 4096)  // One group's worth of bits with 4 KiB blocks
+#define REPS        2000
+
+#define IMG_BLOCKS  16384       // Scratch image: 64 MiB of 4 KiB blocks,
+#define IMG_INODES  2048        // in a single group
+#define PATH_DEPTH  8
+#define DIR_ENTRIES 2000        // Entries ahead of the subdirectory, per level
+#define LOOKUPS     200
+#define READ_BYTES  (32 << 20)  // File read cold through each backend
+#define FRAG_BYTES  (8 << 20)   // File scattered a block at a time
+
+// Returns a monotonic timestamp in seconds
+static double now (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The original scan: the lowest clear bit at or after 'start',
+ * testing one bit at a time. */
+static unsigned int bitwise_find_zero (const unsigned char *bmap,
+                                       unsigned int start, unsigned int nbits) {
+    unsigned int i = start / 8;
+    unsigned int j = start % 8;
+
+    while (i*8 < nbits) {
+        while(j < 8) {
+            if(((bmap[i] >> j)&1) == 0)
+                return (i*8+j < nbits) ? i*8+j : nbits;
+            j++;
+        }
+        j = 0;
+        i++;
+    }
+    return nbits;
+}
+
+// Times REPS full sweeps over every clear bit of 'bmap' with both scans
+static void bench_sweep (const char *label, const unsigned char *bmap) {
+    unsigned int bit, rep;
+    unsigned long old_sum = 0, new_sum = 0;
+    double t;
+
+    t = now();
+    for(rep = 0; rep < REPS; rep++)
+        for(bit = bitwise_find_zero(bmap, 0, NBITS); bit < NBITS;
+            bit = bitwise_find_zero(bmap, bit + 1, NBITS))
+            old_sum += bit;
+    double t_old = now() - t;
+
+    t = now();
+    for(rep = 0; rep < REPS; rep++)
+        for(bit = bitmap_find_zero(bmap, 0, NBITS); bit < NBITS;
+            bit = bitmap_find_zero(bmap, bit + 1, NBITS))
+            new_sum += bit;
+    double t_new = now() - t;
+
+    assert(old_sum == new_sum);
+    printf("%-24s bitwise %8.2f ms   word %8.2f ms   (%.1fx)\n", label,
+           t_old * 1e3, t_new * 1e3, t_old / t_new);
+}
+
+/* Times allocating every clear bit of 'bmap' one at a time, rescanning
+ * from bit 0 on each call the way find_free_block_idx() used to. */
+static void bench_alloc (const char *label, const unsigned char *src) {
+    unsigned char *bmap = malloc(NBITS / 8);
+    unsigned int bit, rep, reps = REPS / 100;
+    double t_old = 0, t_new = 0, t;
+
+    for(rep = 0; rep < reps; rep++) {
+        memcpy(bmap, src, NBITS / 8);
+        t = now();
+        while((bit = bitwise_find_zero(bmap, 0, NBITS)) < NBITS)
+            bmap[bit / 8] |= 1 << (bit % 8);
+        t_old += now() - t;
+
+        memcpy(bmap, src, NBITS / 8);
+        t = now();
+        while((bit = bitmap_find_zero(bmap, 0, NBITS)) < NBITS)
+            bmap[bit / 8] |= 1 << (bit % 8);
+        t_new += now() - t;
+    }
+    printf("%-24s bitwise %8.2f ms   word %8.2f ms   (%.1fx)\n", label,
+           t_old * 1e3, t_new * 1e3, t_old / t_new);
+    free(bmap);
+}
+
+// Checks the run search and popcount against bit-at-a-time answers
+static void check_runs (const unsigned char *bmap) {
+    unsigned int bit, len, end, count = 0;
+
+    for(bit = 0; bit < NBITS; bit++)
+        count += (bmap[bit / 8] >> (bit % 8)) & 1;
+    assert(count == bitmap_count_set(bmap, NBITS));
+
+    for(bit = bitmap_find_zero_run(bmap, 0, NBITS, NBITS, &len); bit < NBITS;
+        bit = bitmap_find_zero_run(bmap, bit + len, NBITS, NBITS, &len)) {
+        assert(bit == bitwise_find_zero(bmap, bit, NBITS));
+        for(end = bit; end < NBITS && !((bmap[end / 8] >> (end % 8)) & 1); )
+            end++;
+        assert(len == end - bit);
+    }
+}
+
+/* The original resolver: copies and strtok()s the path, and 
+ * extract_name()s every entry it compares against. */
+static struct ext2_dir_entry_2* strtok_find_dir_entry (char* dir_name, 
+                                                       unsigned char* disk) {
+    char *spl = "/";
+    char *p_path = calloc(strlen(dir_name) + 1, 1);
+    strncpy(p_path, dir_name, strlen(dir_name));
+
+    struct ext2_inode *cur_inode = inum_to_inode(EXT2_ROOT_INO, disk);
+    struct ext2_dir_entry_2 *d_entry = NULL;
+    char *spl_path = strtok(p_path, spl), *name;
+    unsigned int b_num = 0;
+    int offset = 0, match;
+
+    while (spl_path != NULL && b_num < EXT2_NUM_DIR_PTRS && 
+        (cur_inode->i_mode & EXT2_S_IFDIR) && cur_inode->i_block[b_num]) {
+        d_entry = (struct ext2_dir_entry_2 *)(bnum_to_block(
+            cur_inode->i_block[b_num], disk));
+        offset = 0;
+        while (offset < EXT2_BLOCK_SIZE) {
+            name = extract_name(d_entry);
+            match = !strncmp(spl_path, name, MAX_STR_LEN);
+            free(name);
+            if(match) {
+                cur_inode = inum_to_inode(d_entry->inode, disk);
+                b_num = 0;
+                spl_path = strtok(NULL, spl);
+                offset = 0;
+                break;
+            }
+            offset += d_entry->rec_len;
+            d_entry = (struct ext2_dir_entry_2 *)((char *)d_entry +
+                d_entry->rec_len);
+        }
+        if(offset >= EXT2_BLOCK_SIZE)
+            b_num++;
+    }
+    free(p_path);
+    return spl_path ? NULL : d_entry;
+}
+
+/* Formats 'fd' as a minimal single-group ext2 image with 4 KiB blocks: 
+ * superblock, group descriptor, bitmaps, inode table and a root directory.
+ * 'compat' is the compatible feature set (e.g. hashed directories). */
+static void make_image (int fd, unsigned int compat) {
+    unsigned int bs = 4096, itbl_blocks = IMG_INODES * 128 / bs;
+    unsigned int root_blk = 4 + itbl_blocks, i;
+    unsigned int free_blocks = IMG_BLOCKS - root_blk - 1;
+    unsigned int free_inodes = IMG_INODES - (EXT2_GOOD_OLD_FIRST_INO - 1);
+    unsigned char *blk = calloc(bs, 1);
+    struct ext2_super_block *sb = (struct ext2_super_block*)(blk + 1024);
+    struct ext2_group_desc *gd = (struct ext2_group_desc*)blk;
+    struct ext2_inode *root = (struct ext2_inode*)(blk + 128);
+    struct ext2_dir_entry_2 *de;
+
+    assert(ftruncate(fd, (off_t)IMG_BLOCKS * bs) == 0);
+
+    sb->s_inodes_count = sb->s_inodes_per_group = IMG_INODES;
+    sb->s_blocks_count = IMG_BLOCKS;
+    sb->s_free_blocks_count = free_blocks;
+    sb->s_free_inodes_count = free_inodes;
+    sb->s_log_block_size = 2;
+    sb->s_blocks_per_group = sb->s_frags_per_group = 8 * bs;
+    sb->s_magic = EXT2_SUPER_MAGIC;
+    sb->s_state = 1;
+    sb->s_rev_level = EXT2_GOOD_OLD_REV;
+    sb->s_feature_compat = compat;
+    assert(pwrite(fd, blk, bs, 0) == bs);
+
+    memset(blk, 0, bs);
+    gd->bg_block_bitmap = 2;
+    gd->bg_inode_bitmap = 3;
+    gd->bg_inode_table = 4;
+    gd->bg_free_blocks_count = free_blocks;
+    gd->bg_free_inodes_count = free_inodes;
+    gd->bg_used_dirs_count = 1;
+    assert(pwrite(fd, blk, bs, bs) == bs);
+
+    // Block bitmap: metadata & root dir in use, plus the padding past the end
+    memset(blk, 0, bs);
+    bitmap_set_range(blk, 0, root_blk + 1);
+    bitmap_set_range(blk, IMG_BLOCKS, 8 * bs - IMG_BLOCKS);
+    assert(pwrite(fd, blk, bs, 2 * bs) == bs);
+
+    // Inode bitmap: the reserved inodes
+    memset(blk, 0, bs);
+    bitmap_set_range(blk, 0, EXT2_GOOD_OLD_FIRST_INO - 1);
+    bitmap_set_range(blk, IMG_INODES, 8 * bs - IMG_INODES);
+    assert(pwrite(fd, blk, bs, 3 * bs) == bs);
+
+    // Root inode (#2, the second slot of the table)
+    memset(blk, 0, bs);
+    root->i_mode = EXT2_S_IFDIR | 0755;
+    root->i_size = bs;
+    root->i_links_count = 2;
+    root->i_blocks = bs / 512;
+    root->i_block[0] = root_blk;
+    assert(pwrite(fd, blk, bs, 4 * (off_t)bs) == bs);
+
+    // Root directory block: '.' and '..'
+    memset(blk, 0, bs);
+    for(i = 0; i < 2; i++) {
+        de = (struct ext2_dir_entry_2*)(blk + 12 * i);
+        de->inode = EXT2_ROOT_INO;
+        de->rec_len = i ? bs - 12 : 12;
+        de->name_len = i + 1;
+        de->file_type = EXT2_FT_DIR;
+        memset(de->name, '.', i + 1);
+    }
+    assert(pwrite(fd, blk, bs, (off_t)root_blk * bs) == bs);
+    free(blk);
+}
+
+/* Formats a scratch image and builds a PATH_DEPTH-deep path in it, where
+ * every directory on the way holds DIR_ENTRIES other entries ahead of the
+ * next component. Stores the path in 'path' and returns the open image. */
+static unsigned char* build_tree (char* img, unsigned int compat, 
+                                  char* path, unsigned int* inum) {
+    char name[15];
+    unsigned int depth, i, p_inum = EXT2_ROOT_INO, d_inum, f_inum;
+    int fd = mkstemp(img);
+
+    assert(fd >= 0);
+    make_image(fd, compat);
+    close(fd);
+    unsigned char *disk = open_image(img, O_RDWR);
+
+    // A single empty file, hard linked DIR_ENTRIES times into each level
+    path[0] = '\0';
+    f_inum = alloc_file(disk, 0, EXT2_S_IFREG, p_inum, -1);
+    for(depth = 0; depth < PATH_DEPTH; depth++) {
+        struct ext2_inode *p_dir = inum_to_inode(p_inum, disk);
+        for(i = 0; i < DIR_ENTRIES; i++) {
+            snprintf(name, sizeof(name), "file_%05u", i);
+            add_dir_entr(disk, p_dir, f_inum, name, EXT2_FT_REG_FILE);
+        }
+        d_inum = alloc_file(disk, 0, EXT2_S_IFDIR, p_inum, -1);
+        inum_to_inode(d_inum, disk)->i_size = 0;
+        add_dir_entr(disk, inum_to_inode(d_inum, disk), d_inum, ".", 
+                     EXT2_FT_DIR);
+        add_dir_entr(disk, inum_to_inode(d_inum, disk), p_inum, "..", 
+                     EXT2_FT_DIR);
+        // Same length as the file names, so it can't slip into their slack
+        snprintf(name, sizeof(name), "subdir_%03u", depth);
+        add_dir_entr(disk, p_dir, d_inum, name, EXT2_FT_DIR);
+        snprintf(path + strlen(path), 16, "/%s", name);
+        p_inum = d_inum;
+    }
+    *inum = p_inum;
+    return disk;
+}
+
+/* Times resolving a deep path through large directories with the 
+ * original resolver and the in-place one, and then the in-place one 
+ * again with the directories hash-indexed. These start each lookup with 
+ * an empty dentry cache; the last run leaves it warm. */
+static void bench_lookup (void) {
+    char img[] = "/tmp/ext2_benchXXXXXX", dx_img[] = "/tmp/ext2_benchXXXXXX";
+    char path[PATH_DEPTH * 16 + 1];
+    unsigned int i, inum, dx_inum;
+    struct ext2_dir_entry_2 *old_entry = NULL, *new_entry = NULL;
+    double t_old, t_new, t_dx, t_hot, t;
+
+    unsigned char *disk = build_tree(img, 0, path, &inum);
+
+    t = now();
+    for(i = 0; i < LOOKUPS; i++)
+        old_entry = strtok_find_dir_entry(path, disk);
+    t_old = now() - t;
+
+    t = now();
+    for(i = 0; i < LOOKUPS; i++) {
+        dcache_flush(disk);
+        new_entry = find_dir_entry(path, disk);
+    }
+    t_new = now() - t;
+
+    assert(old_entry && old_entry == new_entry && 
+           new_entry->inode == inum);
+    printf("%-24s strtok  %8.2f ms   in-place %5.2f ms   (%.1fx)\n",
+           "deep path lookup", t_old * 1e3, t_new * 1e3, t_old / t_new);
+    close_image(disk);
+    unlink(img);
+
+    disk = build_tree(dx_img, EXT2_FEATURE_COMPAT_DIR_INDEX, path, &dx_inum);
+    assert(inum_to_inode(EXT2_ROOT_INO, disk)->i_flags & EXT2_INDEX_FL);
+
+    t = now();
+    for(i = 0; i < LOOKUPS; i++) {
+        dcache_flush(disk);
+        new_entry = find_dir_entry(path, disk);
+    }
+    t_dx = now() - t;
+
+    assert(new_entry && new_entry->inode == dx_inum);
+    printf("%-24s linear  %8.2f ms   indexed  %5.2f ms   (%.1fx)\n",
+           "deep path lookup", t_new * 1e3, t_dx * 1e3, t_new / t_dx);
+
+    t = now();
+    for(i = 0; i < LOOKUPS; i++)
+        new_entry = find_dir_entry(path, disk);
+    t_hot = now() - t;
+
+    assert(new_entry && new_entry->inode == dx_inum);
+    printf("%-24s indexed %8.2f ms   cached   %5.2f ms   (%.1fx)\n",
+           "deep path lookup", t_dx * 1e3, t_hot * 1e3, t_dx / t_hot);
+    close_image(disk);
+    unlink(dx_img);
+}
+
+#define READERS     4
+
+// Shared by the threads of bench_concurrent()
+struct concurrent {
+    unsigned char *disk;
+    char *path;
+    unsigned int inum, lookups;
+    int stop;
+};
+
+// Resolves the deep path over and over, from a cold dentry cache
+static void* lookup_worker (void* arg) {
+    struct concurrent *c = arg;
+    struct ext2_dir_entry_2 *d_entry;
+    unsigned int i;
+
+    for(i = 0; i < c->lookups; i++) {
+        dcache_flush(c->disk);
+        d_entry = find_dir_entry(c->path, c->disk);
+        assert(d_entry && d_entry->inode == c->inum);
+    }
+    return NULL;
+}
+
+// Adds and removes entries in the directory the path ends in until told
+static void* churn_worker (void* arg) {
+    struct concurrent *c = arg;
+    struct ext2_inode *dir = inum_to_inode(c->inum, c->disk);
+    char name[16];
+    unsigned int i;
+
+    for(i = 0; !__atomic_load_n(&c->stop, __ATOMIC_RELAXED); i++) {
+        snprintf(name, sizeof(name), "churn_%05u", i % 512);
+        if(!rem_dir_entr(c->disk, dir, name))
+            add_dir_entr(c->disk, dir, c->inum, name, EXT2_FT_DIR);
+    }
+    return NULL;
+}
+
+/* Times LOOKUPS * READERS cold lookups of the deep path split across 
+ * READERS threads, against one thread doing them all, while another 
+ * thread keeps changing the directory the path ends in. Lookups don't 
+ * wait for that directory's lock, so (given the cores) the threads should
+ * finish up to READERS times sooner. Checks every lookup finds the entry. */
+static void bench_concurrent (void) {
+    char img[] = "/tmp/ext2_benchXXXXXX";
+    char path[PATH_DEPTH * 16 + 1];
+    struct concurrent c;
+    pthread_t churn, readers[READERS];
+    double t_one, t_many, t;
+    int i;
+
+    c.disk = build_tree(img, EXT2_FEATURE_COMPAT_DIR_INDEX, path, &c.inum);
+    c.path = path;
+    c.stop = 0;
+    assert(!pthread_create(&churn, NULL, churn_worker, &c));
+
+    c.lookups = LOOKUPS * READERS;
+    t = now();
+    lookup_worker(&c);
+    t_one = now() - t;
+
+    c.lookups = LOOKUPS;
+    t = now();
+    for(i = 0; i < READERS; i++)
+        assert(!pthread_create(&readers[i], NULL, lookup_worker, &c));
+    for(i = 0; i < READERS; i++)
+        pthread_join(readers[i], NULL);
+    t_many = now() - t;
+
+    __atomic_store_n(&c.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(churn, NULL);
+    printf("%-24s 1 thread %7.2f ms   %d threads %4.2f ms   (%.1fx)\n",
+           "lookup beside a writer", t_one * 1e3, READERS, t_many * 1e3, 
+           t_one / t_many);
+    close_image(c.disk);
+    unlink(img);
+}
+
+/* The original run search: one pass over all of a group's free runs,
+ * keeping the first one 'count' long, else the first of the longest */
+static unsigned int scan_find_run (const unsigned char *bmap, 
+                                   unsigned int nbits, unsigned int count,
+                                   unsigned int *best_len) {
+    unsigned int bit, len, best = nbits;
+
+    *best_len = 0;
+    for(bit = bitmap_find_zero_run(bmap, 0, nbits, count, &len); bit < nbits;
+        bit = bitmap_find_zero_run(bmap, bit + len, nbits, count, &len)) {
+        if(len > *best_len) {
+            best = bit;
+            *best_len = len;
+        }
+        if(len >= count)
+            break;
+    }
+    return best;
+}
+
+/* Times reserving (and handing back) a run of 'count' blocks in a scratch
+ * image whose bitmap is 'frag', with the original scan and through the
+ * free-space summary, checking both pick the same run */
+static void bench_runs (const unsigned char *frag, unsigned int count) {
+    char img[] = "/tmp/ext2_benchXXXXXX", label[32];
+    unsigned int bs = 4096, rep, first = 0, len = 0, bit = 0, best_len = 0;
+    int fd = mkstemp(img);
+    double t_old, t_new, t;
+
+    assert(fd >= 0);
+    make_image(fd, 0);
+
+    // The metadata stays in use; the tail of the group has one free stretch
+    unsigned char *bmap = malloc(bs);
+    assert(pread(fd, bmap, bs, 2 * bs) == bs);
+    memcpy(bmap + 8, frag + 8, IMG_BLOCKS / 8 - 8);
+    memset(bmap + IMG_BLOCKS / 8 - 256, 0, 64);
+    assert(pwrite(fd, bmap, bs, 2 * bs) == bs);
+    close(fd);
+    unsigned char *disk = open_image(img, O_RDWR);
+    unsigned char *live = bnum_to_block(get_gd(disk)->bg_block_bitmap, disk);
+
+    t = now();
+    for(rep = 0; rep < REPS; rep++) {
+        bit = scan_find_run(live, IMG_BLOCKS, count, &best_len);
+        bitmap_set_range(live, bit, best_len);
+        bitmap_clear_range(live, bit, best_len);
+    }
+    t_old = now() - t;
+
+    t = now();
+    for(rep = 0; rep < REPS; rep++) {
+        len = alloc_block_run(disk, 0, count, &first);
+        free_block_run(disk, first, len);
+    }
+    t_new = now() - t;
+
+    assert(len == best_len && first == bit);
+    snprintf(label, sizeof(label), "run of %u, fragmented", count);
+    printf("%-24s scan    %8.2f ms   summary  %5.2f ms   (%.1fx)\n",
+           label, t_old * 1e3, t_new * 1e3, t_old / t_new);
+    free(bmap);
+    close_image(disk);
+    unlink(img);
+}
+
+/* Fills a new directory's two blocks exactly with long names, in an order
+ * where sorting them would take a third block, and checks compacting it
+ * with sorting leaves it as it was */
+static void check_compact_sort (unsigned char* disk) {
+    char name[MAX_STR_LEN + 1], path[MAX_STR_LEN + 9];
+    unsigned int i, d_inum = alloc_file(disk, 0, EXT2_S_IFDIR, 
+                                        EXT2_ROOT_INO, -1);
+    struct ext2_inode *dir = inum_to_inode(d_inum, disk);
+
+    dir->i_size = 0;
+    add_dir_entr(disk, dir, d_inum, ".", EXT2_FT_DIR);
+    add_dir_entr(disk, dir, EXT2_ROOT_INO, "..", EXT2_FT_DIR);
+    add_dir_entr(disk, inum_to_inode(EXT2_ROOT_INO, disk), d_inum, "sorted",
+                 EXT2_FT_DIR);
+
+    // Per block: 15 entries of 264 bytes, then one of 112 to fill it
+    for(i = 0; i < 32; i++) {
+        memset(name, i % 16 == 15 ? 'a' : 'b', MAX_STR_LEN);
+        snprintf(name + (i % 16 == 15 ? 102 : 253), 3, "%02u", i);
+        add_dir_entr(disk, dir, d_inum, name, EXT2_FT_DIR);
+    }
+    assert(dir->i_size == 2 * EXT2_BLOCK_SIZE);
+
+    assert(compact_dir(disk, dir, 1) == 2);
+    assert(dir->i_size == 2 * EXT2_BLOCK_SIZE);
+    for(i = 0; i < 32; i++) {
+        memset(name, i % 16 == 15 ? 'a' : 'b', MAX_STR_LEN);
+        snprintf(name + (i % 16 == 15 ? 102 : 253), 3, "%02u", i);
+        snprintf(path, sizeof(path), "/sorted/%s", name);
+        assert(find_inum(path, disk) == d_inum);
+    }
+}
+
+/* Removes three of every four entries ahead of the next directory on the
+ * deep path, then times cold lookups of the path before and after every
+ * directory on it is compacted */
+static void bench_compact (void) {
+    char img[] = "/tmp/ext2_benchXXXXXX";
+    char path[PATH_DEPTH * 16 + 1], name[15], *slash;
+    unsigned int i, depth, inum, p_inum = EXT2_ROOT_INO;
+    unsigned long before = 0, after = 0;
+    struct ext2_dir_entry_2 *entry = NULL;
+    struct ext2_inode *dir;
+    double t_churned, t_compact, t;
+
+    unsigned char *disk = build_tree(img, 0, path, &inum);
+    for(depth = 0, slash = path; depth < PATH_DEPTH; depth++) {
+        dir = inum_to_inode(p_inum, disk);
+        for(i = 0; i < DIR_ENTRIES; i++) {
+            snprintf(name, sizeof(name), "file_%05u", i);
+            if(i % 4)
+                assert(rem_dir_entr(disk, dir, name));
+        }
+        slash = strchr(slash + 1, '/');
+        if(slash)
+            *slash = '\0';
+        p_inum = find_inum(path, disk);
+        if(slash)
+            *slash = '/';
+    }
+
+    t = now();
+    for(i = 0; i < LOOKUPS; i++) {
+        dcache_flush(disk);
+        entry = find_dir_entry(path, disk);
+    }
+    t_churned = now() - t;
+    assert(entry && entry->inode == inum);
+
+    // Compacts the root and every directory down the path
+    for(depth = 0, slash = path, p_inum = EXT2_ROOT_INO; ; depth++) {
+        dir = inum_to_inode(p_inum, disk);
+        before += compact_dir(disk, dir, 0);
+        after += dir->i_size / EXT2_BLOCK_SIZE;
+        if(depth == PATH_DEPTH - 1)
+            break;
+        slash = strchr(slash + 1, '/');
+        *slash = '\0';
+        p_inum = find_inum(path, disk);
+        *slash = '/';
+    }
+
+    t = now();
+    for(i = 0; i < LOOKUPS; i++) {
+        dcache_flush(disk);
+        entry = find_dir_entry(path, disk);
+    }
+    t_compact = now() - t;
+
+    assert(entry && entry->inode == inum && after < before);
+    printf("%-24s churned %8.2f ms   compact  %5.2f ms   (%.1fx, "
+           "%lu -> %lu blocks)\n", "deep path lookup", t_churned * 1e3, 
+           t_compact * 1e3, t_churned / t_compact, before, after);
+    check_compact_sort(disk);
+    close_image(disk);
+    unlink(img);
+}
+
+/* Writes a READ_BYTES file into a scratch image, then reads it back with
+ * the page cache emptied of the image each time, through each block I/O
+ * backend in turn (io_uring only where the kernel has it) */
+static void bench_block_io (void) {
+    char img[] = "/tmp/ext2_benchXXXXXX", src[] = "/tmp/ext2_benchXXXXXX";
+    char dst[] = "/tmp/ext2_benchXXXXXX";
+    static const char* names[] = { "mmap", "io_uring" };
+    unsigned char *disk, *data = malloc(READ_BYTES);
+    unsigned char *back = malloc(READ_BYTES);
+    int fd = mkstemp(img), src_fd = mkstemp(src), dst_fd = mkstemp(dst);
+    unsigned int i, inum;
+    double t[2] = { 0, 0 };
+
+    assert(fd >= 0 && src_fd >= 0 && dst_fd >= 0 && data && back);
+    make_image(fd, 0);
+    close(fd);
+    srand(2);
+    for(i = 0; i < READ_BYTES; i++)
+        data[i] = rand();
+    assert(write(src_fd, data, READ_BYTES) == READ_BYTES);
+
+    disk = open_image(img, O_RDWR);
+    inum = alloc_file(disk, READ_BYTES, EXT2_S_IFREG, EXT2_ROOT_INO, src_fd);
+    write_file(disk, inum_to_inode(inum, disk), READ_BYTES, src_fd);
+    close_image(disk);
+
+    for(i = 0; i < 2; i++) {
+        disk = open_image(img, O_RDONLY);
+        if(set_block_io(disk, names[i]) < 0) {
+            close_image(disk);
+            continue;
+        }
+        fd = open(img, O_RDONLY);
+        assert(fd >= 0 && !posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
+        close(fd);
+
+        assert(ftruncate(dst_fd, 0) == 0 && lseek(dst_fd, 0, SEEK_SET) == 0);
+        t[i] = now();
+        assert(!read_file(disk, inum_to_inode(inum, disk), 0, READ_BYTES,
+                          dst_fd));
+        t[i] = now() - t[i];
+        assert(pread(dst_fd, back, READ_BYTES, 0) == READ_BYTES);
+        assert(!memcmp(data, back, READ_BYTES));
+        close_image(disk);
+    }
+
+    if(t[1])
+        printf("%-24s mmap %10.2f ms   io_uring %8.2f ms   (%.1fx)\n",
+               "cold read of 32 MiB", t[0] * 1e3, t[1] * 1e3, t[0] / t[1]);
+    else
+        printf("%-24s mmap %10.2f ms   (no io_uring here)\n",
+               "cold read of 32 MiB", t[0] * 1e3);
+    close(src_fd);
+    close(dst_fd);
+    unlink(img);
+    unlink(src);
+    unlink(dst);
+    free(data);
+    free(back);
+}
+
+/* Reads the file 'inum' from 'img' to 'dst_fd' with the page cache
+ * emptied of the image first, returning how long it took */
+static double cold_read (char* img, unsigned int inum, int dst_fd) {
+    unsigned char *disk = open_image(img, O_RDONLY);
+    int fd = open(img, O_RDONLY);
+    double t;
+
+    assert(fd >= 0 && !posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
+    close(fd);
+    assert(ftruncate(dst_fd, 0) == 0 && lseek(dst_fd, 0, SEEK_SET) == 0);
+    t = now();
+    assert(!read_file(disk, inum_to_inode(inum, disk), 0, FRAG_BYTES,
+                      dst_fd));
+    t = now() - t;
+    close_image(disk);
+    return t;
+}
+
+/* Writes a FRAG_BYTES file into the free blocks left between every other
+ * block of a full scratch image, then times cold reads of it before and
+ * after it's defragmented */
+static void bench_defrag (void) {
+    char img[] = "/tmp/ext2_benchXXXXXX", src[] = "/tmp/ext2_benchXXXXXX";
+    char dst[] = "/tmp/ext2_benchXXXXXX";
+    unsigned char *disk, *data = malloc(FRAG_BYTES);
+    unsigned char *back = malloc(FRAG_BYTES);
+    int fd = mkstemp(img), src_fd = mkstemp(src), dst_fd = mkstemp(dst);
+    unsigned int i, inum, first, len, bnum, before, after;
+    unsigned int holes = 2 * (FRAG_BYTES / 4096 + 8);
+    double t_frag, t_defrag;
+
+    assert(fd >= 0 && src_fd >= 0 && dst_fd >= 0 && data && back);
+    make_image(fd, 0);
+    close(fd);
+    srand(3);
+    for(i = 0; i < FRAG_BYTES; i++)
+        data[i] = rand();
+    assert(write(src_fd, data, FRAG_BYTES) == FRAG_BYTES);
+
+    // Takes every free block, then gives back every other one at the start
+    disk = open_image(img, O_RDWR);
+    assert(alloc_block_run(disk, 0, IMG_BLOCKS, &first) > holes);
+    while(alloc_block_run(disk, 0, IMG_BLOCKS, &bnum))
+        ;
+    for(bnum = first; bnum < first + holes; bnum += 2)
+        free_block_run(disk, bnum, 1);
+    inum = alloc_file(disk, FRAG_BYTES, EXT2_S_IFREG, EXT2_ROOT_INO, src_fd);
+    write_file(disk, inum_to_inode(inum, disk), FRAG_BYTES, src_fd);
+    for(bnum = first + 1; bnum < first + holes; bnum += 2)
+        free_block_run(disk, bnum, 1);
+    len = IMG_BLOCKS - (first + holes);
+    free_block_run(disk, first + holes, len);
+    close_image(disk);
+
+    t_frag = cold_read(img, inum, dst_fd);
+    disk = open_image(img, O_RDWR);
+    before = count_extents(disk, inum_to_inode(inum, disk));
+    after = defrag_file(disk, inum_to_inode(inum, disk));
+    close_image(disk);
+    t_defrag = cold_read(img, inum, dst_fd);
+
+    assert(pread(dst_fd, back, FRAG_BYTES, 0) == FRAG_BYTES);
+    assert(!memcmp(data, back, FRAG_BYTES) && after < before);
+    printf("%-24s scattered %5.2f ms   defrag   %5.2f ms   (%.1fx, "
+           "%u -> %u extents)\n", "cold read of 8 MiB", t_frag * 1e3,
+           t_defrag * 1e3, t_frag / t_defrag, before, after);
+    close(src_fd);
+    close(dst_fd);
+    unlink(img);
+    unlink(src);
+    unlink(dst);
+    free(data);
+    free(back);
+}
+
+int main (void) {
+    unsigned char *full = malloc(NBITS / 8);
+    unsigned char *frag = malloc(NBITS / 8);
+    unsigned int i;
+
+    // Full but for the very last bit
+    memset(full, 0xff, NBITS / 8);
+    full[NBITS / 8 - 1] = 0x7f;
+
+    // Mostly-used, with scattered free bits and a few free stretches
+    srand(1);
+    for(i = 0; i < NBITS / 8; i++)
+        frag[i] = (rand() % 16) ? 0xff : (unsigned char)rand();
+    memset(frag + NBITS / 16, 0, 64);
+
+    check_runs(full);
+    check_runs(frag);
+
+    printf("bitmap of %u bits, %u reps\n", NBITS, REPS);
+    bench_sweep("sweep, full", full);
+    bench_sweep("sweep, fragmented", frag);
+    bench_alloc("alloc-all, full", full);
+    bench_alloc("alloc-all, fragmented", frag);
+    bench_runs(frag, 64);
+    bench_runs(frag, 1024);
+
+    printf("path of depth %u, %u entries per directory, %u lookups\n",
+           PATH_DEPTH, DIR_ENTRIES, LOOKUPS);
+    bench_lookup();
+    bench_concurrent();
+    bench_compact();
+    bench_block_io();
+    bench_defrag();
+
+    free(full);
+    free(frag);
+    return 0;
+}
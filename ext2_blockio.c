@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "ext2.h"
+#include "ext2_utils.h"
+#include "ext2_blockio.h"
+
+#define URING_DEPTH     32              // Reads in flight at once
+#define URING_CHUNK     (128 * 1024)    // Most bytes one read asks for
+#define MINCORE_PAGES   256             // Pages checked per mincore()
+
+// One backend: how it's set up, and how it brings byte ranges in
+struct block_io_ops {
+    const char* name;
+    int (*setup) (struct block_io* bio);
+
+    /* Starts bringing in bytes [off, off + len) of the file (page
+     * aligned), counting the reads it leaves in flight in '*pending' */
+    void (*queue) (struct block_io* bio, size_t off, size_t len,
+                   unsigned int* pending);
+
+    // Waits for the reads counted in '*pending' (if the backend can)
+    void (*finish) (struct block_io* bio, unsigned int* pending);
+    void (*teardown) (struct block_io* bio);
+};
+
+// An io_uring, with the parts of its rings this code uses
+struct uring {
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_len, cq_len;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    size_t sqes_len;
+
+    /* A scratch chunk per read in flight (what's read is only wanted in
+     * the page cache), which of them are free, and the count of reads in
+     * flight each one's is in */
+    unsigned char* buf;
+    struct iovec iov[URING_DEPTH];
+    unsigned int free_slot[URING_DEPTH], nfree;
+    unsigned int* owner[URING_DEPTH];
+    unsigned int to_submit;
+
+    // Set while a thread waits on the ring (without the lock) for the rest
+    int reaping;
+    pthread_cond_t reaped;
+};
+
+struct block_io {
+    const struct block_io_ops* ops;
+    unsigned char* disk;
+    int fd;
+    size_t len;                 // Of the file (and the mapping)
+    pthread_mutex_t lock;       // Guards the ring's queues and slots
+    struct uring ring;          // io_uring only
+};
+
+/////////////////////////////////////////
+// MMAP
+/////////////////////////////////////////
+
+static int mmap_setup (struct block_io* bio) {
+    return 0;
+}
+
+// The kernel reads the range ahead in the background
+static void mmap_queue (struct block_io* bio, size_t off, size_t len,
+                        unsigned int* pending) {
+    madvise(bio->disk + off, len, MADV_WILLNEED);
+}
+
+static void mmap_finish (struct block_io* bio, unsigned int* pending) {
+}
+
+static void mmap_teardown (struct block_io* bio) {
+}
+
+/////////////////////////////////////////
+// IO_URING
+/////////////////////////////////////////
+
+static int uring_enter (int fd, unsigned int to_submit,
+                        unsigned int min_complete) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+/* Sets up a ring URING_DEPTH deep and maps its queues (without liburing,
+ * straight through the system calls). Returns -1 if the kernel has no
+ * io_uring, or won't give this process one. */
+static int uring_setup (struct block_io* bio) {
+    struct uring* r = &bio->ring;
+    struct io_uring_params p;
+    unsigned int i;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if(r->fd < 0)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_len = r->cq_len = MAX(r->sq_len, r->cq_len);
+    r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    exit_if(r->sq_ring == MAP_FAILED, errno);
+    r->cq_ring = r->sq_ring;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd,
+                          IORING_OFF_CQ_RING);
+        exit_if(r->cq_ring == MAP_FAILED, errno);
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    exit_if(r->sqes == MAP_FAILED, errno);
+
+    r->sq_head = (unsigned int*)((char*)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned int*)((char*)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned int*)((char*)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int*)((char*)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned int*)((char*)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned int*)((char*)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned int*)((char*)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cq_ring + p.cq_off.cqes);
+
+    r->buf = malloc((size_t)URING_DEPTH * URING_CHUNK);
+    exit_if(!r->buf, ENOMEM);
+    for(i = 0; i < URING_DEPTH; i++)
+        r->free_slot[i] = i;
+    r->nfree = URING_DEPTH;
+    r->to_submit = 0;
+    r->reaping = 0;
+    pthread_cond_init(&r->reaped, NULL);
+    return 0;
+}
+
+/* Hands the kernel the reads queued since the last call, waiting for at
+ * least 'min' to complete. Returns how many it took, or -1. */
+static int uring_submit (struct uring* r, unsigned int n, unsigned int min) {
+    int result;
+
+    do {
+        result = uring_enter(r->fd, n, min);
+    } while(result < 0 && errno == EINTR);
+    exit_if(result < 0, errno);
+    return result;
+}
+
+/* Waits (with bio->lock held) until some read completes, then frees the
+ * chunks of all that have, taking each off its caller's count. One thread
+ * at a time waits on the ring, with the lock dropped so others can queue
+ * reads meanwhile; the rest wait for it to be done. */
+static void uring_reap (struct block_io* bio) {
+    struct uring* r = &bio->ring;
+    unsigned int head, tail, slot, n;
+
+    if(r->reaping) {
+        pthread_cond_wait(&r->reaped, &bio->lock);
+        return;
+    }
+    r->reaping = 1;
+    n = r->to_submit;
+    r->to_submit = 0;
+    pthread_mutex_unlock(&bio->lock);
+    n -= MIN((unsigned int)uring_submit(r, n, 1), n);
+    pthread_mutex_lock(&bio->lock);
+    r->to_submit += n;
+
+    // Failed or short reads don't matter: it's all only read ahead
+    head = *r->cq_head;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++) {
+        slot = r->cqes[head & *r->cq_mask].user_data;
+        (*r->owner[slot])--;
+        r->free_slot[r->nfree++] = slot;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    r->reaping = 0;
+    pthread_cond_broadcast(&r->reaped);
+}
+
+/* Reads the range a chunk at a time, as soon as a chunk is free, and
+ * starts the reads off without waiting for them */
+static void uring_queue (struct block_io* bio, size_t off, size_t len,
+                         unsigned int* pending) {
+    struct uring* r = &bio->ring;
+    struct io_uring_sqe* sqe;
+    unsigned int tail, slot;
+    size_t n;
+
+    pthread_mutex_lock(&bio->lock);
+    for(; len; off += n, len -= n) {
+        n = MIN(len, URING_CHUNK);
+        while(!r->nfree)
+            uring_reap(bio);
+        slot = r->free_slot[--r->nfree];
+        r->owner[slot] = pending;
+        (*pending)++;
+        r->iov[slot].iov_base = r->buf + (size_t)slot * URING_CHUNK;
+        r->iov[slot].iov_len = n;
+
+        tail = *r->sq_tail;
+        sqe = &r->sqes[tail & *r->sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = bio->fd;
+        sqe->addr = (unsigned long)&r->iov[slot];
+        sqe->len = 1;
+        sqe->off = off;
+        sqe->user_data = slot;
+        r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+        __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        r->to_submit++;
+    }
+    if(r->to_submit)
+        r->to_submit -= MIN((unsigned int)uring_submit(r, r->to_submit, 0),
+                            r->to_submit);
+    pthread_mutex_unlock(&bio->lock);
+}
+
+static void uring_finish (struct block_io* bio, unsigned int* pending) {
+    pthread_mutex_lock(&bio->lock);
+    while(*pending)
+        uring_reap(bio);
+    pthread_mutex_unlock(&bio->lock);
+}
+
+static void uring_teardown (struct block_io* bio) {
+    struct uring* r = &bio->ring;
+
+    munmap(r->sqes, r->sqes_len);
+    if(r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_len);
+    munmap(r->sq_ring, r->sq_len);
+    close(r->fd);
+    free(r->buf);
+    pthread_cond_destroy(&r->reaped);
+}
+
+/////////////////////////////////////////
+// CHOOSING & USING A BACKEND
+/////////////////////////////////////////
+
+// In order of preference
+static const struct block_io_ops backends[] = {
+    { "io_uring", uring_setup, uring_queue, uring_finish, uring_teardown },
+    { "mmap", mmap_setup, mmap_queue, mmap_finish, mmap_teardown },
+};
+
+/* Sets up the backend called 'name' (NULL: io_uring if the kernel has
+ * it, else mmap) for the image file 'fd', mapped at 'disk' */
+struct block_io* block_io_open (const char* name, unsigned char* disk,
+                                int fd) {
+    struct block_io* bio = calloc(1, sizeof(*bio));
+    struct stat st;
+    unsigned int i;
+
+    exit_if(!bio, ENOMEM);
+    exit_if(fstat(fd, &st) < 0, errno);
+    bio->disk = disk;
+    bio->fd = fd;
+    bio->len = st.st_size;
+    pthread_mutex_init(&bio->lock, NULL);
+
+    for(i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if(name && strcmp(name, backends[i].name))
+            continue;
+        if(!backends[i].setup(bio)) {
+            bio->ops = &backends[i];
+            return bio;
+        }
+    }
+    pthread_mutex_destroy(&bio->lock);
+    free(bio);
+    return NULL;
+}
+
+// Returns the name of the backend 'bio' is
+const char* block_io_name (struct block_io* bio) {
+    return bio->ops->name;
+}
+
+/* Brings the blocks of the 'n' runs at 'runs' into memory. Pages already
+ * there (as mincore() tells) are skipped, so warm blocks cost nothing.
+ * Threads fetching at once share the backend's queue, so their reads are
+ * in flight together. */
+void block_io_fetch (struct block_io* bio, const struct block_run* runs,
+                     unsigned int n) {
+    size_t page = sysconf(_SC_PAGESIZE), start, end, off, stop, i, j;
+    unsigned char vec[MINCORE_PAGES];
+    unsigned int k, pending = 0;
+
+    for(k = 0; k < n; k++) {
+        if(!runs[k].count)
+            continue;
+        start = (size_t)runs[k].first * EXT2_BLOCK_SIZE & ~(page - 1);
+        end = MIN((size_t)(runs[k].first + runs[k].count) * EXT2_BLOCK_SIZE,
+                  bio->len);
+
+        // Queues each stretch of pages not yet in memory
+        for(off = start; off < end; off = stop) {
+            stop = MIN(end, off + MINCORE_PAGES * page);
+            if(mincore(bio->disk + off, stop - off, vec) < 0) {
+                bio->ops->queue(bio, off, stop - off, &pending);
+                continue;
+            }
+            for(i = 0; off + i * page < stop; i = j) {
+                for(j = i; off + j * page < stop &&
+                    !(vec[j] & 1) == !(vec[i] & 1); )
+                    j++;
+                if(!(vec[i] & 1))
+                    bio->ops->queue(bio, off + i * page,
+                                    MIN(stop, off + j * page) -
+                                    (off + i * page), &pending);
+            }
+        }
+    }
+    bio->ops->finish(bio, &pending);
+}
+
+// Tears down what block_io_open() set up
+void block_io_close (struct block_io* bio) {
+    bio->ops->teardown(bio);
+    pthread_mutex_destroy(&bio->lock);
+    free(bio);
+}
@@ -0,0 +1,47 @@
+#ifndef EXT2_BLOCKIO_H
+#define EXT2_BLOCKIO_H
+
+#include <stddef.h>
+#include "ext2.h"
+
+/////////////////////////////////////////
+// BLOCK I/O BACKENDS
+/////////////////////////////////////////
+
+// A run of 'count' image blocks, from block 'first' on
+struct block_run {
+    unsigned int first, count;
+};
+
+/* How an open image's cold blocks are brought in (private to
+ * ext2_blockio.c). The image is always read through its mapping, so
+ * bnum_to_block() stays a plain pointer into it; a backend only decides
+ * how blocks about to be read get from the file into memory:
+ *   "mmap"      the mapping faults them in, with the kernel asked to read
+ *               each run ahead (madvise(MADV_WILLNEED))
+ *   "io_uring"  they're read into the page cache behind the mapping by
+ *               reads submitted in batches to an io_uring and waited for,
+ *               many in flight at once
+ */
+struct block_io;
+
+/* Sets up the backend called 'name' (NULL: io_uring if the kernel has
+ * it, else mmap) for the image file 'fd', mapped at 'disk'. Returns NULL
+ * if there's no such backend or it can't be set up. */
+struct block_io* block_io_open (const char* name, unsigned char* disk,
+                                int fd);
+
+// Returns the name of the backend 'bio' is
+const char* block_io_name (struct block_io* bio);
+
+/* Brings the blocks of the 'n' runs at 'runs' into memory, so reading
+ * them through the mapping doesn't wait on the disk a block at a time.
+ * Only a hint: blocks it fails to read are faulted in as usual. Safe to
+ * call from several threads at once. */
+void block_io_fetch (struct block_io* bio, const struct block_run* runs,
+                     unsigned int n);
+
+// Tears down what block_io_open() set up
+void block_io_close (struct block_io* bio);
+
+#endif
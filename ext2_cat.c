@@ -0,0 +1,87 @@
+/*
+ * ============================================================================================
+ * File Name : ext2_cat.c
+ * Description  : This program takes two or three command line arguments.
+ *                The first is the name of an ext2 formatted virtual disk, and the second
+ *                is an absolute path to a file on that disk. The program works like cat,
+ *                writing the file's contents to standard output, or with a third argument,
+ *                to that path on your native file system (created, or truncated).
+ *                --offset N starts N bytes into the file, and --length N stops after
+ *                N bytes. --io mmap|io_uring picks how the file's blocks are read in
+ *                (io_uring where the kernel has it, by default). If the file does not
+ *                exist or is a directory, then your program should return the
+ *                appropriate error.
+ * ============================================================================================
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2_utils.h"
+#include "ext2_ops.h"
+
+unsigned char *disk;
+
+static void usage (void) {
+    fprintf(stderr, "Usage: ext2_cat [--offset <bytes>] [--length <bytes>] "
+                    "<image file name> <absolute path on the disk> "
+                    "[<path on native file system>]\n");
+    exit(1);
+}
+
+// Returns the byte count in 'arg', exiting with the usage if it isn't one
+static unsigned long parse_bytes (char* arg) {
+    char* end;
+    unsigned long n = strtoul(arg, &end, 10);
+
+    if(!*arg || *end)
+        usage();
+    return n;
+}
+
+int main(int argc, char **argv) {
+    static struct option longopts[] = {
+        { "offset", required_argument, NULL, 'o' },
+        { "length", required_argument, NULL, 'l' },
+        { "io", required_argument, NULL, 'I' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned long off = 0, len = (unsigned long)-1;
+    int opt, out_fd = STDOUT_FILENO;
+    char* io = NULL;
+
+    while((opt = getopt_long(argc, argv, "o:l:I:", longopts, NULL)) != -1) {
+        if(opt == 'o')
+            off = parse_bytes(optarg);
+        else if(opt == 'l')
+            len = parse_bytes(optarg);
+        else if(opt == 'I')
+            io = optarg;
+        else
+            usage();
+    }
+    if(argc - optind != 2 && argc - optind != 3)
+        usage();
+    disk = open_image(argv[optind], O_RDONLY);
+    exit_if(io && set_block_io(disk, io) < 0, EINVAL);
+
+    char* v_path = copy_arg(argv[optind + 1]);
+    if(argc - optind == 3) {
+        out_fd = open(argv[optind + 2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        exit_if(out_fd < 0, errno);
+    }
+
+    // Writes the file out, unless the path is bad
+    int err = do_cat(disk, v_path, off, len, out_fd);
+    exit_if(err, err);
+
+    if(out_fd != STDOUT_FILENO)
+        exit_if(close(out_fd) < 0, errno);
+    return 0;
+}
@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "ext2_utils.h"
+#include "ext2_check.h"
+
+// What a group's checks have to say, gathered until the phase is over
+struct group_log {
+    FILE* f;
+    char* buf;
+    size_t len;
+};
+
+// What the checking threads share
+struct check_state {
+    unsigned char* disk;
+    int repair;
+    unsigned int groups;
+    unsigned int first_ino;
+    unsigned int lost_found;    // Inode of /lost+found, 0 if unusable
+
+    /* Rebuilt bitmaps: a bit per block from s_first_data_block on, and
+     * a bit per inode from inode 1 on (so each group's start on a byte) */
+    unsigned char* block_map;
+    unsigned char* inode_map;
+    unsigned int* links;        // Directory entries naming each inode
+    unsigned char* named;       // A bit per inode: named other than "." / ".."
+    unsigned int* dirs;         // Directories in each group
+    struct group_log* logs;     // One per group
+
+    unsigned int next_group;    // Next group for a thread to take
+    unsigned long problems;
+    unsigned long fixed;
+    unsigned long free_blocks;
+    unsigned long free_inodes;
+    int broken;                 // The group layout can't be trusted
+};
+
+// A phase of the check, run on one group at a time
+typedef void (*group_fn) (struct check_state* st, unsigned int g);
+
+struct check_thread {
+    struct check_state* st;
+    group_fn fn;
+};
+
+/////////////////////////////////////////
+// REPORTING
+/////////////////////////////////////////
+
+/* Records a problem found in group 'g', and whether it was 'fixed'. Only
+ * the thread checking 'g' writes to its log, so no locking is needed. */
+static void note (struct check_state* st, unsigned int g, int fixed,
+                  const char* fmt, ...) {
+    struct group_log* log = &st->logs[g];
+    va_list ap;
+
+    if(!log->f) {
+        log->f = open_memstream(&log->buf, &log->len);
+        exit_if(!log->f, ENOMEM);
+    }
+    va_start(ap, fmt);
+    vfprintf(log->f, fmt, ap);
+    va_end(ap);
+    fputs(fixed ? " (fixed)\n" : "\n", log->f);
+
+    __atomic_fetch_add(&st->problems, 1, __ATOMIC_RELAXED);
+    if(fixed)
+        __atomic_fetch_add(&st->fixed, 1, __ATOMIC_RELAXED);
+}
+
+// Writes out what each group's log gathered, in group order
+static void flush_logs (struct check_state* st, FILE* out) {
+    unsigned int g;
+
+    for(g = 0; g < st->groups; g++) {
+        if(!st->logs[g].f)
+            continue;
+        fclose(st->logs[g].f);
+        fwrite(st->logs[g].buf, 1, st->logs[g].len, out);
+        free(st->logs[g].buf);
+        memset(&st->logs[g], 0, sizeof(st->logs[g]));
+    }
+    fflush(out);
+}
+
+/////////////////////////////////////////
+// RUNNING A PHASE ON EVERY GROUP
+/////////////////////////////////////////
+
+// Runs the phase on whichever group is next, until none are left
+static void* check_worker (void* arg) {
+    struct check_thread* self = arg;
+    unsigned int g;
+
+    while((g = __atomic_fetch_add(&self->st->next_group, 1, __ATOMIC_RELAXED))
+          < self->st->groups)
+        self->fn(self->st, g);
+    return NULL;
+}
+
+// Runs 'fn' on every group with 'nthreads' threads, then prints its logs
+static void run_phase (struct check_state* st, group_fn fn, int nthreads,
+                       FILE* out) {
+    struct check_thread self = { .st = st, .fn = fn };
+    pthread_t* tids = calloc(nthreads, sizeof(*tids));
+    int i;
+
+    exit_if(!tids, ENOMEM);
+    st->next_group = 0;
+
+    // This thread takes part as well
+    for(i = 1; i < nthreads; i++)
+        exit_if(pthread_create(&tids[i], NULL, check_worker, &self), EAGAIN);
+    check_worker(&self);
+    for(i = 1; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    flush_logs(st, out);
+}
+
+/////////////////////////////////////////
+// CLAIMING BLOCKS
+/////////////////////////////////////////
+
+// Returns whether 'bnum' is a block of the filesystem
+static int valid_block (struct check_state* st, unsigned int bnum) {
+    struct ext2_super_block* sb = get_sb(st->disk);
+
+    return bnum >= sb->s_first_data_block && bnum < sb->s_blocks_count;
+}
+
+/* Marks 'bnum' as used in the rebuilt bitmap. Returns 0 if something
+ * had claimed it already. */
+static int claim_block (struct check_state* st, unsigned int bnum) {
+    unsigned int bit = bnum - get_sb(st->disk)->s_first_data_block;
+    unsigned char mask = 1 << (bit % 8);
+
+    return !(__atomic_fetch_or(&st->block_map[bit / 8], mask,
+                               __ATOMIC_RELAXED) & mask);
+}
+
+// Returns whether group 'g' holds a copy of the superblock & descriptors
+static int has_super (unsigned char* disk, unsigned int g) {
+    unsigned int p;
+
+    if(g <= 1 || !(get_sb(disk)->s_feature_ro_compat &
+                   EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return 1;
+    for(p = 3; p <= 7; p += 2) {    // Powers of 3, 5 and 7
+        unsigned long n = p;
+        while(n < g)
+            n *= p;
+        if(n == g)
+            return 1;
+    }
+    return 0;
+}
+
+/* Claims the 'count' blocks of group metadata ('what') at 'first' for
+ * group 'g' */
+static void claim_meta (struct check_state* st, unsigned int g,
+                        unsigned int first, unsigned int count,
+                        const char* what) {
+    unsigned int b;
+
+    if(!valid_block(st, first) || !valid_block(st, first + count - 1)) {
+        note(st, g, 0, "Group %u: %s at block %u is out of range", g,
+             what, first);
+        st->broken = 1;
+        return;
+    }
+    for(b = first; b < first + count; b++)
+        if(!claim_block(st, b))
+            note(st, g, 0, "Group %u: block %u of its %s is claimed twice",
+                 g, b, what);
+}
+
+// Claims group g's superblock, descriptors, bitmaps and inode table
+static void check_layout (struct check_state* st, unsigned int g) {
+    struct ext2_super_block* sb = get_sb(st->disk);
+    struct ext2_group_desc* gd = get_gd(st->disk) + g;
+    unsigned int bs = EXT2_BLOCK_SIZE;
+    unsigned int gdt_blocks = (st->groups * sizeof(*gd) + bs - 1) / bs;
+    unsigned int itb_blocks = (sb->s_inodes_per_group * EXT2_INODE_SIZE(sb)
+                               + bs - 1) / bs;
+
+    if(has_super(st->disk, g)) {
+        if(sb->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO)
+            gdt_blocks += sb->s_reserved_gdt_blocks;
+        claim_meta(st, g, sb->s_first_data_block + g * sb->s_blocks_per_group,
+                   1 + gdt_blocks, "superblock & descriptors");
+    }
+    claim_meta(st, g, gd->bg_block_bitmap, 1, "block bitmap");
+    claim_meta(st, g, gd->bg_inode_bitmap, 1, "inode bitmap");
+    claim_meta(st, g, gd->bg_inode_table, itb_blocks, "inode table");
+}
+
+/////////////////////////////////////////
+// INODES
+/////////////////////////////////////////
+
+// One inode's walk over its block map
+struct inode_walk {
+    struct check_state* st;
+    unsigned int g;
+    unsigned int inum;
+    unsigned long count;        // Blocks it holds, indirect ones included
+    int shared;                 // Whether any were claimed twice
+};
+
+/* Claims the block in '*slot' (and with 'level' > 0, the blocks the
+ * indirect block there maps). Pointers off the end of the disk are
+ * cleared when repairing. */
+static void walk_slot (struct inode_walk* w, unsigned int* slot, int level) {
+    struct check_state* st = w->st;
+    unsigned int* ptrs;
+    unsigned int i;
+
+    if(!valid_block(st, *slot)) {
+        note(st, w->g, st->repair, "Inode %u: block %u is out of range",
+             w->inum, *slot);
+        if(st->repair) {
+            *slot = 0;
+            mark_dirty(st->disk, slot, sizeof(*slot));
+        }
+        return;
+    }
+    w->count++;
+    if(!claim_block(st, *slot)) {
+        note(st, w->g, 0, "Inode %u: block %u is claimed twice", w->inum,
+             *slot);
+        w->shared = 1;
+        return;     // What it maps has been claimed through the other owner
+    }
+    if(!level)
+        return;
+
+    ptrs = (unsigned int*)bnum_to_block(*slot, st->disk);
+    for(i = 0; i < EXT2_BLOCK_SIZE / sizeof(*ptrs); i++)
+        if(ptrs[i])
+            walk_slot(w, &ptrs[i], level - 1);
+}
+
+// Claims every block of inode 'inum', and checks its block count
+static void check_blocks (struct check_state* st, unsigned int g,
+                          unsigned int inum, struct ext2_inode* inode) {
+    struct inode_walk w = { .st = st, .g = g, .inum = inum };
+    unsigned int sectors;
+    int i;
+
+    if(has_blocks(inode))
+        for(i = 0; i < EXT2_INODE_PTR_LEN; i++)
+            if(inode->i_block[i])
+                walk_slot(&w, &inode->i_block[i],
+                          (i < EXT2_IND_BLOCK) ? 0 : i - EXT2_IND_BLOCK + 1);
+    if(inode->i_file_acl)   // Extended attribute block
+        walk_slot(&w, &inode->i_file_acl, 0);
+
+    sectors = w.count * (EXT2_BLOCK_SIZE / 512);
+    if(!w.shared && inode->i_blocks != sectors) {
+        note(st, g, st->repair, "Inode %u: i_blocks is %u, should be %u",
+             inum, inode->i_blocks, sectors);
+        if(st->repair) {
+            inode->i_blocks = sectors;
+            mark_dirty(st->disk, inode, sizeof(*inode));
+        }
+    }
+}
+
+/* Finds group g's inodes in use (those with links, and the reserved
+ * ones) and claims their blocks */
+static void check_inodes (struct check_state* st, unsigned int g) {
+    unsigned int ipg = get_sb(st->disk)->s_inodes_per_group;
+    unsigned int i, inum;
+    struct ext2_inode* inode;
+
+    for(i = 0; i < ipg; i++) {
+        inum = g * ipg + i + 1;
+        inode = inum_to_inode(inum, st->disk);
+        if(inum >= st->first_ino && !inode->i_links_count)
+            continue;
+        st->inode_map[(inum - 1) / 8] |= 1 << ((inum - 1) % 8);
+
+        if((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR)
+            st->dirs[g]++;
+        if(inum == EXT2_RESIZE_INO) {
+            // Its other blocks are the reserved descriptors, claimed above
+            if(inode->i_block[EXT2_DIND_BLOCK]) {
+                struct inode_walk w = { .st = st, .g = g, .inum = inum };
+                walk_slot(&w, &inode->i_block[EXT2_DIND_BLOCK], 0);
+            }
+        } else if(inum >= st->first_ino || inode->i_mode ||
+                  inum == EXT2_BAD_INO)
+            check_blocks(st, g, inum, inode);
+    }
+}
+
+/////////////////////////////////////////
+// DIRECTORIES
+/////////////////////////////////////////
+
+// Returns whether some directory entry other than "." or ".." names 'inum'
+static int is_named (struct check_state* st, unsigned int inum) {
+    return (st->named[inum / 8] >> (inum % 8)) & 1;
+}
+
+// Returns whether inode 'inum' was found to be in use
+static int in_use (struct check_state* st, unsigned int inum) {
+    return inum && inum <= get_sb(st->disk)->s_inodes_count &&
+           ((st->inode_map[(inum - 1) / 8] >> ((inum - 1) % 8)) & 1);
+}
+
+/* Counts the links in block 'bnum' of directory 'dir'. Entries naming
+ * unused inodes are cleared when repairing. */
+static void scan_dir_block (struct check_state* st, unsigned int g,
+                            unsigned int dir, unsigned int bnum) {
+    unsigned char* block = bnum_to_block(bnum, st->disk);
+    struct ext2_dir_entry_2* d_entry;
+    unsigned int off;
+
+    for(off = 0; off < EXT2_BLOCK_SIZE; off += d_entry->rec_len) {
+        d_entry = (struct ext2_dir_entry_2*)(block + off);
+        if(d_entry->rec_len < 8 || d_entry->rec_len % 4 ||
+            off + d_entry->rec_len > EXT2_BLOCK_SIZE ||
+            (d_entry->inode && 8 + d_entry->name_len > d_entry->rec_len)) {
+            note(st, g, 0, "Directory inode %u: block %u is corrupt at "
+                           "offset %u", dir, bnum, off);
+            return;
+        }
+        if(!d_entry->inode)
+            continue;
+        if(!in_use(st, d_entry->inode)) {
+            note(st, g, st->repair, "Directory inode %u: entry '%.*s' names "
+                 "unused inode %u", dir, d_entry->name_len, d_entry->name,
+                 d_entry->inode);
+            if(st->repair) {
+                d_entry->inode = 0;
+                mark_dirty(st->disk, d_entry, sizeof(*d_entry));
+            }
+            continue;
+        }
+        __atomic_fetch_add(&st->links[d_entry->inode], 1, __ATOMIC_RELAXED);
+        if(!(d_entry->name[0] == '.' && (d_entry->name_len == 1 ||
+            (d_entry->name_len == 2 && d_entry->name[1] == '.'))))
+            __atomic_fetch_or(&st->named[d_entry->inode / 8],
+                              1 << (d_entry->inode % 8), __ATOMIC_RELAXED);
+    }
+}
+
+// Scans every directory block reached through the pointer 'bnum'
+static void scan_dir_slot (struct check_state* st, unsigned int g,
+                           unsigned int dir, unsigned int bnum, int level) {
+    unsigned int* ptrs;
+    unsigned int i;
+
+    if(!valid_block(st, bnum))
+        return;     // Reported when the blocks were claimed
+    if(!level) {
+        scan_dir_block(st, g, dir, bnum);
+        return;
+    }
+    ptrs = (unsigned int*)bnum_to_block(bnum, st->disk);
+    for(i = 0; i < EXT2_BLOCK_SIZE / sizeof(*ptrs); i++)
+        if(ptrs[i])
+            scan_dir_slot(st, g, dir, ptrs[i], level - 1);
+}
+
+// Counts the links held by the entries of group g's directories
+static void check_dirs (struct check_state* st, unsigned int g) {
+    unsigned int ipg = get_sb(st->disk)->s_inodes_per_group;
+    unsigned int i, inum;
+    struct ext2_inode* inode;
+    int b;
+
+    for(i = 0; i < ipg; i++) {
+        inum = g * ipg + i + 1;
+        inode = inum_to_inode(inum, st->disk);
+        if(!in_use(st, inum) ||
+            (inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR)
+            continue;
+        for(b = 0; b < EXT2_INODE_PTR_LEN; b++)
+            if(inode->i_block[b])
+                scan_dir_slot(st, g, inum, inode->i_block[b],
+                              (b < EXT2_IND_BLOCK) ? 0 : b - EXT2_IND_BLOCK + 1);
+    }
+}
+
+/* Links the unreferenced inode 'inum' into /lost+found as "#inum", in a
+ * block it already has (nothing is allocated, as the bitmaps aren't
+ * trusted yet). Returns 0 if there was no room. */
+static int link_lost (struct check_state* st, unsigned int inum,
+                      struct ext2_inode* inode) {
+    struct ext2_inode* lf = inum_to_inode(st->lost_found, st->disk);
+    int is_dir = (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+    unsigned char type = is_dir ? EXT2_FT_DIR :
+        ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK) ? EXT2_FT_SYMLINK :
+        EXT2_FT_REG_FILE;
+    struct ext2_dir_entry_2* dotdot;
+    unsigned long lblk, nblocks = lf->i_size / EXT2_BLOCK_SIZE;
+    unsigned int bnum;
+    char name[16];
+    int len = snprintf(name, sizeof(name), "#%u", inum);
+
+    for(lblk = 0; lblk < nblocks; lblk++) {
+        bnum = lblk_to_bnum(st->disk, lf, lblk);
+        if(bnum && add_entr_to_block(st->disk, bnum_to_block(bnum, st->disk),
+                                     inum, name, len, type))
+            break;
+    }
+    if(lblk == nblocks)
+        return 0;
+    st->links[inum]++;
+    st->named[inum / 8] |= 1 << (inum % 8);
+
+    // A directory's ".." now leads to /lost+found
+    if(is_dir && (bnum = lblk_to_bnum(st->disk, inode, 0)) &&
+        (dotdot = find_in_dir_block(bnum_to_block(bnum, st->disk), "..", 2))) {
+        if(in_use(st, dotdot->inode))
+            st->links[dotdot->inode]--;
+        dotdot->inode = st->lost_found;
+        mark_dirty(st->disk, dotdot, sizeof(*dotdot));
+        st->links[st->lost_found]++;
+    }
+    return 1;
+}
+
+/* Finds the inodes in use that no directory entry names, and links them
+ * into /lost+found when repairing. Runs on one thread, after the links
+ * have been counted. */
+static void check_orphans (struct check_state* st) {
+    unsigned int inum, count = get_sb(st->disk)->s_inodes_count;
+    struct ext2_inode* inode;
+    int fixed;
+
+    for(inum = st->first_ino; inum <= count; inum++) {
+        if(!in_use(st, inum) || is_named(st, inum))
+            continue;
+        inode = inum_to_inode(inum, st->disk);
+        fixed = st->repair && st->lost_found && link_lost(st, inum, inode);
+        note(st, inum_to_group(inum, st->disk), fixed,
+             "Inode %u: in use, but no directory entry names it%s", inum,
+             (st->repair && !fixed) ? " (no room in /lost+found)" : "");
+    }
+}
+
+/////////////////////////////////////////
+// LINK COUNTS, BITMAPS & COUNTERS
+/////////////////////////////////////////
+
+/* Compares the 'nbits'-bit bitmap on the disk at 'bmap' with the rebuilt
+ * one at 'want' (both starting on a byte), and copies it over when
+ * repairing. Returns how many bits 'want' has set. */
+static unsigned int check_bitmap (struct check_state* st, unsigned int g,
+                                  const char* what, unsigned char* bmap,
+                                  const unsigned char* want,
+                                  unsigned int nbits) {
+    unsigned int i, used = 0, missing = 0, extra = 0;
+    unsigned char mask;
+
+    for(i = 0; i < (nbits + 7) / 8; i++) {
+        mask = (i < nbits / 8) ? 0xFF : (1 << (nbits % 8)) - 1;
+        used += __builtin_popcount(want[i] & mask);
+        missing += __builtin_popcount(want[i] & ~bmap[i] & mask);
+        extra += __builtin_popcount(bmap[i] & ~want[i] & mask);
+    }
+    if(missing)
+        note(st, g, st->repair, "Group %u: %u %s in use marked free in the "
+             "bitmap", g, missing, what);
+    if(extra)
+        note(st, g, st->repair, "Group %u: %u unused %s marked in use in the"
+             " bitmap", g, extra, what);
+    if((missing || extra) && st->repair) {
+        memcpy(bmap, want, nbits / 8);
+        if(nbits % 8) {     // Keeps the padding past the group's end
+            mask = (1 << (nbits % 8)) - 1;
+            bmap[nbits / 8] = (bmap[nbits / 8] & ~mask) | (want[nbits / 8] & mask);
+        }
+        mark_dirty(st->disk, bmap, (nbits + 7) / 8);
+    }
+    return used;
+}
+
+// Compares a group counter ('what') with the value it should have
+static void check_counter (struct check_state* st, unsigned int g,
+                           const char* what, unsigned short* counter,
+                           unsigned int want) {
+    if(*counter == want)
+        return;
+    note(st, g, st->repair, "Group %u: %s count is %u, should be %u", g,
+         what, *counter, want);
+    if(st->repair) {
+        *counter = want;
+        mark_dirty(st->disk, counter, sizeof(*counter));
+    }
+}
+
+/* Checks the link counts of group g's inodes, then its bitmaps and
+ * counters against the rebuilt ones */
+static void check_group (struct check_state* st, unsigned int g) {
+    struct ext2_super_block* sb = get_sb(st->disk);
+    struct ext2_group_desc* gd = get_gd(st->disk) + g;
+    unsigned int ipg = sb->s_inodes_per_group, bpg = sb->s_blocks_per_group;
+    unsigned int i, inum, nblocks = group_blocks_count(g, st->disk);
+    unsigned int used_inodes, used_blocks;
+    struct ext2_inode* inode;
+
+    for(i = 0; i < ipg; i++) {
+        inum = g * ipg + i + 1;
+        if(!in_use(st, inum) ||
+            (inum < st->first_ino ? inum != EXT2_ROOT_INO : !is_named(st, inum)))
+            continue;
+        inode = inum_to_inode(inum, st->disk);
+        if(inode->i_links_count == st->links[inum])
+            continue;
+        note(st, g, st->repair, "Inode %u: link count is %u, should be %u",
+             inum, inode->i_links_count, st->links[inum]);
+        if(st->repair) {
+            inode->i_links_count = st->links[inum];
+            mark_dirty(st->disk, inode, sizeof(*inode));
+        }
+    }
+
+    used_inodes = check_bitmap(st, g, "inodes",
+                               bnum_to_block(gd->bg_inode_bitmap, st->disk),
+                               st->inode_map + g * ipg / 8, ipg);
+    used_blocks = check_bitmap(st, g, "blocks",
+                               bnum_to_block(gd->bg_block_bitmap, st->disk),
+                               st->block_map + g * bpg / 8, nblocks);
+    check_counter(st, g, "free inodes", &gd->bg_free_inodes_count,
+                  ipg - used_inodes);
+    check_counter(st, g, "free blocks", &gd->bg_free_blocks_count,
+                  nblocks - used_blocks);
+    check_counter(st, g, "directories", &gd->bg_used_dirs_count, st->dirs[g]);
+
+    __atomic_fetch_add(&st->free_inodes, ipg - used_inodes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->free_blocks, nblocks - used_blocks,
+                       __ATOMIC_RELAXED);
+}
+
+/////////////////////////////////////////
+// THE WHOLE CHECK
+/////////////////////////////////////////
+
+/* Checks the image mapped at 'disk' against what its inode table and
+ * directory tree say it should hold: the block and inode bitmaps, every
+ * inode's link count and block count, and the free block, free inode and
+ * directory counters of each group and the superblock. The checks run a
+ * group at a time on 'nthreads' threads, and what they find is written to
+ * 'out' in group order. With 'repair' set (the image must be writable),
+ * what can be rebuilt is fixed in the mapping. */
+struct check_result check_image (unsigned char* disk, int nthreads,
+                                 int repair, FILE* out) {
+    struct ext2_super_block* sb = get_sb(disk);
+    struct check_state st = { .disk = disk, .repair = repair };
+    struct check_result result;
+    struct ext2_dir_entry_2* lf;
+
+    nthreads = MAX(nthreads, 1);
+    st.groups = get_groups_count(disk);
+    st.first_ino = (sb->s_rev_level == EXT2_GOOD_OLD_REV) ?
+                   EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+    // Rounded up to whole groups, so every group's bits can be compared
+    st.block_map = calloc(st.groups, sb->s_blocks_per_group / 8);
+    st.inode_map = calloc(st.groups, sb->s_inodes_per_group / 8);
+    st.links = calloc(sb->s_inodes_count + 1, sizeof(*st.links));
+    st.named = calloc(sb->s_inodes_count / 8 + 1, 1);
+    st.dirs = calloc(st.groups, sizeof(*st.dirs));
+    st.logs = calloc(st.groups, sizeof(*st.logs));
+    exit_if(!st.block_map || !st.inode_map || !st.links || !st.named ||
+            !st.dirs || !st.logs, ENOMEM);
+
+    if(sb->s_feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER)
+        fprintf(out, "Warning: the journal needs recovery; checking the "
+                     "image as it is\n");
+
+    // Group metadata first, so a file claiming it is the one reported
+    run_phase(&st, check_layout, nthreads, out);
+    if(!st.broken) {
+        run_phase(&st, check_inodes, nthreads, out);
+        run_phase(&st, check_dirs, nthreads, out);
+
+        lf = lookup_dir_entry(disk, inum_to_inode(EXT2_ROOT_INO, disk),
+                              "lost+found", 10);
+        if(lf && in_use(&st, lf->inode) &&
+            (inum_to_inode(lf->inode, disk)->i_mode & EXT2_S_IFMT) ==
+            EXT2_S_IFDIR &&
+            !(inum_to_inode(lf->inode, disk)->i_flags & EXT2_INDEX_FL))
+            st.lost_found = lf->inode;
+        check_orphans(&st);
+        flush_logs(&st, out);
+
+        run_phase(&st, check_group, nthreads, out);
+        if(sb->s_free_inodes_count != st.free_inodes) {
+            note(&st, 0, repair, "Superblock: free inodes count is %u, "
+                 "should be %lu", sb->s_free_inodes_count, st.free_inodes);
+            if(repair) {
+                sb->s_free_inodes_count = st.free_inodes;
+                mark_dirty(disk, sb, sizeof(*sb));
+            }
+        }
+        if(sb->s_free_blocks_count != st.free_blocks) {
+            note(&st, 0, repair, "Superblock: free blocks count is %u, "
+                 "should be %lu", sb->s_free_blocks_count, st.free_blocks);
+            if(repair) {
+                sb->s_free_blocks_count = st.free_blocks;
+                mark_dirty(disk, sb, sizeof(*sb));
+            }
+        }
+        flush_logs(&st, out);
+    }
+
+    free(st.block_map);
+    free(st.inode_map);
+    free(st.links);
+    free(st.named);
+    free(st.dirs);
+    free(st.logs);
+    result.problems = st.problems;
+    result.fixed = st.fixed;
+    return result;
+}
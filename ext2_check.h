@@ -0,0 +1,31 @@
+#ifndef EXT2_CHECK_H
+#define EXT2_CHECK_H
+
+#include <stdio.h>
+#include "ext2.h"
+
+/////////////////////////////////////////
+// CONSISTENCY CHECKING
+/////////////////////////////////////////
+
+// What check_image() found
+struct check_result {
+    unsigned long problems;     // Inconsistencies found
+    unsigned long fixed;        // ... and of those, repaired
+};
+
+/* Checks the image mapped at 'disk' against what its inode table and
+ * directory tree say it should hold: the block and inode bitmaps, every
+ * inode's link count and block count, and the free block, free inode and
+ * directory counters of each group and the superblock. The checks run a
+ * group at a time on 'nthreads' threads, and what they find is written to
+ * 'out' in group order. With 'repair' set (the image must be writable),
+ * what can be rebuilt is fixed in the mapping: the bitmaps and counters
+ * are rewritten, link and block counts corrected, entries naming unused
+ * inodes cleared, and inodes no directory names linked into /lost+found.
+ * Blocks claimed by two inodes and corrupt directory blocks are only
+ * reported. */
+struct check_result check_image (unsigned char* disk, int nthreads,
+                                 int repair, FILE* out);
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * ============================================================================================
+ * File Name : ext2_compact.c
+ * Description  : This program takes the name of an ext2 formatted virtual disk and an
+ *                absolute path to a directory on it. It repacks the directory's live
+ *                entries densely, so the space left behind by removed entries is gathered
+ *                up, and frees the blocks left empty at its end. An indexed directory has
+ *                its index rebuilt. With -s the entries are sorted by name ("." and ".."
+ *                first), and with -r every directory under the path is compacted too.
+ *                Prints "<blocks before><TAB><blocks after><TAB><path>" for each.
+ * ============================================================================================
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include "ext2_utils.h"
+#include "ext2_ops.h"
+
+unsigned char *disk;
+
+static void usage (void) {
+    fprintf(stderr, "Usage: ext2_compact [-s] [-r] <image file name> "
+                    "<absolute path on the disk>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt, sort = 0, recursive = 0;
+
+    while((opt = getopt(argc, argv, "sr")) != -1) {
+        if(opt == 's')
+            sort = 1;
+        else if(opt == 'r')
+            recursive = 1;
+        else
+            usage();
+    }
+    if(argc - optind != 2)
+        usage();
+    disk = open_image(argv[optind], O_RDWR);
+
+    char* path = copy_arg(argv[optind + 1]);
+    int err = do_compact(disk, path, sort, recursive, stdout);
+    exit_if(err, err);
+
+    // Writes all changes back into the .img file
+    close_image(disk);
+    return 0;
+}
@@ -11,6 +11,9 @@
  *                The program should work like cp, copying the file on your native file system onto 
  *                the specified location on the disk. If the specified file or target location does not exist,
  *                then your program should return the appropriate error (ENOENT)
+ *                With -r, the native path may be a directory, which is copied over with
+ *                everything under it; -j N sets how many threads copy file data
+ *                (one per CPU by default).
  * 
  * Copyright 2015 Seungkyu Kim all rights reserved
  * ============================================================================================
@@ -27,56 +30,41 @@
 #include <errno.h>
 #include <assert.h>
 #include "ext2_utils.h"
+#include "ext2_ops.h"
 
 unsigned char *disk;
 
-int main(int argc, char **argv) {
+static void usage (void) {
+    fprintf(stderr, "Usage: ext2_cp [-r] [-j <threads>] <image file name> "
+        "<absolute path on native file system> "
+        "<absolute path on the virtual disk>\n");
+    exit(1);
+}
 
-    if (argc != 4) {
-        fprintf(stderr, "Usage: ext2_cp <image file name> "
-            "<absolute path on native file system> "
-            "<absolute path on the virtual disk>\n");
-        exit(1);
-    }
-    int fd = open(argv[1], O_RDWR);
+int main(int argc, char **argv) {
+    int opt, recursive = 0, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-	   perror("mmap");
-	   exit(1);
+    while((opt = getopt(argc, argv, "rj:")) != -1) {
+        if(opt == 'r')
+            recursive = 1;
+        else if(opt == 'j')
+            nthreads = atoi(optarg);
+        else
+            usage();
     }
+    if (argc - optind != 3)
+        usage();
+    disk = open_image(argv[optind], O_RDWR);
 
-    char *v_name = copy_arg(argv[3]);
-
-    // ERRORTRAPPING OF INPUT
-
-    FILE *native_fd = fopen(argv[2], "r");
-    exit_if(!native_fd, ENOENT); // File not found in native file system
-
-    struct ext2_inode* cur_dir = find_inode(v_name, disk);
-    exit_if(cur_dir!=NULL, EEXIST);  // File already exists
-
-    struct ext2_inode* p_dir = find_inode(get_pdir_name(v_name), disk);
-    exit_if(!p_dir, ENOENT); // File not found in virtual file system
-
-    ////////////////////////////////////////////
-    
-    // Gets the size of the file
-    fseek(native_fd, 0L, SEEK_END);
-    long int f_size = ftell(native_fd);
-
-    // Allocates inodes & blocks for a new file
-    unsigned int free_inode = alloc_file(disk, f_size, EXT2_S_IFREG);
-    struct ext2_inode* n_inode = inum_to_inode(free_inode, disk);
-
-    // Writes data into allocated blocks
-    fseek(native_fd, 0L, SEEK_SET); 
-    write_file(disk, n_inode, f_size, native_fd);
+    char *v_name = copy_arg(argv[optind + 2]);
 
-    // Creates a new directory entry for the newly copied file.
-    add_dir_entr(disk, p_dir, free_inode, v_name, EXT2_FT_REG_FILE);
+    // Copies the file (or tree) in, unless the paths are bad
+    int err = recursive ? 
+              do_cp_tree(disk, argv[optind + 1], v_name, nthreads) :
+              do_cp(disk, argv[optind + 1], v_name);
+    exit_if(err, err);
 
     // Writes all changes back into the .img file
-    assert(write(fd, disk, EXT2_ADDR_PER_BLOCK * EXT2_BLOCK_SIZE)>0);
+    close_image(disk);
     return 0;
 }
\ No newline at end of file
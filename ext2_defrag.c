@@ -0,0 +1,55 @@
+/*
+ * ============================================================================================
+ * File Name : ext2_defrag.c
+ * Description  : This program takes the name of an ext2 formatted virtual disk and,
+ *                optionally, an absolute path to a regular file on it. It moves the blocks
+ *                of the file (or of every regular file on the disk, if no path is given)
+ *                into as few contiguous runs as the free space allows, each indirect block
+ *                just before the data it maps, so the file can be read back in long
+ *                sequential reads. The data is copied first, and the file only switches
+ *                over to its new blocks once the copy is complete. With -n nothing is
+ *                moved; fragmentation is only measured. Prints "<extents before><TAB>
+ *                <extents after><TAB><path>" for the file, or, for the whole disk, the
+ *                same with the inode number for each file in more than one extent, then
+ *                a line of the totals.
+ * ============================================================================================
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include "ext2_utils.h"
+#include "ext2_ops.h"
+
+unsigned char *disk;
+
+static void usage (void) {
+    fprintf(stderr, "Usage: ext2_defrag [-n] <image file name> "
+                    "[<absolute path on the disk>]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt, measure_only = 0;
+    char* path = NULL;
+
+    while((opt = getopt(argc, argv, "n")) != -1) {
+        if(opt == 'n')
+            measure_only = 1;
+        else
+            usage();
+    }
+    if(argc - optind != 1 && argc - optind != 2)
+        usage();
+    disk = open_image(argv[optind], measure_only ? O_RDONLY : O_RDWR);
+
+    if(argc - optind == 2)
+        path = copy_arg(argv[optind + 1]);
+    int err = do_defrag(disk, path, measure_only, stdout);
+    exit_if(err, err);
+
+    // Writes all changes back into the .img file
+    close_image(disk);
+    return 0;
+}
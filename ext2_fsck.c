@@ -0,0 +1,58 @@
+/*
+ * ============================================================================================
+ * File Name : ext2_fsck.c
+ * Description  : This program takes the name of an ext2 formatted virtual disk, and checks
+ *                its block and inode bitmaps, link counts, block counts and free counters
+ *                against what its inode table and directory tree say they should be.
+ *                Each problem found is printed on its own line. With -y the problems that
+ *                can be are repaired in place (-n, the default, only reports them). -j N
+ *                sets how many threads check the groups (one per CPU by default).
+ *                Exits with 0 if the image is clean, 1 if every problem was repaired,
+ *                and 4 if problems are left, as e2fsck does.
+ * ============================================================================================
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include "ext2_utils.h"
+#include "ext2_check.h"
+
+unsigned char *disk;
+
+static void usage (void) {
+    fprintf(stderr, "Usage: ext2_fsck [-n | -y] [-j <threads>] "
+                    "<image file name>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt, repair = 0, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct check_result result;
+
+    while((opt = getopt(argc, argv, "nyj:")) != -1) {
+        if(opt == 'n')
+            repair = 0;
+        else if(opt == 'y')
+            repair = 1;
+        else if(opt == 'j')
+            nthreads = atoi(optarg);
+        else
+            usage();
+    }
+    if(argc - optind != 1)
+        usage();
+    disk = open_image(argv[optind], repair ? O_RDWR : O_RDONLY);
+
+    result = check_image(disk, nthreads, repair, stdout);
+    close_image(disk);
+
+    if(!result.problems) {
+        printf("%s: clean\n", argv[optind]);
+        return 0;
+    }
+    printf("%s: %lu problem(s) found, %lu repaired\n", argv[optind],
+           result.problems, result.fixed);
+    return (result.fixed == result.problems) ? 1 : 4;
+}
@@ -0,0 +1,662 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2.h"
+#include "ext2_utils.h"
+#include "ext2_htree.h"
+
+/////////////////////////////////////////
+// DIRECTORY HASH FUNCTIONS
+/////////////////////////////////////////
+
+/* These follow the kernel's fs/ext2 & e2fsprogs versions bit for bit,
+ * since other tools have to find our entries by hash and vice versa. */
+
+// The original htree hash, kept for old filesystems
+static unsigned int dx_hack_hash (const char* name, unsigned int len,
+                                  int is_unsigned) {
+    unsigned int hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    int c;
+
+    while(len--) {
+        c = is_unsigned ? (int)(unsigned char)*name : (int)(signed char)*name;
+        name++;
+        hash = hash1 + (hash0 ^ (unsigned int)(c * 7152373));
+        if(hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+/* Packs up to 'num' * 4 bytes of 'msg' into 'num' words, padding with
+ * a pattern derived from the length */
+static void str2hashbuf (const char* msg, int len, unsigned int* buf,
+                         int num, int is_unsigned) {
+    unsigned int pad, val;
+    int i, c;
+
+    pad = (unsigned int)len | ((unsigned int)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    if(len > num * 4)
+        len = num * 4;
+    for(i = 0; i < len; i++) {
+        c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = c + (val << 8);
+        if((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if(--num >= 0)
+        *buf++ = val;
+    while(--num >= 0)
+        *buf++ = pad;
+}
+
+#define ROL32(x, s)     (((x) << (s)) | ((x) >> (32 - (s))))
+
+// MD4's selection, majority and parity functions
+#define F(x, y, z)      ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z)      (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z)      ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s)  (a += f(b, c, d) + (x), a = ROL32(a, s))
+#define K1  0
+#define K2  013240474631U
+#define K3  015666365641U
+
+// A cut-down MD4 transform: three rounds over 8 words of input
+static void half_md4_transform (unsigned int buf[4], const unsigned int in[8]) {
+    unsigned int a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0] + K1,  3);
+    ROUND(F, d, a, b, c, in[1] + K1,  7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1,  3);
+    ROUND(F, d, a, b, c, in[5] + K1,  7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2,  3);
+    ROUND(G, d, a, b, c, in[3] + K2,  5);
+    ROUND(G, c, d, a, b, in[5] + K2,  9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2,  3);
+    ROUND(G, d, a, b, c, in[2] + K2,  5);
+    ROUND(G, c, d, a, b, in[4] + K2,  9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3,  3);
+    ROUND(H, d, a, b, c, in[7] + K3,  9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3,  3);
+    ROUND(H, d, a, b, c, in[5] + K3,  9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// 16 rounds of TEA over 4 words of input
+static void tea_transform (unsigned int buf[4], const unsigned int in[4]) {
+    unsigned int sum = 0, b0 = buf[0], b1 = buf[1];
+    unsigned int a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while(--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/* Computes the directory hash of the 'len' bytes at 'name' with the
+ * given DX_HASH_* algorithm and seed (all zero for the default). Stores
+ * the secondary hash in '*minor_hash' unless it's NULL. */
+unsigned int dx_hash (const char* name, unsigned int len, int version,
+                      const unsigned int seed[4], unsigned int* minor_hash) {
+    unsigned int buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    unsigned int in[8], hash, minor = 0;
+    int i, is_unsigned = (version >= DX_HASH_LEGACY_UNSIGNED);
+    const char *p = name;
+    int left = len;
+
+    for(i = 0; seed && i < 4; i++) {
+        if(seed[i]) {
+            memcpy(buf, seed, sizeof(buf));
+            break;
+        }
+    }
+
+    switch(version) {
+    case DX_HASH_LEGACY:
+    case DX_HASH_LEGACY_UNSIGNED:
+        hash = dx_hack_hash(name, len, is_unsigned);
+        break;
+    case DX_HASH_HALF_MD4:
+    case DX_HASH_HALF_MD4_UNSIGNED:
+        for(; left > 0; left -= 32, p += 32) {
+            str2hashbuf(p, left, in, 8, is_unsigned);
+            half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        minor = buf[2];
+        break;
+    case DX_HASH_TEA:
+    case DX_HASH_TEA_UNSIGNED:
+        for(; left > 0; left -= 16, p += 16) {
+            str2hashbuf(p, left, in, 4, is_unsigned);
+            tea_transform(buf, in);
+        }
+        hash = buf[0];
+        minor = buf[1];
+        break;
+    default:
+        hash = 0;
+    }
+
+    // The low bit is the index's collision flag; the top value means EOF
+    hash &= ~DX_HASH_CONTINUED;
+    if(hash == (0x7fffffffU << 1))
+        hash = (0x7fffffffU - 1) << 1;
+    if(minor_hash)
+        *minor_hash = minor;
+    return hash;
+}
+
+
+/////////////////////////////////////////
+// WALKING THE INDEX
+/////////////////////////////////////////
+
+// One level of the path from the root index down to a leaf
+struct dx_frame {
+    struct dx_entry* entries;   // Start of this level's index array
+    struct dx_entry* at;        // Entry followed down to the next level
+};
+
+// Count & limit, stored in place of the first index entry's hash
+static struct dx_countlimit* dx_cl (struct dx_entry* entries) {
+    return (struct dx_countlimit*)entries;
+}
+
+// How many index entries fit in the root / in a node
+static unsigned int dx_root_limit (void) {
+    return (EXT2_BLOCK_SIZE - DX_ROOT_ENTRIES_OFFSET) / sizeof(struct dx_entry);
+}
+static unsigned int dx_node_limit (void) {
+    return (EXT2_BLOCK_SIZE - DX_NODE_ENTRIES_OFFSET) / sizeof(struct dx_entry);
+}
+
+// Returns the root info of the index whose root entries are 'entries'
+static struct dx_root_info* dx_info (struct dx_entry* entries) {
+    return (struct dx_root_info*)((unsigned char*)entries -
+                                  sizeof(struct dx_root_info));
+}
+
+// Returns the hash of 'name' under the algorithm the index was built with
+static unsigned int dx_name_hash (unsigned char* disk,
+                                  struct dx_root_info* info,
+                                  const char* name, unsigned int len) {
+    struct ext2_super_block *sb = get_sb(disk);
+    int version = info->hash_version;
+
+    // The on-disk version doesn't say how chars were signed when hashing
+    if(version <= DX_HASH_TEA && (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+        version += DX_HASH_LEGACY_UNSIGNED;
+    return dx_hash(name, len, version, sb->s_hash_seed, NULL);
+}
+
+/* Walks the index of 'dir' down towards the leaf for 'hash' (computed
+ * from 'name' and stored), filling in one frame per level. Returns the
+ * number of levels, or 0 if the index is missing or malformed. */
+static int dx_probe (unsigned char* disk, struct ext2_inode* dir,
+                     const char* name, unsigned int len,
+                     unsigned int* hash, struct dx_frame frames[DX_MAX_LEVELS]) {
+    unsigned int bnum = lblk_to_bnum(disk, dir, 0), limit, count, lo, hi, mid;
+    struct dx_root_info *info;
+    struct dx_entry *entries;
+    int level;
+
+    if(!bnum)
+        return 0;
+    info = (struct dx_root_info*)(bnum_to_block(bnum, disk) +
+                                  DX_ROOT_INFO_OFFSET);
+    if(info->reserved_zero || info->info_length != 8 ||
+        info->hash_version > DX_HASH_TEA ||
+        info->indirect_levels >= DX_MAX_LEVELS)
+        return 0;
+
+    *hash = dx_name_hash(disk, info, name, len);
+    entries = (struct dx_entry*)(info + 1);
+    limit = dx_root_limit();
+
+    for(level = 0; ; level++) {
+        count = dx_cl(entries)->count;
+        if(dx_cl(entries)->limit != limit || !count || count > limit)
+            return 0;
+
+        // Binary search for the last entry whose hash is <= 'hash'
+        lo = 1;
+        hi = count - 1;
+        while(lo <= hi) {
+            mid = (lo + hi) / 2;
+            if(entries[mid].hash > *hash)
+                hi = mid - 1;
+            else
+                lo = mid + 1;
+        }
+        frames[level].entries = entries;
+        frames[level].at = entries + lo - 1;
+
+        if(level == info->indirect_levels)
+            return level + 1;
+        bnum = lblk_to_bnum(disk, dir, frames[level].at->block);
+        if(!bnum)
+            return 0;
+        entries = (struct dx_entry*)(bnum_to_block(bnum, disk) +
+                                     DX_NODE_ENTRIES_OFFSET);
+        limit = dx_node_limit();
+    }
+}
+
+/* Looks 'name' up through the index of directory 'dir', reading only the
+ * index blocks on the way and the leaf (or leaves, on hash collisions)
+ * the name hashes to. Stores the entry found (or NULL) in '*res' and
+ * returns 1, or returns 0 if the index is unusable. */
+int dx_lookup (unsigned char* disk, struct ext2_inode* dir,
+               const char* name, unsigned int len,
+               struct ext2_dir_entry_2** res) {
+    struct dx_frame frames[DX_MAX_LEVELS], *frame;
+    struct dx_entry *at, *end;
+    unsigned int hash, bnum;
+    int levels = dx_probe(disk, dir, name, len, &hash, frames);
+
+    if(!levels)
+        return 0;
+    frame = &frames[levels - 1];
+    end = frame->entries + dx_cl(frame->entries)->count;
+
+    /* Entries with this hash may carry on into the following leaves,
+     * whose index hashes then have the continuation bit set */
+    *res = NULL;
+    for(at = frame->at; at < end && !*res; at++) {
+        if(at != frame->at && (at->hash & ~DX_HASH_CONTINUED) != hash)
+            break;
+        if((bnum = lblk_to_bnum(disk, dir, at->block)))
+            *res = find_in_dir_block(bnum_to_block(bnum, disk), name, len);
+    }
+    return 1;
+}
+
+
+/////////////////////////////////////////
+// GROWING THE INDEX
+/////////////////////////////////////////
+
+// Inserts (hash, block) into an index array, just after entry 'at'
+static void dx_insert (unsigned char* disk, struct dx_entry* entries,
+                       struct dx_entry* at, unsigned int hash,
+                       unsigned int block) {
+    struct dx_entry *end = entries + dx_cl(entries)->count;
+
+    memmove(at + 2, at + 1, (end - (at + 1)) * sizeof(struct dx_entry));
+    at[1].hash = hash;
+    at[1].block = block;
+    dx_cl(entries)->count++;
+    mark_dirty(disk, entries, (end + 1 - entries) * sizeof(struct dx_entry));
+}
+
+/* Appends an empty index node to 'dir' holding the 'count' entries at
+ * 'from' (the first one's hash is dropped). Returns its logical block. */
+static unsigned int dx_new_node (unsigned char* disk, struct ext2_inode* dir,
+                                 struct dx_entry* from, unsigned int count) {
+    unsigned int lblk, bnum = dir_append_block(disk, dir, &lblk);
+    struct dx_entry *entries = (struct dx_entry*)(bnum_to_block(bnum, disk) +
+                                                  DX_NODE_ENTRIES_OFFSET);
+
+    // dir_append_block() leaves one empty entry spanning the block
+    memcpy(entries, from, count * sizeof(struct dx_entry));
+    dx_cl(entries)->limit = dx_node_limit();
+    dx_cl(entries)->count = count;
+    mark_dirty(disk, entries, count * sizeof(struct dx_entry));
+    return lblk;
+}
+
+/* Makes room in the full index array at the bottom of 'frames': a full
+ * root has its entries pushed down into a new node (adding a level),
+ * and a full node is split in two, the upper half indexed by the root */
+static void dx_grow_index (unsigned char* disk, struct ext2_inode* dir,
+                           struct dx_frame* frames, int levels) {
+    struct dx_entry *root = frames[0].entries, *node;
+    struct dx_root_info *info = dx_info(root);
+    unsigned int count, half;
+
+    if(levels == 1) {
+        count = dx_cl(root)->count;
+        root[0].block = dx_new_node(disk, dir, root, count);
+        dx_cl(root)->count = 1;
+        info->indirect_levels = 1;
+        mark_dirty(disk, info, sizeof(*info) + sizeof(struct dx_entry));
+        return;
+    }
+
+    // Two levels is as deep as the index goes
+    exit_if(dx_cl(root)->count >= dx_cl(root)->limit, ENOSPC);
+
+    node = frames[1].entries;
+    count = dx_cl(node)->count;
+    half = count / 2;
+    dx_insert(disk, root, frames[0].at, node[half].hash,
+              dx_new_node(disk, dir, node + half, count - half));
+    dx_cl(node)->count = half;
+    mark_dirty(disk, node, sizeof(struct dx_entry));
+}
+
+// A live entry of a leaf being split, by hash
+struct dx_map_entry {
+    unsigned int hash;
+    unsigned int offs;          // Offset of the entry in the leaf
+};
+
+static int dx_map_cmp (const void* a, const void* b) {
+    unsigned int ha = ((const struct dx_map_entry*)a)->hash;
+    unsigned int hb = ((const struct dx_map_entry*)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+/* Lays the 'n' entries of 'src' listed in 'map' out one after another
+ * in 'block', the last one stretched to the end of the block */
+static void dx_fill_leaf (unsigned char* disk, unsigned char* block,
+                          const unsigned char* src,
+                          const struct dx_map_entry* map, unsigned int n) {
+    struct ext2_dir_entry_2 *d_entry = (struct ext2_dir_entry_2*)block;
+    const struct ext2_dir_entry_2 *from;
+    unsigned int i, offset = 0;
+
+    memset(block, 0, EXT2_BLOCK_SIZE);
+    for(i = 0; i < n; i++) {
+        from = (const struct ext2_dir_entry_2*)(src + map[i].offs);
+        d_entry = (struct ext2_dir_entry_2*)(block + offset);
+        memcpy(d_entry, from, sizeof(*from) + from->name_len);
+        d_entry->rec_len = calc_d_entr_size(from->name_len);
+        offset += d_entry->rec_len;
+    }
+    d_entry->rec_len += EXT2_BLOCK_SIZE - offset;
+    mark_dirty(disk, block, EXT2_BLOCK_SIZE);
+}
+
+/* Splits the full leaf under 'frame' in two by hash, moving the upper
+ * half into a new block indexed just after it */
+static void dx_split_leaf (unsigned char* disk, struct ext2_inode* dir,
+                           struct dx_root_info* info, struct dx_frame* frame) {
+    unsigned char *leaf = bnum_to_block(lblk_to_bnum(disk, dir,
+                                        frame->at->block), disk);
+    unsigned char *src = malloc(EXT2_BLOCK_SIZE);
+    struct dx_map_entry *map = malloc(EXT2_BLOCK_SIZE / 12 * sizeof(*map));
+    struct ext2_dir_entry_2 *d_entry;
+    unsigned int offset, n = 0, split, split_hash, lblk, bnum;
+
+    exit_if(!src || !map, ENOMEM);
+    memcpy(src, leaf, EXT2_BLOCK_SIZE);
+
+    for(offset = 0; offset < EXT2_BLOCK_SIZE; offset += d_entry->rec_len) {
+        d_entry = (struct ext2_dir_entry_2*)(src + offset);
+        if(!d_entry->rec_len)
+            break;
+        if(!d_entry->inode)
+            continue;
+        map[n].hash = dx_name_hash(disk, info, d_entry->name,
+                                   d_entry->name_len);
+        map[n++].offs = offset;
+    }
+    exit_if(n < 2, ENOSPC);
+    qsort(map, n, sizeof(*map), dx_map_cmp);
+
+    // Equal hashes straddling the split are flagged on the new leaf
+    split = n / 2;
+    split_hash = map[split].hash;
+    if(map[split - 1].hash == split_hash)
+        split_hash |= DX_HASH_CONTINUED;
+
+    bnum = dir_append_block(disk, dir, &lblk);
+    dx_fill_leaf(disk, leaf, src, map, split);
+    dx_fill_leaf(disk, bnum_to_block(bnum, disk), src, map + split, n - split);
+    dx_insert(disk, frame->entries, frame->at, split_hash, lblk);
+
+    free(map);
+    free(src);
+}
+
+/* Adds an entry to the leaf of indexed directory 'dir' that 'name' hashes
+ * to, splitting the leaf (and the index above it) when it's full.
+ * Returns the new entry, or NULL if the index is unusable. */
+struct ext2_dir_entry_2* dx_add_entry (unsigned char* disk,
+                                       struct ext2_inode* dir,
+                                       unsigned int inum, const char* name,
+                                       unsigned int len, unsigned char type) {
+    struct dx_frame frames[DX_MAX_LEVELS], *frame;
+    struct ext2_dir_entry_2 *d_entry;
+    unsigned int hash, bnum;
+    int levels;
+
+    // Each pass either adds the entry or makes more room on its path
+    for(;;) {
+        if(!(levels = dx_probe(disk, dir, name, len, &hash, frames)))
+            return NULL;
+        frame = &frames[levels - 1];
+        if(!(bnum = lblk_to_bnum(disk, dir, frame->at->block)))
+            return NULL;
+
+        d_entry = add_entr_to_block(disk, bnum_to_block(bnum, disk),
+                                    inum, name, len, type);
+        if(d_entry)
+            return d_entry;
+
+        if(dx_cl(frame->entries)->count >= dx_cl(frame->entries)->limit)
+            dx_grow_index(disk, dir, frames, levels);
+        else
+            dx_split_leaf(disk, dir, dx_info(frames[0].entries), frame);
+    }
+}
+
+/* Turns the single-block directory 'dir' into an indexed one: moves its
+ * entries (bar "." and "..") into a new leaf and builds a root index in
+ * block 0. Returns 0 if block 0 doesn't start with "." and "..". */
+int dx_make_indexed (unsigned char* disk, struct ext2_inode* dir) {
+    struct ext2_super_block *sb = get_sb(disk);
+    unsigned char *root = bnum_to_block(lblk_to_bnum(disk, dir, 0), disk);
+    struct ext2_dir_entry_2 *dot = (struct ext2_dir_entry_2*)root;
+    struct ext2_dir_entry_2 *dotdot = (struct ext2_dir_entry_2*)(root + 12);
+    struct ext2_dir_entry_2 *d_entry;
+    struct dx_map_entry *map;
+    struct dx_root_info *info;
+    struct dx_entry *entries;
+    unsigned char *src;
+    unsigned int offset, n = 0, lblk, bnum;
+
+    if(dot->rec_len != 12 || dot->name_len != 1 || dot->name[0] != '.' ||
+        dotdot->name_len != 2 || strncmp(dotdot->name, "..", 2))
+        return 0;
+
+    src = malloc(EXT2_BLOCK_SIZE);
+    map = malloc(EXT2_BLOCK_SIZE / 12 * sizeof(*map));
+    exit_if(!src || !map, ENOMEM);
+    memcpy(src, root, EXT2_BLOCK_SIZE);
+
+    // Everything after ".." moves to the first leaf, as it is
+    for(offset = 12 + dotdot->rec_len; offset < EXT2_BLOCK_SIZE;
+        offset += d_entry->rec_len) {
+        d_entry = (struct ext2_dir_entry_2*)(src + offset);
+        if(!d_entry->rec_len)
+            break;
+        if(d_entry->inode)
+            map[n++].offs = offset;
+    }
+    bnum = dir_append_block(disk, dir, &lblk);
+    if(n)
+        dx_fill_leaf(disk, bnum_to_block(bnum, disk), src, map, n);
+
+    dotdot->rec_len = EXT2_BLOCK_SIZE - 12;
+    memset(root + DX_ROOT_INFO_OFFSET, 0,
+           EXT2_BLOCK_SIZE - DX_ROOT_INFO_OFFSET);
+    info = (struct dx_root_info*)(root + DX_ROOT_INFO_OFFSET);
+    info->hash_version = (sb->s_def_hash_version <= DX_HASH_TEA) ?
+                         sb->s_def_hash_version : DX_HASH_HALF_MD4;
+    info->info_length = 8;
+    entries = (struct dx_entry*)(info + 1);
+    dx_cl(entries)->limit = dx_root_limit();
+    dx_cl(entries)->count = 1;
+    entries[0].block = lblk;
+    mark_dirty(disk, root, EXT2_BLOCK_SIZE);
+
+    // dx_hash() treats names as signed chars unless told otherwise
+    if(!(sb->s_flags & (EXT2_FLAGS_SIGNED_HASH | EXT2_FLAGS_UNSIGNED_HASH)))
+        sb->s_flags |= EXT2_FLAGS_SIGNED_HASH;
+    dir->i_flags |= EXT2_INDEX_FL;
+    mark_dirty(disk, sb, sizeof(struct ext2_super_block));
+    mark_dirty(disk, dir, sizeof(struct ext2_inode));
+
+    free(map);
+    free(src);
+    return 1;
+}
+
+/* Repacks the leaves of indexed directory 'dir' as densely as they go, in
+ * hash order, and rebuilds its index over them in the directory's first
+ * blocks: the root, then any index nodes, then the leaves. Returns how
+ * many blocks that takes (the rest are left unused, for the caller to
+ * free), or 0 if the index is unusable or a block is missing (the 
+ * directory is then left as it was). */
+unsigned long dx_compact (unsigned char* disk, struct ext2_inode* dir) {
+    unsigned long nblocks = dir->i_size / EXT2_BLOCK_SIZE, lblk, used = 0;
+    unsigned int bnum = nblocks ? lblk_to_bnum(disk, dir, 0) : 0;
+    unsigned int offset, n = 0, i, j, nleaves = 0, nnodes, fill, size, hash;
+    unsigned int *leaf_first = NULL;
+    unsigned char *root, *src = NULL, *block;
+    struct ext2_dir_entry_2 *dotdot, *d_entry;
+    struct dx_map_entry *map = NULL;
+    struct dx_root_info *info, old;
+    struct dx_entry *entries;
+
+    if(!bnum)
+        return 0;
+    root = bnum_to_block(bnum, disk);
+    dotdot = (struct ext2_dir_entry_2*)(root + 12);
+    info = (struct dx_root_info*)(root + DX_ROOT_INFO_OFFSET);
+    if(((struct ext2_dir_entry_2*)root)->rec_len != 12 || 
+        dotdot->name_len != 2 || info->reserved_zero || 
+        info->info_length != 8 || info->hash_version > DX_HASH_TEA || 
+        info->indirect_levels >= DX_MAX_LEVELS)
+        return 0;
+    old = *info;
+
+    // Copies out every block but the root, noting each live entry's hash
+    src = malloc(nblocks * EXT2_BLOCK_SIZE);
+    map = malloc((nblocks * EXT2_BLOCK_SIZE / 12 + 1) * sizeof(*map));
+    leaf_first = malloc((nblocks * EXT2_BLOCK_SIZE / 12 + 1) * 
+                        sizeof(*leaf_first));
+    exit_if(!src || !map || !leaf_first, ENOMEM);
+    for(lblk = 1; lblk < nblocks; lblk++) {
+        if(!(bnum = lblk_to_bnum(disk, dir, lblk)))
+            goto out;
+        block = src + lblk * EXT2_BLOCK_SIZE;
+        memcpy(block, bnum_to_block(bnum, disk), EXT2_BLOCK_SIZE);
+        for(offset = 0; offset < EXT2_BLOCK_SIZE; 
+            offset += d_entry->rec_len) {
+            d_entry = (struct ext2_dir_entry_2*)(block + offset);
+            if(!d_entry->rec_len)
+                break;
+            if(!d_entry->inode)     // Index nodes hold just an empty one
+                continue;
+            map[n].hash = dx_name_hash(disk, &old, d_entry->name,
+                                       d_entry->name_len);
+            map[n++].offs = lblk * EXT2_BLOCK_SIZE + offset;
+        }
+    }
+    qsort(map, n, sizeof(*map), dx_map_cmp);
+
+    // Cuts the sorted entries into leaves, each filled as far as it goes
+    leaf_first[nleaves++] = 0;
+    for(i = 0, fill = 0; i < n; i++) {
+        d_entry = (struct ext2_dir_entry_2*)(src + map[i].offs);
+        size = calc_d_entr_size(d_entry->name_len);
+        if(fill + size > EXT2_BLOCK_SIZE) {
+            leaf_first[nleaves++] = i;
+            fill = 0;
+        }
+        fill += size;
+    }
+    leaf_first[nleaves] = n;
+    nnodes = (nleaves <= dx_root_limit()) ? 0 : 
+             (nleaves + dx_node_limit() - 1) / dx_node_limit();
+    if(nnodes > dx_root_limit() || 1 + nnodes + nleaves > nblocks)
+        goto out;
+    used = 1 + nnodes + nleaves;
+
+    for(j = 0; j < nleaves; j++) {
+        lblk = 1 + nnodes + j;
+        block = bnum_to_block(lblk_to_bnum(disk, dir, lblk), disk);
+        dx_fill_leaf(disk, block, src, map + leaf_first[j],
+                     leaf_first[j + 1] - leaf_first[j]);
+    }
+
+    // The root keeps "." and "..", and indexes the leaves or the nodes
+    dotdot->rec_len = EXT2_BLOCK_SIZE - 12;
+    memset(root + DX_ROOT_INFO_OFFSET, 0, 
+           EXT2_BLOCK_SIZE - DX_ROOT_INFO_OFFSET);
+    info->hash_version = old.hash_version;
+    info->info_length = 8;
+    info->indirect_levels = nnodes ? 1 : 0;
+    entries = (struct dx_entry*)(info + 1);
+    for(i = 0; i < (nnodes ? nnodes : nleaves); i++) {
+        j = nnodes ? i * dx_node_limit() : i;
+        entries[i].block = 1 + (nnodes ? i : nnodes + j);
+        hash = map[leaf_first[j]].hash;
+        if(leaf_first[j] && map[leaf_first[j] - 1].hash == hash)
+            hash |= DX_HASH_CONTINUED;
+        entries[i].hash = hash;
+    }
+    dx_cl(entries)->limit = dx_root_limit();
+    dx_cl(entries)->count = i;
+    mark_dirty(disk, root, EXT2_BLOCK_SIZE);
+
+    // Each node indexes the next dx_node_limit() leaves
+    for(i = 0; i < nnodes; i++) {
+        block = bnum_to_block(lblk_to_bnum(disk, dir, 1 + i), disk);
+        memset(block, 0, EXT2_BLOCK_SIZE);
+        ((struct ext2_dir_entry_2*)block)->rec_len = EXT2_BLOCK_SIZE;
+        entries = (struct dx_entry*)(block + DX_NODE_ENTRIES_OFFSET);
+        for(j = i * dx_node_limit(); 
+            j < nleaves && j < (i + 1) * dx_node_limit(); j++) {
+            entries[j % dx_node_limit()].block = 1 + nnodes + j;
+            hash = map[leaf_first[j]].hash;
+            if(leaf_first[j] && map[leaf_first[j] - 1].hash == hash)
+                hash |= DX_HASH_CONTINUED;
+            entries[j % dx_node_limit()].hash = hash;
+        }
+        dx_cl(entries)->limit = dx_node_limit();
+        dx_cl(entries)->count = j - i * dx_node_limit();
+        mark_dirty(disk, block, EXT2_BLOCK_SIZE);
+    }
+
+out:
+    free(leaf_first);
+    free(map);
+    free(src);
+    return used;
+}
@@ -0,0 +1,79 @@
+#ifndef EXT2_HTREE_H
+#define EXT2_HTREE_H
+
+#include "ext2.h"
+
+/*
+ * On-disk layout of a hashed directory index, as used by ext3's htree.
+ *
+ * Block 0 of an indexed directory holds the "." and ".." entries, with
+ * ".." stretched to cover the rest of the block. Hidden in that space
+ * are a dx_root_info and a sorted array of (hash, logical block) index
+ * entries. With indirect_levels set, those point to dx_node blocks (one
+ * empty dir entry covering the block, then another index array), which
+ * in turn point to ordinary directory blocks (the leaves).
+ *
+ * The first entry of each index array has no hash of its own (it covers
+ * everything below the second); a dx_countlimit is stored there instead.
+ */
+struct dx_root_info {
+	unsigned int	reserved_zero;
+	unsigned char	hash_version;
+	unsigned char	info_length;	/* 8 */
+	unsigned char	indirect_levels;
+	unsigned char	unused_flags;
+};
+
+struct dx_entry {
+	unsigned int	hash;
+	unsigned int	block;		/* Logical block within the directory */
+};
+
+struct dx_countlimit {
+	unsigned short	limit;
+	unsigned short	count;
+};
+
+#define DX_ROOT_INFO_OFFSET	24	/* After "." and ".." (12 bytes each) */
+#define DX_ROOT_ENTRIES_OFFSET	(DX_ROOT_INFO_OFFSET + 8)
+#define DX_NODE_ENTRIES_OFFSET	8	/* After the empty dir entry */
+#define DX_MAX_LEVELS		2	/* The root, plus one level of nodes */
+
+/* Hash of a leaf's first entry, with the low bit set when the previous
+ * leaf ends with entries of the same hash */
+#define DX_HASH_CONTINUED	1
+
+/* Computes the directory hash of the 'len' bytes at 'name' with the
+ * given DX_HASH_* algorithm and seed (all zero for the default). Stores
+ * the secondary hash in '*minor_hash' unless it's NULL. */
+unsigned int dx_hash (const char* name, unsigned int len, int version,
+                      const unsigned int seed[4], unsigned int* minor_hash);
+
+/* Looks 'name' up through the index of directory 'dir', reading only the
+ * index blocks on the way and the leaf (or leaves, on hash collisions)
+ * the name hashes to. Stores the entry found (or NULL) in '*res' and
+ * returns 1, or returns 0 if the index is unusable. */
+int dx_lookup (unsigned char* disk, struct ext2_inode* dir,
+               const char* name, unsigned int len,
+               struct ext2_dir_entry_2** res);
+
+/* Adds an entry to the leaf of indexed directory 'dir' that 'name' hashes
+ * to, splitting the leaf (and the index above it) when it's full.
+ * Returns the new entry, or NULL if the index is unusable. */
+struct ext2_dir_entry_2* dx_add_entry (unsigned char* disk,
+                                       struct ext2_inode* dir,
+                                       unsigned int inum, const char* name,
+                                       unsigned int len, unsigned char type);
+
+/* Turns the single-block directory 'dir' into an indexed one: moves its
+ * entries (bar "." and "..") into a new leaf and builds a root index in
+ * block 0. Returns 0 if block 0 doesn't start with "." and "..". */
+int dx_make_indexed (unsigned char* disk, struct ext2_inode* dir);
+
+/* Repacks the leaves of indexed directory 'dir' densely in hash order and
+ * rebuilds its index over them in the directory's first blocks. Returns
+ * how many blocks that takes (the rest are left for the caller to free),
+ * or 0 if the index is unusable (the directory is then left as it was). */
+unsigned long dx_compact (unsigned char* disk, struct ext2_inode* dir);
+
+#endif
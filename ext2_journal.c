@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include "ext2.h"
+#include "ext2_utils.h"
+#include "ext2_journal.h"
+
+// The journal of an image open for writing
+struct journal {
+    int fd;                         // The image file
+    struct jbd_superblock* jsb;     // Its superblock (a copy, kept up to date)
+    unsigned int* jmap;             // Image block holding each of its blocks
+};
+
+/////////////////////////////////////////
+// RAW I/O ON THE IMAGE FILE
+/////////////////////////////////////////
+
+// Writes the 'len' bytes at 'buf' to offset 'off' of 'fd' in full
+static void write_full (int fd, const void* buf, size_t len, off_t off) {
+    ssize_t result;
+
+    while(len) {
+        result = pwrite(fd, buf, len, off);
+        if(result < 0 && errno == EINTR)
+            continue;
+        exit_if(result <= 0, result < 0 ? errno : EIO);
+        buf = (const unsigned char*)buf + result;
+        len -= result;
+        off += result;
+    }
+}
+
+// Waits for everything written to 'fd' so far to reach the disk
+static void barrier (int fd) {
+    exit_if(fdatasync(fd) < 0, errno);
+}
+
+// Writes 'count' blocks of the mapping, from block 'bnum' on, in place
+static void write_blocks (unsigned char* disk, int fd, unsigned int bnum,
+                          unsigned int count) {
+    write_full(fd, bnum_to_block(bnum, disk),
+               (size_t)count * EXT2_BLOCK_SIZE, (off_t)bnum * EXT2_BLOCK_SIZE);
+}
+
+/* Drops the mapping's private copies of 'count' blocks from 'bnum' on
+ * once they are in the file, so the memory goes back to the kernel and
+ * later reads see the file again */
+static void drop_blocks (unsigned char* disk, unsigned int bnum,
+                         unsigned int count) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)bnum * EXT2_BLOCK_SIZE & ~(page - 1);
+    size_t end = ((size_t)(bnum + count) * EXT2_BLOCK_SIZE + page - 1) &
+                 ~(page - 1);
+
+    end = MIN(end, (size_t)get_sb(disk)->s_blocks_count * EXT2_BLOCK_SIZE);
+    madvise(disk + start, end - start, MADV_DONTNEED);
+}
+
+// Writes the journal superblock to the disk
+static void write_jsb (struct journal* jnl) {
+    write_full(jnl->fd, jnl->jsb, sizeof(*jnl->jsb),
+               (off_t)jnl->jmap[0] * EXT2_BLOCK_SIZE);
+}
+
+// Returns the log block after 'lblk', wrapping around the journal's end
+static unsigned int log_next (struct journal* jnl, unsigned int lblk) {
+    return (lblk + 1 < ntohl(jnl->jsb->s_maxlen)) ? lblk + 1 :
+                                                   ntohl(jnl->jsb->s_first);
+}
+
+/////////////////////////////////////////
+// RECOVERY
+/////////////////////////////////////////
+
+// A block a transaction revoked: copies of it logged up to then are stale
+struct revoke {
+    unsigned int bnum, seq;
+};
+
+// The blocks revoked by the transactions in the log
+struct revoke_table {
+    struct revoke* r;
+    unsigned int n, cap;
+};
+
+static int cmp_revoke (const void* a, const void* b) {
+    const struct revoke *x = a, *y = b;
+
+    if(x->bnum != y->bnum)
+        return x->bnum < y->bnum ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+// Adds the blocks listed in the revoke block 'hdr' to 'rt', for 'seq'
+static void add_revokes (struct revoke_table* rt, struct jbd_header* hdr,
+                         unsigned int seq) {
+    struct jbd_revoke_header* rh = (struct jbd_revoke_header*)hdr;
+    unsigned int* bnums = (unsigned int*)(rh + 1);
+    unsigned int i, count = ntohl(rh->r_count);
+
+    exit_if(count < sizeof(*rh) || count > EXT2_BLOCK_SIZE, EUCLEAN);
+    for(i = 0; i < (count - sizeof(*rh)) / sizeof(*bnums); i++) {
+        if(rt->n == rt->cap) {
+            rt->cap = rt->cap ? 2 * rt->cap : 64;
+            rt->r = realloc(rt->r, rt->cap * sizeof(*rt->r));
+            exit_if(!rt->r, ENOMEM);
+        }
+        rt->r[rt->n].bnum = ntohl(bnums[i]);
+        rt->r[rt->n++].seq = seq;
+    }
+}
+
+/* Returns whether the copy of block 'bnum' logged by transaction 'seq' is
+ * stale: the block was revoked by that transaction or a later one. 'rt'
+ * is sorted, and holds only the latest revocation of each block. */
+static int is_revoked (struct revoke_table* rt, unsigned int bnum,
+                       unsigned int seq) {
+    unsigned int lo = 0, hi = rt->n, mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(rt->r[mid].bnum < bnum)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < rt->n && rt->r[lo].bnum == bnum &&
+           (int)(rt->r[lo].seq - seq) >= 0;
+}
+
+/* Walks the tags of the descriptor block at log block 'lblk' of
+ * transaction 'seq', and with 'rt' set, copies each block that follows to
+ * where it belongs (unless it's revoked), unescaping it in the block at
+ * 'copy' if need be. Returns the log block of the last one. */
+static unsigned int replay_descriptor (struct journal* jnl,
+                                       unsigned char* disk,
+                                       unsigned int lblk, unsigned int seq,
+                                       struct revoke_table* rt,
+                                       unsigned char* copy) {
+    unsigned int bs = EXT2_BLOCK_SIZE, off, flags, bnum;
+    unsigned int magic = htonl(JBD_MAGIC);
+    struct jbd_header* hdr = (struct jbd_header*)
+                             bnum_to_block(jnl->jmap[lblk], disk);
+    unsigned char* block;
+    struct jbd_tag* tag;
+
+    for(off = sizeof(*hdr); off + sizeof(*tag) <= bs; ) {
+        tag = (struct jbd_tag*)((unsigned char*)hdr + off);
+        flags = ntohs(tag->t_flags);
+        off += sizeof(*tag) + ((flags & JBD_FLAG_SAME_UUID) ? 0 : 16);
+        lblk = log_next(jnl, lblk);
+
+        bnum = ntohl(tag->t_blocknr);
+        if(rt && !is_revoked(rt, bnum, seq)) {
+            block = bnum_to_block(jnl->jmap[lblk], disk);
+            if(flags & JBD_FLAG_ESCAPE) {
+                memcpy(copy, block, bs);
+                memcpy(copy, &magic, sizeof(magic));
+                block = copy;
+            }
+            exit_if(bnum >= get_sb(disk)->s_blocks_count, EUCLEAN);
+            write_full(jnl->fd, block, bs, (off_t)bnum * bs);
+        }
+        if(flags & JBD_FLAG_LAST_TAG)
+            break;
+    }
+    return lblk;
+}
+
+/* Replays every committed transaction in the log, in order, by copying
+ * its blocks to their places in the file. A first pass finds where the
+ * committed transactions end (a transaction with no commit block was cut
+ * short by the crash and is dropped), and collects the blocks they
+ * revoked; the second copies every logged block not revoked by its own
+ * transaction or a later one. */
+static void journal_replay (struct journal* jnl, unsigned char* disk) {
+    unsigned int seq = ntohl(jnl->jsb->s_sequence), end = seq, pending = 0;
+    unsigned int lblk, type, i, j, replayed;
+    struct revoke_table rt = { NULL, 0, 0 };
+    struct jbd_header* hdr;
+    unsigned char* copy;
+
+    for(lblk = ntohl(jnl->jsb->s_start); ; lblk = log_next(jnl, lblk)) {
+        hdr = (struct jbd_header*)bnum_to_block(jnl->jmap[lblk], disk);
+        if(ntohl(hdr->h_magic) != JBD_MAGIC || ntohl(hdr->h_sequence) != end)
+            break;
+        type = ntohl(hdr->h_blocktype);
+        if(type == JBD_DESCRIPTOR_BLOCK)
+            lblk = replay_descriptor(jnl, disk, lblk, end, NULL, NULL);
+        else if(type == JBD_REVOKE_BLOCK)
+            add_revokes(&rt, hdr, end);
+        else if(type == JBD_COMMIT_BLOCK) {
+            end++;
+            pending = rt.n;
+        } else {
+            fprintf(stderr, "ERROR: journal needs a full recovery "
+                            "(run e2fsck)\n");
+            exit(EUCLEAN);
+        }
+    }
+    rt.n = pending;     // Revocations by an uncommitted transaction don't count
+
+    // Keeps just the latest revocation of each block
+    qsort(rt.r, rt.n, sizeof(*rt.r), cmp_revoke);
+    for(i = j = 0; i < rt.n; i++) {
+        if(j && rt.r[j - 1].bnum == rt.r[i].bnum)
+            j--;
+        rt.r[j++] = rt.r[i];
+    }
+    rt.n = j;
+
+    copy = malloc(EXT2_BLOCK_SIZE);
+    exit_if(!copy, ENOMEM);
+    lblk = ntohl(jnl->jsb->s_start);
+    for(replayed = 0; seq + replayed != end; lblk = log_next(jnl, lblk)) {
+        hdr = (struct jbd_header*)bnum_to_block(jnl->jmap[lblk], disk);
+        type = ntohl(hdr->h_blocktype);
+        if(type == JBD_DESCRIPTOR_BLOCK)
+            lblk = replay_descriptor(jnl, disk, lblk, seq + replayed, &rt,
+                                     copy);
+        else if(type == JBD_COMMIT_BLOCK)
+            replayed++;
+    }
+    free(rt.r);
+    free(copy);
+
+    // The log is empty again once the replayed blocks are on the disk
+    barrier(jnl->fd);
+    jnl->jsb->s_sequence = htonl(end);
+    jnl->jsb->s_start = 0;
+    write_jsb(jnl);
+    barrier(jnl->fd);
+    if(replayed)
+        fprintf(stderr, "Replayed %u transaction(s) from the journal\n",
+                replayed);
+}
+
+/////////////////////////////////////////
+// OPENING & CLOSING
+/////////////////////////////////////////
+
+/* Sets or clears the superblock's needs-recovery flag, in the mapping
+ * and straight in the file */
+static void set_recover (unsigned char* disk, int fd, int on) {
+    struct ext2_super_block* sb = get_sb(disk);
+
+    if(on)
+        sb->s_feature_incompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+    else
+        sb->s_feature_incompat &= ~EXT3_FEATURE_INCOMPAT_RECOVER;
+    write_full(fd, sb, sizeof(*sb), EXT2_SUPERBLOCK_OFFSET);
+    barrier(fd);
+}
+
+/* Checks whether the image has an internal journal this code can use.
+ * If so, replays what a crash left in it, flags the image as needing
+ * recovery until journal_close(), and returns the journal. */
+struct journal* journal_open (unsigned char* disk, int fd) {
+    struct ext2_super_block* sb = get_sb(disk);
+    struct ext2_inode* jinode;
+    struct journal* jnl;
+    unsigned int i, maxlen;
+
+    if(!(sb->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) ||
+        !sb->s_journal_inum)
+        return NULL;
+    exit_if(sb->s_journal_dev != 0, EINVAL);    // External journals
+
+    jinode = inum_to_inode(sb->s_journal_inum, disk);
+    exit_if(!lblk_to_bnum(disk, jinode, 0), EUCLEAN);
+    jnl = malloc(sizeof(*jnl));
+    exit_if(!jnl, ENOMEM);
+    jnl->fd = fd;
+    jnl->jsb = malloc(sizeof(*jnl->jsb));
+    exit_if(!jnl->jsb, ENOMEM);
+    memcpy(jnl->jsb, bnum_to_block(lblk_to_bnum(disk, jinode, 0), disk),
+           sizeof(*jnl->jsb));
+
+    // Only plain journals (no checksums, 64-bit tags etc.) are understood
+    exit_if(ntohl(jnl->jsb->s_header.h_magic) != JBD_MAGIC ||
+            ntohl(jnl->jsb->s_blocksize) != EXT2_BLOCK_SIZE, EUCLEAN);
+    if(ntohl(jnl->jsb->s_header.h_blocktype) == JBD_SUPERBLOCK_V1)
+        memset(&jnl->jsb->s_feature_compat, 0,
+               sizeof(*jnl->jsb) - 
+               offsetof(struct jbd_superblock, s_feature_compat));
+    exit_if(jnl->jsb->s_feature_compat || 
+            (ntohl(jnl->jsb->s_feature_incompat) & 
+             ~JBD_FEATURE_INCOMPAT_REVOKE), EINVAL);
+
+    maxlen = ntohl(jnl->jsb->s_maxlen);
+    exit_if(maxlen < 4 || ntohl(jnl->jsb->s_first) >= maxlen ||
+            (unsigned long)maxlen * EXT2_BLOCK_SIZE > get_inode_size(jinode),
+            EUCLEAN);
+    jnl->jmap = malloc(maxlen * sizeof(*jnl->jmap));
+    exit_if(!jnl->jmap, ENOMEM);
+    for(i = 0; i < maxlen; i++) {
+        jnl->jmap[i] = lblk_to_bnum(disk, jinode, i);
+        exit_if(!jnl->jmap[i], EUCLEAN);
+    }
+
+    if(jnl->jsb->s_start)
+        journal_replay(jnl, disk);
+    set_recover(disk, fd, 1);
+    return jnl;
+}
+
+// Marks the image as cleanly closed (nothing left to recover)
+void journal_close (struct journal* jnl, unsigned char* disk) {
+    set_recover(disk, jnl->fd, 0);
+    free(jnl->jmap);
+    free(jnl->jsb);
+    free(jnl);
+}
+
+/////////////////////////////////////////
+// COMMITTING
+/////////////////////////////////////////
+
+/* Writes the 'n' metadata blocks listed (in order) at 'blocks' as one
+ * transaction: descriptor blocks and copies of the blocks, then (after a
+ * barrier) the commit block. Once that is on the disk, writes the blocks
+ * in place and empties the log again. */
+static void commit_transaction (struct journal* jnl, unsigned char* disk,
+                                const unsigned int* blocks, unsigned int n) {
+    unsigned int bs = EXT2_BLOCK_SIZE, seq = ntohl(jnl->jsb->s_sequence);
+    unsigned int per_desc = (bs - sizeof(struct jbd_header) - 16) /
+                            sizeof(struct jbd_tag);
+    unsigned int lblk = ntohl(jnl->jsb->s_first), i, j, k, run;
+    unsigned int magic = htonl(JBD_MAGIC);
+    unsigned char *desc = malloc(bs), *copy = malloc(bs), *block;
+    struct jbd_header* hdr = (struct jbd_header*)desc;
+    struct jbd_tag* tag;
+    size_t off;
+
+    exit_if(!desc || !copy, ENOMEM);
+    for(i = 0; i < n; i += k) {
+        k = MIN(per_desc, n - i);
+
+        // One tag per block; only the first is followed by the UUID
+        memset(desc, 0, bs);
+        hdr->h_magic = magic;
+        hdr->h_blocktype = htonl(JBD_DESCRIPTOR_BLOCK);
+        hdr->h_sequence = htonl(seq);
+        for(j = 0, off = sizeof(*hdr); j < k; j++) {
+            tag = (struct jbd_tag*)(desc + off);
+            tag->t_blocknr = htonl(blocks[i + j]);
+            tag->t_flags = htons((j ? JBD_FLAG_SAME_UUID : 0) |
+                                 (j == k - 1 ? JBD_FLAG_LAST_TAG : 0) |
+                                 (memcmp(bnum_to_block(blocks[i + j], disk),
+                                         &magic, sizeof(magic)) ?
+                                  0 : JBD_FLAG_ESCAPE));
+            off += sizeof(*tag);
+            if(!j) {
+                memcpy(desc + off, jnl->jsb->s_uuid, 16);
+                off += 16;
+            }
+        }
+        write_full(jnl->fd, desc, bs, (off_t)jnl->jmap[lblk] * bs);
+        lblk = log_next(jnl, lblk);
+
+        // The copies, with any that look like journal blocks escaped
+        for(j = 0; j < k; j++) {
+            block = bnum_to_block(blocks[i + j], disk);
+            if(!memcmp(block, &magic, sizeof(magic))) {
+                memcpy(copy, block, bs);
+                memset(copy, 0, sizeof(magic));
+                block = copy;
+            }
+            write_full(jnl->fd, block, bs, (off_t)jnl->jmap[lblk] * bs);
+            lblk = log_next(jnl, lblk);
+        }
+    }
+
+    // Points recovery at the transaction, then commits it
+    jnl->jsb->s_start = jnl->jsb->s_first;
+    write_jsb(jnl);
+    barrier(jnl->fd);
+    memset(desc, 0, bs);
+    hdr->h_magic = magic;
+    hdr->h_blocktype = htonl(JBD_COMMIT_BLOCK);
+    hdr->h_sequence = htonl(seq);
+    write_full(jnl->fd, desc, bs, (off_t)jnl->jmap[lblk] * bs);
+    barrier(jnl->fd);
+
+    // Checkpoints it: the blocks go in place, a run at a time
+    for(i = 0; i < n; i += run) {
+        for(run = 1; i + run < n && blocks[i + run] == blocks[i] + run; )
+            run++;
+        write_blocks(disk, jnl->fd, blocks[i], run);
+    }
+    barrier(jnl->fd);
+
+    // Recovery has nothing to do from here on
+    jnl->jsb->s_sequence = htonl(seq + 1);
+    jnl->jsb->s_start = 0;
+    write_jsb(jnl);
+
+    free(desc);
+    free(copy);
+}
+
+// Whether block 'b' is marked as file data in 'data_map'
+#define IS_DATA(data_map, b)    (((data_map)[(b) / 8] >> ((b) % 8)) & 1)
+
+/* Writes the dirty blocks back as a transaction in ordered mode: file
+ * data first, then metadata through the journal */
+void journal_commit (struct journal* jnl, unsigned char* disk,
+                     const unsigned char* dirty_map,
+                     const unsigned char* data_map) {
+    unsigned int nblocks = get_sb(disk)->s_blocks_count;
+    unsigned int cap = ntohl(jnl->jsb->s_maxlen) - ntohl(jnl->jsb->s_first);
+    unsigned int per_desc = (EXT2_BLOCK_SIZE - sizeof(struct jbd_header) - 16)
+                            / sizeof(struct jbd_tag);
+    unsigned int bit, end, b, run, n = 0, i, max_n;
+    unsigned int* blocks;
+
+    // Data goes straight in place (a run at a time), and must be there
+    // before the commit
+    for(bit = bitmap_find_set(dirty_map, 0, nblocks); bit < nblocks;
+        bit = bitmap_find_set(dirty_map, end, nblocks)) {
+        end = bitmap_find_zero(dirty_map, bit, nblocks);
+        for(b = bit; b < end; b += run) {
+            for(run = 1; b + run < end && IS_DATA(data_map, b + run) == 
+                                          IS_DATA(data_map, b); )
+                run++;
+            if(IS_DATA(data_map, b))
+                write_blocks(disk, jnl->fd, b, run);
+            else
+                n += run;
+        }
+    }
+    barrier(jnl->fd);
+
+    // Lists the metadata blocks (in block order)
+    blocks = malloc(MAX(n, 1) * sizeof(*blocks));
+    exit_if(!blocks, ENOMEM);
+    n = 0;
+    for(bit = bitmap_find_set(dirty_map, 0, nblocks); bit < nblocks;
+        bit = bitmap_find_set(dirty_map, end, nblocks)) {
+        end = bitmap_find_zero(dirty_map, bit, nblocks);
+        for(b = bit; b < end; b++)
+            if(!IS_DATA(data_map, b))
+                blocks[n++] = b;
+    }
+
+    // Each transaction must fit in the log with its descriptors & commit
+    max_n = (unsigned long)(cap - 1) * per_desc / (per_desc + 1);
+    if(n > max_n)
+        fprintf(stderr, "Warning: %u changed blocks don't fit in the journal;"
+                        " committing them in %u pieces\n", n,
+                        (n + max_n - 1) / max_n);
+    for(i = 0; i < n; i += max_n)
+        commit_transaction(jnl, disk, blocks + i, MIN(max_n, n - i));
+
+    // Everything dirty is in the file now; the private copies can go
+    for(bit = bitmap_find_set(dirty_map, 0, nblocks); bit < nblocks;
+        bit = bitmap_find_set(dirty_map, end, nblocks)) {
+        end = bitmap_find_zero(dirty_map, bit, nblocks);
+        drop_blocks(disk, bit, end - bit);
+    }
+    free(blocks);
+}
@@ -0,0 +1,94 @@
+#ifndef EXT2_JOURNAL_H
+#define EXT2_JOURNAL_H
+
+#include "ext2.h"
+
+/*
+ * On-disk layout of an ext3 (JBD) journal, kept in the blocks of inode
+ * s_journal_inum. Every field is big-endian.
+ *
+ * Block 0 of the journal holds its superblock; the rest is a circular
+ * log of transactions. A transaction is one or more descriptor blocks,
+ * each a list of tags saying where the copies of metadata blocks that
+ * follow it belong, and then a commit block. Only transactions whose
+ * commit block made it to the disk are replayed after a crash. A
+ * transaction may also hold revoke blocks, listing blocks whose copies
+ * logged by it or earlier transactions must not be replayed (they were
+ * freed, and may hold file data since).
+ */
+#define JBD_MAGIC		0xC03B3998U
+
+#define JBD_DESCRIPTOR_BLOCK	1
+#define JBD_COMMIT_BLOCK	2
+#define JBD_SUPERBLOCK_V1	3
+#define JBD_SUPERBLOCK_V2	4
+#define JBD_REVOKE_BLOCK	5
+
+struct jbd_header {
+	unsigned int	h_magic;
+	unsigned int	h_blocktype;
+	unsigned int	h_sequence;	/* Transaction the block belongs to */
+};
+
+struct jbd_superblock {
+	struct jbd_header s_header;
+	unsigned int	s_blocksize;
+	unsigned int	s_maxlen;	/* Blocks in the journal */
+	unsigned int	s_first;	/* First block of the log */
+	unsigned int	s_sequence;	/* First transaction expected in the log */
+	unsigned int	s_start;	/* Its first block (0: the log is empty) */
+	unsigned int	s_errno;
+	/* V2 superblocks only */
+	unsigned int	s_feature_compat;
+	unsigned int	s_feature_incompat;
+	unsigned int	s_feature_ro_compat;
+	unsigned char	s_uuid[16];
+};
+
+#define JBD_FEATURE_INCOMPAT_REVOKE	0x0001
+
+struct jbd_revoke_header {
+	struct jbd_header r_header;
+	unsigned int	r_count;	/* Bytes used in the block, header included */
+};
+
+struct jbd_tag {
+	unsigned int	t_blocknr;	/* Where the block belongs on the disk */
+	unsigned short	t_checksum;
+	unsigned short	t_flags;
+};
+
+#define JBD_FLAG_ESCAPE		1	/* Block started with JBD_MAGIC (zeroed) */
+#define JBD_FLAG_SAME_UUID	2	/* No UUID follows this tag */
+#define JBD_FLAG_LAST_TAG	8
+
+/////////////////////////////////////////
+// JOURNALING CHANGES TO AN OPEN IMAGE
+/////////////////////////////////////////
+
+// An open image's journal (private to ext2_journal.c)
+struct journal;
+
+/* Checks whether the image mapped at 'disk' (open for writing on 'fd')
+ * has an internal journal this code can use. If so, first replays any
+ * transactions a crash left committed in it straight into the file, then
+ * flags the image as needing recovery (until journal_close()) and
+ * returns the journal. Changes must then reach the file only through
+ * journal_commit(). Returns NULL for images without a journal. */
+struct journal* journal_open (unsigned char* disk, int fd);
+
+/* Writes the blocks set in 'dirty_map' back to the file as one
+ * transaction, in ordered mode: blocks also set in 'data_map' (file data)
+ * go straight to their place, then the rest (metadata) through the
+ * journal, and only once that has committed, to their place. Transactions
+ * too large for the journal are split, and are only atomic piece by piece.
+ */
+void journal_commit (struct journal* jnl, unsigned char* disk,
+                     const unsigned char* dirty_map,
+                     const unsigned char* data_map);
+
+/* Marks the image as cleanly closed (nothing left to recover), and frees
+ * the journal */
+void journal_close (struct journal* jnl, unsigned char* disk);
+
+#endif
@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <assert.h>
 #include "ext2_utils.h"
+#include "ext2_ops.h"
 
 unsigned char *disk;
 
@@ -39,41 +40,16 @@ int main(int argc, char **argv) {
             <link target> <link storage location>\n");
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-	   perror("mmap");
-	   exit(1);
-    }
+    disk = open_image(argv[1], O_RDWR);
 
     char* target = copy_arg(argv[2]);
     char* new_loc = copy_arg(argv[3]);
 
-    // ERRORTRAPPING OF INPUT
-    struct ext2_inode *tar_inode = find_inode(target, disk);
-    exit_if(!tar_inode, ENOENT);   // File does not exist
-
-    exit_if(tar_inode->i_mode & EXT2_S_IFDIR, EISDIR); // File is a directory
-
-    struct ext2_inode *new_inode = find_inode(new_loc, disk);
-    exit_if(new_inode!=NULL, EEXIST);    // New location is occupied
-
-    //////////////////////////////////////////
-
-    // Gets the inode number for the target file.
-    struct ext2_dir_entry_2* tar_dir_entry = find_dir_entry(target, disk);
-    unsigned int tar_inum = tar_dir_entry->inode;
-
-    tar_inode->i_links_count++;     
-
-    // Find the parent directory of the path where we'll make the new link
-    struct ext2_inode* par_dir = find_inode(get_pdir_name(new_loc), disk);
-    
-    // Makes a new directory entry for the new hard link 
-    add_dir_entr(disk, par_dir, tar_inum, new_loc, EXT2_FT_REG_FILE);
+    // Makes the link, unless the paths are bad
+    int err = do_ln(disk, target, new_loc);
+    exit_if(err, err);
 
     // Writes all changes back into the .img file
-    assert(write(fd, disk, EXT2_ADDR_PER_BLOCK * EXT2_BLOCK_SIZE)>0);
+    close_image(disk);
     return 0;
 }
\ No newline at end of file
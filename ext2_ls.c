@@ -11,6 +11,14 @@
  *                Unlike ls -1, it should also print . and ... In other words, 
  *                it will print one line for every directory entry in the directory specified by the absolute path.
  *                If the directory does not exist print "No such file or diretory".
+ *                With -R, every directory under the path is listed as "path:" followed
+ *                by its entries; with -u, the KiB and bytes used under each directory
+ *                are printed instead, like du. -j N sets how many threads walk the
+ *                tree (one per CPU by default). -I mmap|io_uring picks how cold blocks
+ *                are read in (io_uring where the kernel has it, by default). With -l,
+ *                each entry's mode, links, owner, size and mtime are printed too, like
+ *                ls -l; -f json or -f csv prints the same (plus inode and blocks) as
+ *                JSON or CSV instead.
  * 
  * Copyright 2015 Seungkyu Kim all rights reserved
  * ============================================================================================
@@ -26,51 +34,54 @@
 #include <string.h>
 #include <errno.h>
 #include "ext2_utils.h"
+#include "ext2_ops.h"
 
 unsigned char *disk;
 
-int main(int argc, char **argv) {
+static void usage (void) {
+    fprintf(stderr, "Usage: ext2_ls [-R | -u | -l | -f json|csv] "
+                     "[-j <threads>] [-I mmap|io_uring] "
+                     "<image file name> <absolute path on the disk> \n");
+    exit(1);
+}
 
-    if(argc != 3) {
-        fprintf(stderr, "Usage: ext2_ls <image file name> "
-                         "<absolute path on the disk> \n");
-        exit(1);
-    }
-    int fd = open(argv[1], O_RDWR);
+int main(int argc, char **argv) {
+    int opt, recursive = 0, du = 0, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int format = -1;
+    char* io = NULL;
 
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-	   perror("mmap");
-	   exit(1);
+    while((opt = getopt(argc, argv, "Ruj:I:lf:")) != -1) {
+        if(opt == 'R')
+            recursive = 1;
+        else if(opt == 'u')
+            du = 1;
+        else if(opt == 'j')
+            nthreads = atoi(optarg);
+        else if(opt == 'I')
+            io = optarg;
+        else if(opt == 'l')
+            format = LS_LONG;
+        else if(opt == 'f' && !strcmp(optarg, "json"))
+            format = LS_JSON;
+        else if(opt == 'f' && !strcmp(optarg, "csv"))
+            format = LS_CSV;
+        else
+            usage();
     }
+    if (argc - optind != 2 || (format >= 0 && (recursive || du)))
+        usage();
+    disk = open_image(argv[optind], O_RDONLY);
+    exit_if(io && set_block_io(disk, io) < 0, EINVAL);
 
-    char* path = copy_arg(argv[2]);
-    struct ext2_inode *cur_dir = find_inode(path, disk);
-    if(!cur_dir) { // Invalid path
+    char* path = copy_arg(argv[optind + 1]);
+    int err = (recursive || du) ? 
+              do_ls_tree(disk, path, stdout, nthreads, du) :
+              (format >= 0) ? do_ls_long(disk, path, stdout, format) :
+              do_ls(disk, path, stdout);
+    if(err) { // Invalid path
         fprintf(stderr, "No such file or directory\n");
         exit(1);
     } 
 
-    // If the specified path is a regular file, just prints out its name.
-    if (cur_dir->i_mode & EXT2_S_IFREG) {
-        printf("%s\n", pathname_final(path));
-        return 0;
-    }
-
-    // Prints out all the directory blocks' names
-    unsigned int b;     // Block number
-    struct ext2_dir_entry_2 *d_entry;
-    unsigned int offset;
-    for (b=0; b<EXT2_NUM_DIR_PTRS; b++) {
-        if(cur_dir->i_block[b]) {
-            while (offset < cur_dir->i_size){
-                d_entry = (struct ext2_dir_entry_2*)(disk + 
-                            EXT2_BLOCK_SIZE*cur_dir->i_block[b] + offset);
-                printf("%s\n", extract_name(d_entry));
-                offset += d_entry->rec_len;
-            }
-        }
-    }
-
     return 0;
 }
\ No newline at end of file
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <assert.h>
 #include "ext2_utils.h"
+#include "ext2_ops.h"
 #include <errno.h>
 
 unsigned char *disk;
@@ -38,44 +39,15 @@ int main(int argc, char **argv) {
             "<absolute path on ext2 formatted disk>\n");
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-	   perror("mmap");
-	   exit(1);
-    }
+    disk = open_image(argv[1], O_RDWR);
 
     char* v_name = copy_arg(argv[2]);
 
-    // ERRORTRAPPING OF INPUT
-    
-    struct ext2_inode* cur_dir = find_inode(v_name, disk);
-    exit_if(cur_dir!=NULL,EEXIST); // Specified directory already exists
-
-    struct ext2_inode* p_directory = find_inode(get_pdir_name(v_name), disk);
-    exit_if(!p_directory,ENOENT); // Parent of specified directory doesn't exist
-
-    ////////////////////////////////////////////////
-   
-    // Allocates an inode & a directory entry for the new directory itself
-    unsigned int n_inode_idx = alloc_file(disk, EXT2_BLOCK_SIZE, EXT2_S_IFDIR);
-    struct ext2_inode* n_inode = inum_to_inode(n_inode_idx,disk);
-    add_dir_entr(disk, p_directory, n_inode_idx, v_name, EXT2_FT_DIR);
-
-    // Adds '.' to the new directory
-    add_dir_entr(disk, n_inode, n_inode_idx, ".", EXT2_FT_DIR);
-    n_inode->i_links_count++;
-
-    // Adds '..' to the new directory
-    add_dir_entr(disk, n_inode, n_inode_idx, "..", EXT2_FT_DIR);
-    p_directory->i_links_count++;
+    // Makes the directory, unless the path is bad
+    int err = do_mkdir(disk, v_name);
+    exit_if(err, err);
 
     // Writes all changes back into the .img file
-    assert(write(fd, disk, EXT2_ADDR_PER_BLOCK * EXT2_BLOCK_SIZE)>0);
+    close_image(disk);
     return 0;
 }
-
-
-
-
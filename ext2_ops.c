@@ -0,0 +1,857 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "ext2_utils.h"
+#include "ext2_ops.h"
+#include "ext2_walk.h"
+
+/* Finds the directory that will hold the new entry 'path', storing its 
+ * inode number in '*p_inum'. Returns 0, or the errno value to fail with
+ * if 'path' is taken or its parent isn't an existing directory. On 
+ * success the parent is left locked (see inode_lock()), so the name 
+ * can't be taken before the caller adds it and unlocks the parent. */
+static int new_entry_parent (unsigned char* disk, char* path, 
+                             unsigned int* p_inum) {
+    char *p_path = get_pdir_name(path);
+    struct ext2_inode* p_inode;
+
+    *p_inum = find_inum(p_path, disk);
+    free(p_path);
+
+    if(!*p_inum)
+        return ENOENT;  // Parent not found in virtual file system
+    p_inode = inum_to_inode(*p_inum, disk);
+    if(!(p_inode->i_mode & EXT2_S_IFDIR))
+        return ENOTDIR;
+    inode_lock(disk, p_inode);
+    if(find_inum(path, disk)) {
+        inode_unlock(disk, p_inode);
+        return EEXIST;  // File already exists
+    }
+    return 0;
+}
+
+/* Makes a new, empty-but-allocated regular file at 'v_path' for the
+ * native file 'fd' described by 'st' (with the same holes), storing its
+ * inode in '*n_inode'. Returns 0, or the errno value to fail with. */
+static int create_file (unsigned char* disk, char* v_path, struct stat* st,
+                        int fd, struct ext2_inode** n_inode) {
+    unsigned int p_inum;
+    int err = new_entry_parent(disk, v_path, &p_inum);
+
+    if(err)
+        return err;
+
+    // Allocates inodes & blocks for a new file
+    unsigned int free_inode = alloc_file(disk, st->st_size, 
+                                         EXT2_S_IFREG, p_inum, fd);
+    *n_inode = inum_to_inode(free_inode, disk);
+
+    // Creates a new directory entry for the newly copied file.
+    add_dir_entr(disk, inum_to_inode(p_inum, disk), free_inode, v_path,
+                 EXT2_FT_REG_FILE);
+    inode_unlock(disk, inum_to_inode(p_inum, disk));
+    return 0;
+}
+
+/* Copies the native file 'native_path' to the absolute path 'v_path'
+ * on the disk (like ext2_cp) */
+int do_cp (unsigned char* disk, char* native_path, char* v_path) {
+    struct ext2_inode* n_inode;
+    struct stat st;
+    unsigned int p_inum, n_inum;
+    int err;
+
+    // ERRORTRAPPING OF INPUT
+
+    int native_fd = open(native_path, O_RDONLY);
+    if(native_fd < 0)
+        return ENOENT;  // File not found in native file system
+
+    // Gets the size of the file
+    if(fstat(native_fd, &st) < 0)
+        err = errno;
+    else if(S_ISDIR(st.st_mode))
+        err = EISDIR;
+    else if(!(err = new_entry_parent(disk, v_path, &p_inum)))
+        inode_unlock(disk, inum_to_inode(p_inum, disk));
+    if(err) {
+        close(native_fd);
+        return err;
+    }
+
+    // Filled in before it's linked, so no one can read it half copied
+    n_inum = alloc_file(disk, st.st_size, EXT2_S_IFREG, p_inum, native_fd);
+    n_inode = inum_to_inode(n_inum, disk);
+    write_file(disk, n_inode, st.st_size, native_fd);
+    close(native_fd);
+
+    err = new_entry_parent(disk, v_path, &p_inum);
+    if(err) {   // Taken (or its parent removed) meanwhile
+        dealloc_file(disk, n_inode);
+        n_inode->i_dtime = time(NULL);
+        mark_dirty(disk, n_inode, sizeof(struct ext2_inode));
+        rem_inode_from_imap(n_inum, disk);
+        return err;
+    }
+    add_dir_entr(disk, inum_to_inode(p_inum, disk), n_inum, v_path,
+                 EXT2_FT_REG_FILE);
+    inode_unlock(disk, inum_to_inode(p_inum, disk));
+    return 0;
+}
+
+/////////////////////////////////////////
+// RECURSIVE IMPORT
+/////////////////////////////////////////
+
+#define COPY_QUEUE_MAX  256     // Files allocated ahead of the copy threads
+
+// A file whose blocks are allocated, waiting for its data to be copied in
+struct copy_job {
+    struct copy_job* next;
+    struct ext2_inode* inode;
+    long int f_size;
+    int fd;
+};
+
+/* Files handed from the (single) thread walking the native tree to the
+ * threads copying data. Bounded, so the walk can't hold too many native
+ * files open at once. */
+struct copy_queue {
+    unsigned char* disk;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    struct copy_job *head, *tail;
+    unsigned int len;
+    int done;                   // Set once the walk has queued everything
+};
+
+/* Copies the data of queued files until the walk is over and the queue
+ * drained. Each file's blocks were allocated up front, so threads only
+ * ever write to disjoint blocks. */
+static void* copy_worker (void* arg) {
+    struct copy_queue* q = arg;
+    struct copy_job* job;
+
+    for(;;) {
+        pthread_mutex_lock(&q->lock);
+        while(!q->head && !q->done)
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        job = q->head;
+        if(job) {
+            q->head = job->next;
+            if(!q->head)
+                q->tail = NULL;
+            q->len--;
+            pthread_cond_signal(&q->not_full);
+        }
+        pthread_mutex_unlock(&q->lock);
+        if(!job)
+            return NULL;
+
+        write_file(q->disk, job->inode, job->f_size, job->fd);
+        close(job->fd);
+        free(job);
+    }
+}
+
+/* Creates the file 'v_path' for the native file 'native_path' (whose
+ * details are in 'st') and queues its data to be copied in */
+static int queue_file (struct copy_queue* q, char* native_path, 
+                       char* v_path, struct stat* st) {
+    struct copy_job* job;
+    struct ext2_inode* n_inode;
+    int err, fd = open(native_path, O_RDONLY);
+
+    if(fd < 0)
+        return errno;
+    if((err = create_file(q->disk, v_path, st, fd, &n_inode))) {
+        close(fd);
+        return err;
+    }
+
+    job = malloc(sizeof(*job));
+    exit_if(!job, ENOMEM);
+    job->next = NULL;
+    job->inode = n_inode;
+    job->f_size = st->st_size;
+    job->fd = fd;
+
+    pthread_mutex_lock(&q->lock);
+    while(q->len >= COPY_QUEUE_MAX)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    if(q->tail)
+        q->tail->next = job;
+    else
+        q->head = job;
+    q->tail = job;
+    q->len++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* Recreates the native directory 'native_path' at 'v_path', then
+ * everything in it: subdirectories recursively, and regular files by 
+ * allocating them and queueing their data on 'q' */
+static int import_dir (struct copy_queue* q, char* native_path, 
+                       char* v_path) {
+    struct dirent* d;
+    struct stat st;
+    char *n_child, *v_child;
+    int err = do_mkdir(q->disk, v_path);
+    DIR* dir;
+
+    if(err)
+        return err;
+    if(!(dir = opendir(native_path)))
+        return errno;
+
+    while(!err && (d = readdir(dir))) {
+        if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+        n_child = join_path(native_path, d->d_name, strlen(d->d_name));
+        v_child = join_path(v_path, d->d_name, strlen(d->d_name));
+
+        if(lstat(n_child, &st) < 0)
+            err = errno;
+        else if(S_ISDIR(st.st_mode))
+            err = import_dir(q, n_child, v_child);
+        else if(S_ISREG(st.st_mode))
+            err = queue_file(q, n_child, v_child, &st);
+        else    // Links, devices etc. have no ext2_* equivalent here
+            fprintf(stderr, "Skipping %s: not a regular file or directory\n",
+                    n_child);
+
+        free(n_child);
+        free(v_child);
+    }
+    closedir(dir);
+    return err;
+}
+
+/* Copies the native file or directory tree 'native_path' to the absolute
+ * path 'v_path' on the disk (like ext2_cp -r). Directories are created
+ * and files allocated by one thread, in order, while 'nthreads' threads
+ * copy file data into the blocks already set aside for it. If something
+ * fails part way, what was imported before it is kept. */
+int do_cp_tree (unsigned char* disk, char* native_path, char* v_path,
+                int nthreads) {
+    struct copy_queue q = { .disk = disk };
+    pthread_t* threads;
+    struct stat st;
+    int i, err;
+
+    if(stat(native_path, &st) < 0)
+        return ENOENT;  // File not found in native file system
+    if(!S_ISDIR(st.st_mode))
+        return do_cp(disk, native_path, v_path);
+
+    nthreads = MAX(nthreads, 1);
+    threads = malloc(nthreads * sizeof(*threads));
+    exit_if(!threads, ENOMEM);
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.not_empty, NULL);
+    pthread_cond_init(&q.not_full, NULL);
+    for(i = 0; i < nthreads; i++)
+        exit_if(pthread_create(&threads[i], NULL, copy_worker, &q), EAGAIN);
+
+    err = import_dir(&q, native_path, v_path);
+
+    // Lets the copy threads finish off the queue, then stop
+    pthread_mutex_lock(&q.lock);
+    q.done = 1;
+    pthread_cond_broadcast(&q.not_empty);
+    pthread_mutex_unlock(&q.lock);
+    for(i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&q.not_full);
+    pthread_cond_destroy(&q.not_empty);
+    pthread_mutex_destroy(&q.lock);
+    free(threads);
+    return err;
+}
+
+// Creates the directory 'v_path' (like ext2_mkdir)
+int do_mkdir (unsigned char* disk, char* v_path) {
+
+    unsigned int p_inum;
+
+    // ERRORTRAPPING OF INPUT
+    int err = new_entry_parent(disk, v_path, &p_inum);
+    if(err)
+        return err;
+    struct ext2_inode* p_directory = inum_to_inode(p_inum, disk);
+
+    ////////////////////////////////////////////////
+
+    // Allocates an inode for the new directory itself
+    unsigned int n_inode_idx = alloc_file(disk, EXT2_BLOCK_SIZE,
+                                          EXT2_S_IFDIR, p_inum, -1);
+    struct ext2_inode* n_inode = inum_to_inode(n_inode_idx,disk);
+
+    // Adds '.' to the new directory, spanning its whole (fresh) block,
+    // then '..'; it's filled in before anyone can look in it
+    struct ext2_dir_entry_2* dot = (struct ext2_dir_entry_2*)(bnum_to_block(
+                                    n_inode->i_block[0], disk));
+    memset(dot, 0, EXT2_BLOCK_SIZE);
+    dot->inode = n_inode_idx;
+    dot->rec_len = EXT2_BLOCK_SIZE;
+    dot->name_len = 1;
+    dot->file_type = EXT2_FT_DIR;
+    dot->name[0] = '.';
+    mark_dirty(disk, dot, EXT2_BLOCK_SIZE);
+    add_entr_to_block(disk, (unsigned char*)dot, p_inum, "..", 2, 
+                      EXT2_FT_DIR);
+    n_inode->i_links_count++;
+    mark_dirty(disk, n_inode, sizeof(struct ext2_inode));
+
+    // Links it into its parent
+    add_dir_entr(disk, p_directory, n_inode_idx, v_path, EXT2_FT_DIR);
+    p_directory->i_links_count++;
+    mark_dirty(disk, p_directory, sizeof(struct ext2_inode));
+    inode_unlock(disk, p_directory);
+    return 0;
+}
+
+// Makes 'new_loc' a hard link to the file 'target' (like ext2_ln)
+int do_ln (unsigned char* disk, char* target, char* new_loc) {
+
+    // ERRORTRAPPING OF INPUT
+
+    // Gets the inode number for the target file.
+    unsigned int tar_inum = find_inum(target, disk);
+    if(!tar_inum)
+        return ENOENT;  // File does not exist
+    struct ext2_inode *tar_inode = inum_to_inode(tar_inum, disk);
+    if(tar_inode->i_mode & EXT2_S_IFDIR)
+        return EISDIR;  // File is a directory
+
+    // Counts the link up front, so the target can't go while it's made
+    // (one inode lock at a time)
+    inode_lock(disk, tar_inode);
+    if(!tar_inode->i_links_count) {
+        inode_unlock(disk, tar_inode);
+        return ENOENT;  // Removed meanwhile
+    }
+    tar_inode->i_links_count++;
+    mark_dirty(disk, tar_inode, sizeof(struct ext2_inode));
+    inode_unlock(disk, tar_inode);
+
+    // Find the parent directory of the path where we'll make the new link
+    unsigned int p_inum;
+    int err = new_entry_parent(disk, new_loc, &p_inum);
+    if(err) {
+        inode_lock(disk, tar_inode);
+        tar_inode->i_links_count--;
+        inode_unlock(disk, tar_inode);
+        return err;     // New location is occupied, or has no parent
+    }
+
+    //////////////////////////////////////////
+
+    // Makes a new directory entry for the new hard link
+    add_dir_entr(disk, inum_to_inode(p_inum, disk), tar_inum, new_loc,
+                 EXT2_FT_REG_FILE);
+    inode_unlock(disk, inum_to_inode(p_inum, disk));
+    return 0;
+}
+
+// Removes the file or link 'target' (like ext2_rm)
+int do_rm (unsigned char* disk, char* target) {
+
+    // ERRORTRAPPING OF INPUT
+    struct ext2_inode *tar_inode = find_inode(target, disk);
+    if(!tar_inode)
+        return ENOENT;  // File not found
+    if(tar_inode->i_mode & EXT2_S_IFDIR)
+        return EISDIR;  // Is a directory
+
+    //////////////////////////////////////////
+
+    // Gets the parent directory's inode, and delinks the target's entry
+    char* p_path = get_pdir_name(target);
+    struct ext2_inode* p_inode = find_inode(p_path, disk);
+    unsigned int tar_inum = rem_dir_entr(disk, p_inode, target);
+    free(p_path);
+    if(!tar_inum)
+        return ENOENT;  // Removed meanwhile
+    tar_inode = inum_to_inode(tar_inum, disk);
+
+    inode_lock(disk, tar_inode);
+    tar_inode->i_links_count--;
+    mark_dirty(disk, tar_inode, sizeof(struct ext2_inode));
+
+    // The inode itself goes only with its last link
+    if (tar_inode->i_links_count == 0) {
+        dealloc_file(disk, tar_inode); // Deallocates the data blocks
+        tar_inode->i_dtime = time(NULL);
+        rem_inode_from_imap(tar_inum, disk);
+    }
+    inode_unlock(disk, tar_inode);
+    return 0;
+}
+
+/* Writes 'len' bytes of the regular file 'v_path', starting 'off' bytes
+ * in, to the native file descriptor 'out_fd' (like ext2_cat) */
+int do_cat (unsigned char* disk, char* v_path, unsigned long off,
+            unsigned long len, int out_fd) {
+    struct ext2_inode *inode = find_inode(v_path, disk);
+
+    if(!inode)
+        return ENOENT;  // File not found
+    if((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR)
+        return EISDIR;  // Is a directory
+    if((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFREG)
+        return EINVAL;  // A symlink, device, FIFO or socket
+
+    return read_file(disk, inode, off, len, out_fd);
+}
+
+/* Writes what the inode of 'path' holds to 'out' as one line of
+ * key=value pairs (like stat) */
+int do_stat (unsigned char* disk, char* path, FILE* out) {
+    unsigned int inum = find_inum(path, disk);
+    struct ext2_inode* inode;
+
+    if(!inum)
+        return ENOENT;  // File not found
+    inode = inum_to_inode(inum, disk);
+    fprintf(out, "inode=%u mode=0%o links=%u uid=%u gid=%u size=%lu "
+                 "blocks=%u atime=%u mtime=%u ctime=%u\n", inum,
+            inode->i_mode, inode->i_links_count, inode->i_uid, inode->i_gid,
+            get_inode_size(inode), inode->i_blocks, inode->i_atime,
+            inode->i_mtime, inode->i_ctime);
+    return 0;
+}
+
+/* Writes the name of the file 'path', or of every entry in the
+ * directory 'path', to 'out', one per line (like ext2_ls) */
+int do_ls (unsigned char* disk, char* path, FILE* out) {
+    struct ext2_inode *cur_dir = find_inode(path, disk);
+    struct ext2_dir_entry_2 *d_entry;
+    struct block_iter it;
+    unsigned int bnum, offset;
+    int is_meta;
+
+    if(!cur_dir)    // Invalid path
+        return ENOENT;
+
+    // If the specified path is a regular file, just prints out its name.
+    if (!(cur_dir->i_mode & EXT2_S_IFDIR)) {
+        fprintf(out, "%s\n", pathname_final(path));
+        return 0;
+    }
+
+    // Prints out the names in all the directory's blocks
+    inode_lock(disk, cur_dir);
+    fetch_dir(disk, cur_dir, 0);
+    block_iter_init(&it, disk, cur_dir, 0,
+                    cur_dir->i_size / EXT2_BLOCK_SIZE, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(is_meta || !bnum)
+            continue;
+        for(offset = 0; offset < EXT2_BLOCK_SIZE; offset += d_entry->rec_len) {
+            d_entry = (struct ext2_dir_entry_2*)(bnum_to_block(bnum, disk)
+                                                 + offset);
+            if(!d_entry->rec_len)   // Corrupt block; don't spin on it
+                break;
+            if(d_entry->inode)
+                fprintf(out, "%.*s\n", d_entry->name_len, d_entry->name);
+        }
+    }
+    inode_unlock(disk, cur_dir);
+    return 0;
+}
+
+/////////////////////////////////////////
+// LONG & MACHINE-READABLE LISTINGS
+/////////////////////////////////////////
+
+#define LS_BUF_SIZE     65536   // Output gathered before each fwrite()
+
+// One entry of a listed directory, with what's shown of its inode
+struct ls_entry {
+    unsigned int inum;
+    size_t name_off;            // Into the listing's name buffer
+    unsigned int name_len;
+    unsigned short mode, links, uid, gid;
+    unsigned long size;
+    unsigned int blocks, mtime;
+};
+
+// Output gathered into one reused buffer, written out as it fills
+struct ls_out {
+    FILE* out;
+    size_t len;
+    char buf[LS_BUF_SIZE];
+};
+
+static void ls_flush (struct ls_out* o) {
+    fwrite(o->buf, 1, o->len, o->out);
+    o->len = 0;
+}
+
+static void ls_putc (struct ls_out* o, char c) {
+    if(o->len == LS_BUF_SIZE)
+        ls_flush(o);
+    o->buf[o->len++] = c;
+}
+
+// Appends what the printf()-style 'fmt' makes (short fields only)
+static void ls_printf (struct ls_out* o, const char* fmt, ...) {
+    va_list ap;
+    int n;
+
+    if(LS_BUF_SIZE - o->len < 256)
+        ls_flush(o);
+    va_start(ap, fmt);
+    n = vsnprintf(o->buf + o->len, LS_BUF_SIZE - o->len, fmt, ap);
+    va_end(ap);
+    o->len += MIN((size_t)n, LS_BUF_SIZE - o->len - 1);
+}
+
+// Appends the 'len' bytes of 'name', quoted as 'format' needs
+static void ls_name (struct ls_out* o, const char* name, unsigned int len,
+                     int format) {
+    unsigned int i;
+    int quote = 0;
+
+    if(format == LS_JSON) {
+        ls_putc(o, '"');
+        for(i = 0; i < len; i++) {
+            if(name[i] == '"' || name[i] == '\\') {
+                ls_putc(o, '\\');
+                ls_putc(o, name[i]);
+            } else if((unsigned char)name[i] < 0x20)
+                ls_printf(o, "\\u%04x", (unsigned char)name[i]);
+            else
+                ls_putc(o, name[i]);
+        }
+        ls_putc(o, '"');
+        return;
+    }
+
+    // CSV quotes a field holding a separator, quote or line break
+    for(i = 0; format == LS_CSV && i < len; i++)
+        quote |= (name[i] == ',' || name[i] == '"' || name[i] == '\n' ||
+                  name[i] == '\r');
+    if(quote)
+        ls_putc(o, '"');
+    for(i = 0; i < len; i++) {
+        if(quote && name[i] == '"')
+            ls_putc(o, '"');
+        ls_putc(o, name[i]);
+    }
+    if(quote)
+        ls_putc(o, '"');
+}
+
+// Fills in what's shown of 'e' from its inode
+static void ls_stat (unsigned char* disk, struct ls_entry* e) {
+    struct ext2_inode* inode = inum_to_inode(e->inum, disk);
+
+    e->mode = inode->i_mode;
+    e->links = inode->i_links_count;
+    e->uid = inode->i_uid;
+    e->gid = inode->i_gid;
+    e->size = get_inode_size(inode);
+    e->blocks = inode->i_blocks;
+    e->mtime = inode->i_mtime;
+}
+
+// Writes the line for entry 'e' named by the 'len' bytes at 'name'
+static void ls_line (struct ls_out* o, struct ls_entry* e, const char* name,
+                     int format, int first) {
+    static const char* rwx = "rwxrwxrwx";
+    char perms[11], when[20];
+    time_t t = e->mtime;
+    struct tm tm;
+    int i;
+
+    if(format == LS_JSON) {
+        ls_printf(o, "%s{\"name\":", first ? "" : ",\n");
+        ls_name(o, name, e->name_len, format);
+        ls_printf(o, ",\"inode\":%u,\"mode\":\"0%o\",\"links\":%u,"
+                     "\"uid\":%u,\"gid\":%u,\"size\":%lu,\"blocks\":%u,"
+                     "\"mtime\":%u}", e->inum, e->mode, e->links, e->uid,
+                  e->gid, e->size, e->blocks, e->mtime);
+        return;
+    }
+    if(format == LS_CSV) {
+        ls_name(o, name, e->name_len, format);
+        ls_printf(o, ",%u,0%o,%u,%u,%u,%lu,%u,%u\n", e->inum, e->mode,
+                  e->links, e->uid, e->gid, e->size, e->blocks, e->mtime);
+        return;
+    }
+
+    // Like ls -l: type & permissions, links, owner, size, time, name
+    perms[0] = (e->mode & EXT2_S_IFMT) == EXT2_S_IFDIR ? 'd' :
+               (e->mode & EXT2_S_IFMT) == EXT2_S_IFLNK ? 'l' : '-';
+    for(i = 0; i < 9; i++)
+        perms[i + 1] = (e->mode & (0400 >> i)) ? rwx[i] : '-';
+    perms[10] = '\0';
+    localtime_r(&t, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+    ls_printf(o, "%s %3u %5u %5u %10lu %s ", perms, e->links, e->uid,
+              e->gid, e->size, when);
+    ls_name(o, name, e->name_len, format);
+    ls_putc(o, '\n');
+}
+
+static int cmp_ls_inum (const void* a, const void* b) {
+    const struct ls_entry *x = *(struct ls_entry* const*)a;
+    const struct ls_entry *y = *(struct ls_entry* const*)b;
+
+    return (x->inum > y->inum) - (x->inum < y->inum);
+}
+
+/* Writes a line for the file 'path', or for every entry in the directory
+ * 'path', with its inode, mode, link count, owner, size, blocks and mtime
+ * (like ext2_ls -l; see enum ls_format). Each directory block is read
+ * once, then the inodes in inode number order, so the inode table is read
+ * front to back; lines go out through one buffer in directory order. */
+int do_ls_long (unsigned char* disk, char* path, FILE* out, int format) {
+    unsigned int inum = find_inum(path, disk), bnum, offset, i;
+    struct ext2_inode *cur_dir;
+    struct ext2_dir_entry_2 *d_entry;
+    struct ls_entry *entries = NULL, **order;
+    struct ls_out* o;
+    struct block_iter it;
+    size_t n = 0, cap = 0, names_len = 0, names_cap = 0;
+    char *names = NULL;
+    int is_meta;
+
+    if(!inum)       // Invalid path
+        return ENOENT;
+    cur_dir = inum_to_inode(inum, disk);
+    o = malloc(sizeof(*o));
+    exit_if(!o, ENOMEM);
+    o->out = out;
+    o->len = 0;
+    if(format == LS_JSON)
+        ls_printf(o, "[\n");
+    else if(format == LS_CSV)
+        ls_printf(o, "name,inode,mode,links,uid,gid,size,blocks,mtime\n");
+
+    // A file is listed on its own
+    if(!(cur_dir->i_mode & EXT2_S_IFDIR)) {
+        struct ls_entry e;
+        char* name = pathname_final(path);
+
+        e.inum = inum;
+        e.name_len = strlen(name);
+        ls_stat(disk, &e);
+        ls_line(o, &e, name, format, 1);
+        if(format == LS_JSON)
+            ls_printf(o, "\n]\n");
+        ls_flush(o);
+        free(o);
+        return 0;
+    }
+
+    // Gathers the entries, each directory block read just once
+    inode_lock(disk, cur_dir);
+    fetch_dir(disk, cur_dir, 1);
+    block_iter_init(&it, disk, cur_dir, 0,
+                    cur_dir->i_size / EXT2_BLOCK_SIZE, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(is_meta || !bnum)
+            continue;
+        for(offset = 0; offset < EXT2_BLOCK_SIZE; offset += d_entry->rec_len) {
+            d_entry = (struct ext2_dir_entry_2*)(bnum_to_block(bnum, disk)
+                                                 + offset);
+            if(!d_entry->rec_len)   // Corrupt block; don't spin on it
+                break;
+            if(!d_entry->inode)
+                continue;
+            if(n == cap) {
+                cap = cap ? 2 * cap : 256;
+                entries = realloc(entries, cap * sizeof(*entries));
+                exit_if(!entries, ENOMEM);
+            }
+            if(names_len + d_entry->name_len > names_cap) {
+                names_cap = MAX(2 * names_cap, 4096);
+                names = realloc(names, names_cap);
+                exit_if(!names, ENOMEM);
+            }
+            memcpy(names + names_len, d_entry->name, d_entry->name_len);
+            entries[n].inum = d_entry->inode;
+            entries[n].name_off = names_len;
+            entries[n++].name_len = d_entry->name_len;
+            names_len += d_entry->name_len;
+        }
+    }
+
+    // Reads the inodes in inode number order
+    order = malloc(MAX(n, 1) * sizeof(*order));
+    exit_if(!order, ENOMEM);
+    for(i = 0; i < n; i++)
+        order[i] = &entries[i];
+    qsort(order, n, sizeof(*order), cmp_ls_inum);
+    for(i = 0; i < n; i++)
+        ls_stat(disk, order[i]);
+    inode_unlock(disk, cur_dir);
+
+    for(i = 0; i < n; i++)
+        ls_line(o, &entries[i], names + entries[i].name_off, format, !i);
+    if(format == LS_JSON)
+        ls_printf(o, "%s]\n", n ? "\n" : "");
+    ls_flush(o);
+    free(o);
+    free(order);
+    free(entries);
+    free(names);
+    return 0;
+}
+
+// Compacts 'dir' and every directory under it, parents first
+static void compact_tree (unsigned char* disk, struct walk_dir* dir, 
+                          int sort, FILE* out) {
+    struct ext2_inode* inode = inum_to_inode(dir->inum, disk);
+    struct walk_dir* child;
+    unsigned long before = compact_dir(disk, inode, sort);
+
+    if(out)
+        fprintf(out, "%lu\t%lu\t%s\n", before, 
+                (unsigned long)inode->i_size / EXT2_BLOCK_SIZE, dir->path);
+    for(child = dir->first_child; child; child = child->next_sibling)
+        compact_tree(disk, child, sort, out);
+}
+
+/* Compacts the directory 'path' (see compact_dir()), or with 'recursive'
+ * set, every directory under it, writing "<blocks before>\t<blocks after>
+ * \t<path>" for each to 'out' unless it's NULL (like ext2_compact) */
+int do_compact (unsigned char* disk, char* path, int sort, int recursive,
+                FILE* out) {
+    struct ext2_inode* inode = find_inode(path, disk);
+    struct walk_dir* root;
+    unsigned long before;
+
+    if(!inode)      // Invalid path
+        return ENOENT;
+    if(!(inode->i_mode & EXT2_S_IFDIR))
+        return ENOTDIR;
+    if(!recursive) {
+        before = compact_dir(disk, inode, sort);
+        if(out)
+            fprintf(out, "%lu\t%lu\t%s\n", before, 
+                    (unsigned long)inode->i_size / EXT2_BLOCK_SIZE, path);
+        return 0;
+    }
+
+    // The tree is walked first, so compacting doesn't move entries under it
+    root = walk_tree(disk, path, 1, 0);
+    compact_tree(disk, root, sort, out);
+    walk_free(root);
+    return 0;
+}
+
+/* Defragments the regular file 'path' (see defrag_file()), or with 'path'
+ * NULL, every regular file on the disk, in inode number order. With
+ * 'measure_only' set, nothing is moved. Writes "<extents before>\t<extents
+ * after>\t<path or inode number>" to 'out' for the file, or for each file
+ * in more than one extent, then a line of the totals over those. */
+int do_defrag (unsigned char* disk, char* path, int measure_only,
+               FILE* out) {
+    struct ext2_super_block* sb = get_sb(disk);
+    struct ext2_inode* inode;
+    unsigned int first_ino, inum, before, after, files = 0;
+    unsigned long total_before = 0, total_after = 0;
+
+    if(path) {
+        inode = find_inode(path, disk);
+        if(!inode)      // Invalid path
+            return ENOENT;
+        if((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR)
+            return EISDIR;
+        if((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFREG)
+            return EINVAL;
+        before = count_extents(disk, inode);
+        after = measure_only ? before : defrag_file(disk, inode);
+        fprintf(out, "%u\t%u\t%s\n", before, after, path);
+        return 0;
+    }
+
+    first_ino = (sb->s_rev_level == EXT2_GOOD_OLD_REV) ?
+                EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+    for(inum = first_ino; inum <= sb->s_inodes_count; inum++) {
+        inode = inum_to_inode(inum, disk);
+        if(!inode->i_links_count ||
+           (inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFREG)
+            continue;
+        before = count_extents(disk, inode);
+        if(before <= 1)
+            continue;
+        after = measure_only ? before : defrag_file(disk, inode);
+        fprintf(out, "%u\t%u\t%u\n", before, after, inum);
+        total_before += before;
+        total_after += after;
+        files++;
+    }
+    fprintf(out, "%lu\t%lu\t(%u fragmented files)\n", total_before,
+            total_after, files);
+    return 0;
+}
+
+// Prints each directory under 'dir' as "path:", then its entries (ls -R)
+static void print_listing (FILE* out, struct walk_dir* dir) {
+    struct walk_dir* child;
+
+    fprintf(out, "%s:\n%.*s", dir->path, (int)dir->listing_len, dir->listing);
+    for(child = dir->first_child; child; child = child->next_sibling) {
+        fprintf(out, "\n");
+        print_listing(out, child);
+    }
+}
+
+/* Prints "KiB<TAB>bytes<TAB>path" for each directory under 'dir', after
+ * those below it (du) */
+static void print_usage (FILE* out, struct walk_dir* dir) {
+    struct walk_dir* child;
+
+    for(child = dir->first_child; child; child = child->next_sibling)
+        print_usage(out, child);
+    fprintf(out, "%lu\t%lu\t%s\n", dir->blocks / 2, dir->size, dir->path);
+}
+
+/* Writes every directory under 'path' with its entries (like ext2_ls -R),
+ * or with 'usage' set, the space used under each one (like du). The tree
+ * is read by 'nthreads' threads, but printed in the same order however
+ * it was split between them. */
+int do_ls_tree (unsigned char* disk, char* path, FILE* out, int nthreads,
+                int usage) {
+    struct ext2_inode *inode = find_inode(path, disk);
+    struct walk_dir* root;
+
+    if(!inode)      // Invalid path
+        return ENOENT;
+
+    // A regular file is its own whole tree
+    if (!(inode->i_mode & EXT2_S_IFDIR)) {
+        if(usage)
+            fprintf(out, "%u\t%lu\t%s\n", inode->i_blocks / 2,
+                    get_inode_size(inode), path);
+        else
+            fprintf(out, "%s\n", pathname_final(path));
+        return 0;
+    }
+
+    root = walk_tree(disk, path, nthreads, !usage);
+    if(usage)
+        print_usage(out, root);
+    else
+        print_listing(out, root);
+    walk_free(root);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef EXT2_OPS_H
+#define EXT2_OPS_H
+
+#include <stdio.h>
+#include "ext2.h"
+
+/////////////////////////////////////////
+// WHOLE OPERATIONS ON AN OPEN IMAGE
+/////////////////////////////////////////
+
+/* Each of these does the work of one of the ext2_* tools on the image
+ * mapped at 'disk', leaving the changes in the mapping for the caller to
+ * flush. They return 0, or an errno value if the arguments are rejected
+ * (in which case the image is left as it was). Running out of space part
+ * way through still exits, as the helpers in ext2_utils.c do. */
+
+/* Copies the native file 'native_path' to the absolute path 'v_path'
+ * on the disk (like ext2_cp). The name is linked in only once the data 
+ * has been copied. */
+int do_cp (unsigned char* disk, char* native_path, char* v_path);
+
+/* Copies the native file or directory tree 'native_path' to the absolute
+ * path 'v_path' on the disk (like ext2_cp -r). Directories are created
+ * and files allocated by one thread, in order, while 'nthreads' threads
+ * copy file data into the blocks already set aside for it. If something
+ * fails part way, what was imported before it is kept. */
+int do_cp_tree (unsigned char* disk, char* native_path, char* v_path,
+                int nthreads);
+
+// Creates the directory 'v_path' (like ext2_mkdir)
+int do_mkdir (unsigned char* disk, char* v_path);
+
+// Makes 'new_loc' a hard link to the file 'target' (like ext2_ln)
+int do_ln (unsigned char* disk, char* target, char* new_loc);
+
+// Removes the file or link 'target' (like ext2_rm)
+int do_rm (unsigned char* disk, char* target);
+
+/* Writes 'len' bytes of the regular file 'v_path', starting 'off' bytes
+ * in, to the native file descriptor 'out_fd' (like ext2_cat) */
+int do_cat (unsigned char* disk, char* v_path, unsigned long off,
+            unsigned long len, int out_fd);
+
+/* Writes what the inode of 'path' holds to 'out' as one line of
+ * key=value pairs: inode, mode (octal), links, uid, gid, size, blocks
+ * (512-byte sectors), atime, mtime and ctime (like stat) */
+int do_stat (unsigned char* disk, char* path, FILE* out);
+
+/* Writes the name of the file 'path', or of every entry in the
+ * directory 'path', to 'out', one per line (like ext2_ls) */
+int do_ls (unsigned char* disk, char* path, FILE* out);
+
+// How do_ls_long() writes each entry
+enum ls_format {
+    LS_LONG,        // Lines like ls -l's
+    LS_JSON,        // A JSON array of objects
+    LS_CSV          // CSV, after a header line
+};
+
+/* Writes a line for the file 'path', or for every entry in the directory
+ * 'path', with its inode, mode, link count, owner, size, blocks and mtime
+ * (like ext2_ls -l), in the given 'format'. The inodes are read in inode
+ * number order, and the output written through one reused buffer. */
+int do_ls_long (unsigned char* disk, char* path, FILE* out, int format);
+
+/* Compacts the directory 'path' (see compact_dir()), or with 'recursive'
+ * set, every directory under it, writing "<blocks before>\t<blocks after>
+ * \t<path>" for each to 'out' unless it's NULL (like ext2_compact) */
+int do_compact (unsigned char* disk, char* path, int sort, int recursive,
+                FILE* out);
+
+/* Defragments the regular file 'path' (see defrag_file()), or with 'path'
+ * NULL, every regular file on the disk. With 'measure_only' set, nothing
+ * is moved. Writes "<extents before>\t<extents after>\t<path or inode
+ * number>" to 'out' for the file, or for each file in more than one
+ * extent, then a line of the totals over those (like ext2_defrag). */
+int do_defrag (unsigned char* disk, char* path, int measure_only,
+               FILE* out);
+
+/* Writes every directory under 'path' with its entries (like ext2_ls -R),
+ * or with 'usage' set, the space used under each one (like du). The tree
+ * is read by 'nthreads' threads, but printed in the same order however
+ * it was split between them. */
+int do_ls_tree (unsigned char* disk, char* path, FILE* out, int nthreads,
+                int usage);
+
+#endif
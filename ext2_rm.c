@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <assert.h>
 #include "ext2_utils.h"
+#include "ext2_ops.h"
 
 unsigned char *disk;
 
@@ -36,70 +37,15 @@ int main(int argc, char **argv) {
                          "<absolute path on the disk> \n");
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-	   perror("mmap");
-	   exit(1);
-    }
+    disk = open_image(argv[1], O_RDWR);
 
     char* target = copy_arg(argv[2]);
-    char* target_final = pathname_final(target);
-
-    // ERRORTRAPPING OF INPUT
-    struct ext2_inode *tar_inode = find_inode(target, disk);
-    exit_if(!tar_inode,ENOENT); // File not found
-    exit_if(tar_inode->i_mode & EXT2_S_IFDIR, EISDIR); // Is a directory
-
-    //////////////////////////////////////////
-
-    tar_inode->i_links_count--;
-
-    if (tar_inode->i_links_count == 0)
-        dealloc_file(disk, tar_inode); // Deallocates the data blocks
-
-    // Gets the parent directory's inode 
-    struct ext2_inode* p_inode = find_inode(get_pdir_name(target), disk);
-    struct ext2_dir_entry_2* d_entry = NULL;
-
-    int b_num, to_break;
-    to_break=0;
-    unsigned int offset, prev_offset;
-
-    // Traverses the direct pointers of the parent dir
-    for (b_num=0; !to_break && b_num<12; b_num++) {  
-
-        // Corresponding data block for the parent, FOR NOW****
-        d_entry = (struct ext2_dir_entry_2 *)(disk+
-            (p_inode->i_block[b_num]*EXT2_BLOCK_SIZE));
-
-        offset=0;
-
-        // In the current inode, looks for a dir entry that matches in name
-        while (offset < EXT2_BLOCK_SIZE) {
-            if(!strncmp(target_final, extract_name(d_entry), MAX_STR_LEN)) {
-                // Quits both loops
-                to_break=1;
-                break;
-            }
-            prev_offset=offset;
-            offset += d_entry->rec_len;
-            d_entry = (struct ext2_dir_entry_2*)((char*)d_entry+
-                d_entry->rec_len);
-        }
-    }
-    b_num--;
-
-    // Now that we have the target file's offset, delink its directory entry!
-    struct ext2_dir_entry_2* prev = (struct ext2_dir_entry_2*)(disk+
-            (p_inode->i_block[b_num]*EXT2_BLOCK_SIZE)+prev_offset);
-
-    prev->rec_len += d_entry->rec_len;
 
-    rem_inode_from_imap(d_entry->inode, disk);
+    // Removes the file, unless the path is bad
+    int err = do_rm(disk, target);
+    exit_if(err, err);
   
     // Writes all changes back into the .img file
-    assert(write(fd, disk, EXT2_ADDR_PER_BLOCK * EXT2_BLOCK_SIZE)>0);
+    close_image(disk);
     return 0;
 }
\ No newline at end of file
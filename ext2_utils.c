@@ -1,104 +1,1348 @@
+#define _GNU_SOURCE     // copy_file_range()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "ext2.h"
 #include "ext2_utils.h"
+#include "ext2_htree.h"
+#include "ext2_journal.h"
+#include "ext2_blockio.h"
+
+// Block size of the opened image, as read from its superblock
+unsigned long ext2_block_size = EXT2_MIN_BLOCK_SIZE;
+
+#define MAX_OPEN_IMAGES 16      // Images open at once
+#define INODE_LOCKS     1024    // Inode lock stripes; a power of two
+#define SEQ_RETRIES     8       // Optimistic directory reads before locking
+
+#define PREALLOC_SLOTS  256     // Direct-mapped; a power of two
+#define DCACHE_SLOTS    4096    // Direct-mapped; a power of two
+
+/* Blocks set aside (already marked used in the bitmap) for the next 
+ * blocks the inode at 'inode' grows by (see PER-INODE PREALLOCATION) */
+struct prealloc_slot {
+    struct ext2_inode* inode;
+    unsigned int start;
+    unsigned int len;
+};
+
+// See FREE-SPACE SUMMARY and DENTRY CACHE below
+struct group_summary;
+struct dcache_slot;
+
+/* Everything kept about an image open_image() mapped. Functions find it
+ * from the mapping they are given (see get_fs()), so 'disk' serves as the
+ * handle for the image, and several can be open at once. */
+struct ext2_fs {
+    unsigned char* disk;
+    int fd;                         // Backing file and length of the mapping
+    size_t len;
+
+    /* One bit per image block, set for blocks changed since the last 
+     * flush (NULL when the image is read-only) */
+    unsigned char* dirty_map;
+    unsigned long dirty_count;
+    pthread_mutex_t dirty_lock;
+
+    /* Set when the image's changes go through its journal; the mapping is
+     * then private, and 'data_map' marks the dirty blocks holding file 
+     * data (written in place rather than logged) */
+    struct journal* journal;
+    unsigned char* data_map;
+
+    /* Runs freed since the last flush of a journaled image. They stay in
+     * use until the flush, so no block the last committed state still
+     * points at is overwritten before the transaction freeing it commits. */
+    struct block_run* held;
+    size_t held_len, held_cap;
+    pthread_mutex_t held_lock;
+
+    /* One lock per group, over its bitmaps, free counters and free-space
+     * summary. Allocations in different groups don't wait for each other;
+     * the superblock's totals are only ever changed atomically. */
+    pthread_mutex_t* group_locks;
+    struct group_summary* summary;  // NULL for read-only images
+
+    struct prealloc_slot prealloc[PREALLOC_SLOTS];
+    pthread_mutex_t prealloc_lock;
+
+    /* Inode locks, striped by the inode's place in the mapping, and a
+     * sequence count per stripe, odd while a directory under it is being
+     * changed (see lookup_dir_entry()) */
+    pthread_mutex_t inode_locks[INODE_LOCKS];
+    unsigned int dir_seq[INODE_LOCKS];
+
+    /* Lookups remembered in this image's directories, and the current
+     * generation: slots from earlier ones are dead (see dcache_flush()) */
+    struct dcache_slot* dcache;
+    uint64_t dcache_gen;
+
+    // How blocks about to be read are brought in (see ext2_blockio.h)
+    struct block_io* bio;
+};
+
+static struct ext2_fs* open_fs[MAX_OPEN_IMAGES];
+static pthread_mutex_t open_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// An image's dentry cache (see DENTRY CACHE below)
+static void dcache_init (struct ext2_fs* fs);
+
+// Per-group free-space summaries (see FREE-SPACE SUMMARY below)
+static void summary_build (struct ext2_fs* fs);
+static void summary_free (struct ext2_fs* fs);
+static void release_block_run (unsigned char* disk, unsigned int first,
+                               unsigned int count);
 
+/////////////////////////////////////////
+// OPENING & CLOSING THE DISK IMAGE
+/////////////////////////////////////////
+
+// Returns what is kept about the open image mapped at 'disk'
+static struct ext2_fs* get_fs (unsigned char* disk) {
+    struct ext2_fs* fs;
+    int i;
+
+    for(i = 0; i < MAX_OPEN_IMAGES; i++) {
+        fs = __atomic_load_n(&open_fs[i], __ATOMIC_ACQUIRE);
+        if(fs && fs->disk == disk)
+            return fs;
+    }
+    assert(!"not an open image");
+    return NULL;
+}
+
+/* Opens the image file 'path' with the given open(2) flags, maps the
+ * whole file, and reads the filesystem geometry from its superblock.
+ * An image with a journal opened for writing is recovered first, and
+ * mapped privately so nothing reaches the file but through the journal.
+ * Returns a pointer to the start of the mapping.
+ */
+unsigned char* open_image (char* path, int flags) {
+    struct stat st;
+    unsigned char* disk;
+    struct ext2_fs* fs;
+    unsigned long block_size;
+    unsigned int g, ngroups;
+    int prot = PROT_READ, i, fd;
+
+    if((flags & O_ACCMODE) != O_RDONLY)
+        prot |= PROT_WRITE;
+
+    fd = open(path, flags);
+    if(fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    if(fstat(fd, &st) < 0) {
+        perror("fstat");
+        exit(1);
+    }
+    // Too small to even hold a superblock
+    exit_if(st.st_size < EXT2_SUPERBLOCK_OFFSET + 
+            sizeof(struct ext2_super_block), EINVAL);
+
+    disk = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    if(disk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    struct ext2_super_block* sb = get_sb(disk);
+    exit_if(sb->s_magic != EXT2_SUPER_MAGIC, EINVAL); // Not an ext2 image
+
+    // The block size is shared by every image open at once
+    block_size = EXT2_MIN_BLOCK_SIZE << sb->s_log_block_size;
+    pthread_mutex_lock(&open_fs_lock);
+    for(i = 0; i < MAX_OPEN_IMAGES && !open_fs[i]; i++)
+        ;
+    exit_if(i < MAX_OPEN_IMAGES && block_size != ext2_block_size, EINVAL);
+    ext2_block_size = block_size;
+    pthread_mutex_unlock(&open_fs_lock);
+
+    // The file must hold every block the superblock claims
+    exit_if((off_t)sb->s_blocks_count * EXT2_BLOCK_SIZE > st.st_size, EINVAL);
+
+    fs = calloc(1, sizeof(*fs));
+    exit_if(!fs, ENOMEM);
+    fs->fd = fd;
+    fs->len = st.st_size;
+    pthread_mutex_init(&fs->dirty_lock, NULL);
+    pthread_mutex_init(&fs->held_lock, NULL);
+    pthread_mutex_init(&fs->prealloc_lock, NULL);
+    ngroups = get_groups_count(disk);
+    fs->group_locks = malloc(ngroups * sizeof(pthread_mutex_t));
+    exit_if(!fs->group_locks, ENOMEM);
+    for(g = 0; g < ngroups; g++)
+        pthread_mutex_init(&fs->group_locks[g], NULL);
+
+    // A directory operation may lock its directory again on the way
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    for(i = 0; i < INODE_LOCKS; i++)
+        pthread_mutex_init(&fs->inode_locks[i], &attr);
+    pthread_mutexattr_destroy(&attr);
+    dcache_init(fs);
+
+    if((prot & PROT_WRITE) && (fs->journal = journal_open(disk, fd))) {
+        munmap(disk, fs->len);
+        disk = mmap(NULL, fs->len, prot, MAP_PRIVATE, fd, 0);
+        if(disk == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        sb = get_sb(disk);
+        fs->data_map = calloc((sb->s_blocks_count + 7) / 8, 1);
+        exit_if(!fs->data_map, ENOMEM);
+    }
+    fs->disk = disk;
+    if(prot & PROT_WRITE) {
+        fs->dirty_map = calloc((sb->s_blocks_count + 7) / 8, 1);
+        exit_if(!fs->dirty_map, ENOMEM);
+        summary_build(fs);      // Only needed to allocate blocks
+    }
+    fs->bio = block_io_open(NULL, disk, fd);
+    exit_if(!fs->bio, EIO);     // The mmap backend always sets up
+
+    pthread_mutex_lock(&open_fs_lock);
+    for(i = 0; i < MAX_OPEN_IMAGES && open_fs[i]; i++)
+        ;
+    exit_if(i == MAX_OPEN_IMAGES, EMFILE);
+    __atomic_store_n(&open_fs[i], fs, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&open_fs_lock);
+    return disk;
+}
+
+/* Records that the 'len' bytes at 'ptr' (inside the mapping) have been
+ * changed, so the blocks holding them get written out on the next flush. */
+void mark_dirty (unsigned char* disk, void* ptr, size_t len) {
+    struct ext2_fs* fs = get_fs(disk);
+    size_t off = (unsigned char*)ptr - disk;
+    unsigned int first = off / EXT2_BLOCK_SIZE;
+    unsigned int last = (off + MAX(len, 1) - 1) / EXT2_BLOCK_SIZE;
+
+    if(!fs->dirty_map)
+        return;
+    assert(off + len <= fs->len);
+
+    // File data may be copied in by several threads at once
+    pthread_mutex_lock(&fs->dirty_lock);
+    fs->dirty_count += last - first + 1;
+    bitmap_set_range(fs->dirty_map, first, last - first + 1);
+    if(fs->data_map)    // Whatever else they held, they're metadata now
+        bitmap_clear_range(fs->data_map, first, last - first + 1);
+    pthread_mutex_unlock(&fs->dirty_lock);
+}
+
+/* Like mark_dirty() for 'count' blocks of file data from 'bnum' on,
+ * which a journaled image writes in place instead of logging */
+static void mark_data_dirty (unsigned char* disk, unsigned int bnum,
+                             unsigned int count) {
+    struct ext2_fs* fs = get_fs(disk);
+
+    if(!fs->dirty_map)
+        return;
+    pthread_mutex_lock(&fs->dirty_lock);
+    fs->dirty_count += count;
+    bitmap_set_range(fs->dirty_map, bnum, count);
+    if(fs->data_map)
+        bitmap_set_range(fs->data_map, bnum, count);
+    pthread_mutex_unlock(&fs->dirty_lock);
+}
+
+/* Writes back only the blocks marked dirty since the last flush, 
+ * one msync() per contiguous run of them. A journaled image's are
+ * written as a single transaction instead, so every flush commits a
+ * consistent state. */
+void flush_image (unsigned char* disk) {
+    struct ext2_fs* fs = get_fs(disk);
+    unsigned int nblocks = get_sb(disk)->s_blocks_count;
+    unsigned int bit, end;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start, stop, i;
+
+    // Blocks set aside but not yet used are never written out as used
+    prealloc_release(disk, NULL);
+    for(i = 0; i < fs->held_len; i++)
+        release_block_run(disk, fs->held[i].first, fs->held[i].count);
+    fs->held_len = 0;
+    if(!fs->dirty_map || !fs->dirty_count)
+        return;
+
+    if(fs->journal) {
+        journal_commit(fs->journal, disk, fs->dirty_map, fs->data_map);
+        memset(fs->dirty_map, 0, (nblocks + 7) / 8);
+        memset(fs->data_map, 0, (nblocks + 7) / 8);
+        fs->dirty_count = 0;
+        return;
+    }
+
+    for(bit = bitmap_find_set(fs->dirty_map, 0, nblocks); bit < nblocks;
+        bit = bitmap_find_set(fs->dirty_map, end, nblocks)) {
+        end = bitmap_find_zero(fs->dirty_map, bit, nblocks);
+
+        // msync() wants a page-aligned start
+        start = (size_t)bit * EXT2_BLOCK_SIZE & ~(page - 1);
+        stop = MIN((size_t)end * EXT2_BLOCK_SIZE, fs->len);
+        exit_if(msync(disk + start, stop - start, MS_SYNC) < 0, errno);
+        bitmap_clear_range(fs->dirty_map, bit, end - bit);
+    }
+    fs->dirty_count = 0;
+}
+
+/* Flushes every change made through the mapping back 
+ * to the image file, then unmaps and closes it. */
+void close_image (unsigned char* disk) {
+    struct ext2_fs* fs = get_fs(disk);
+    unsigned int g, ngroups = get_groups_count(disk);
+    int i;
+
+    flush_image(disk);
+    if(fs->journal)
+        journal_close(fs->journal, disk);
+
+    pthread_mutex_lock(&open_fs_lock);
+    for(i = 0; open_fs[i] != fs; i++)
+        ;
+    __atomic_store_n(&open_fs[i], NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&open_fs_lock);
+
+    summary_free(fs);
+    for(g = 0; g < ngroups; g++)
+        pthread_mutex_destroy(&fs->group_locks[g]);
+    for(i = 0; i < INODE_LOCKS; i++)
+        pthread_mutex_destroy(&fs->inode_locks[i]);
+    free(fs->group_locks);
+    free(fs->dirty_map);
+    free(fs->data_map);
+    free(fs->held);
+    block_io_close(fs->bio);
+    free(fs->dcache);
+    munmap(disk, fs->len);
+    close(fs->fd);
+    free(fs);
+}
+
+// Returns which of the inode locks covers 'inode'
+static unsigned int inode_stripe (struct ext2_inode* inode) {
+    return ((uintptr_t)inode / sizeof(struct ext2_inode)) & (INODE_LOCKS - 1);
+}
+
+/* Takes / drops the lock on 'inode' (one of INODE_LOCKS stripes; 
+ * recursive, so the directory helpers can take it again) */
+void inode_lock (unsigned char* disk, struct ext2_inode* inode) {
+    struct ext2_fs* fs = get_fs(disk);
+    pthread_mutex_lock(&fs->inode_locks[inode_stripe(inode)]);
+}
+void inode_unlock (unsigned char* disk, struct ext2_inode* inode) {
+    struct ext2_fs* fs = get_fs(disk);
+    pthread_mutex_unlock(&fs->inode_locks[inode_stripe(inode)]);
+}
+
+/* Starts / ends a change to the entries of directory 'dir': takes its
+ * lock, and keeps its sequence count odd meanwhile, so lookups reading
+ * it without the lock know to read it again */
+static void dir_write_begin (unsigned char* disk, struct ext2_inode* dir) {
+    struct ext2_fs* fs = get_fs(disk);
+    unsigned int* seq = &fs->dir_seq[inode_stripe(dir)];
+
+    inode_lock(disk, dir);
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+static void dir_write_end (unsigned char* disk, struct ext2_inode* dir) {
+    struct ext2_fs* fs = get_fs(disk);
+    unsigned int* seq = &fs->dir_seq[inode_stripe(dir)];
+
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+    inode_unlock(disk, dir);
+}
 
 // Returns a pointer to the superblock
 struct ext2_super_block* get_sb (unsigned char* disk) {
-    return (struct ext2_super_block*)(disk + EXT2_BLOCK_SIZE);
+    return (struct ext2_super_block*)(disk + EXT2_SUPERBLOCK_OFFSET);
 }
-// Returns a pointer to the group descriptor block
+// Returns a pointer to the group descriptor table (indexed by group number)
 struct ext2_group_desc* get_gd (unsigned char* disk) {
-    return (struct ext2_group_desc*)(disk + 2 * EXT2_BLOCK_SIZE);
+    return (struct ext2_group_desc*)(bnum_to_block(
+                get_sb(disk)->s_first_data_block + 1, disk));
+}
+// Returns a pointer to the start of the given group's itable
+unsigned char* get_itbl (unsigned char* disk, unsigned int group) {
+    return bnum_to_block(get_gd(disk)[group].bg_inode_table, disk);
+}
+
+// Returns the number of block groups on the disk
+unsigned int get_groups_count (unsigned char* disk) {
+    struct ext2_super_block* sb = get_sb(disk);
+    return (sb->s_blocks_count - sb->s_first_data_block + 
+            sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+}
+
+// Returns the number of blocks in the given group (the last may be short)
+unsigned int group_blocks_count (unsigned int group, unsigned char* disk) {
+    struct ext2_super_block* sb = get_sb(disk);
+    unsigned int first = sb->s_first_data_block + 
+                        group * sb->s_blocks_per_group;
+
+    if(sb->s_blocks_count - first < sb->s_blocks_per_group)
+        return sb->s_blocks_count - first;
+    return sb->s_blocks_per_group;
+}
+
+// Returns the group holding the given inode / block
+unsigned int inum_to_group (unsigned int inum, unsigned char* disk) {
+    return (inum - 1) / get_sb(disk)->s_inodes_per_group;
+}
+unsigned int bnum_to_group (unsigned int bnum, unsigned char* disk) {
+    struct ext2_super_block* sb = get_sb(disk);
+    return (bnum - sb->s_first_data_block) / sb->s_blocks_per_group;
+}
+
+// Returns an inode's full size (i_dir_acl holds the high half for files)
+unsigned long get_inode_size (struct ext2_inode* inode) {
+    unsigned long size = inode->i_size;
+    if(inode->i_mode & EXT2_S_IFREG)
+        size |= (unsigned long)inode->i_dir_acl << 32;
+    return size;
+}
+
+// Sets an inode's full size, flagging the disk as holding large files
+void set_inode_size (unsigned char* disk, struct ext2_inode* inode, 
+                     unsigned long size) {
+    inode->i_size = (unsigned int)size;
+    mark_dirty(disk, inode, sizeof(struct ext2_inode));
+    if(!(inode->i_mode & EXT2_S_IFREG))
+        return;
+    inode->i_dir_acl = size >> 32;
+    if(size >> 31) {
+        __atomic_or_fetch(&get_sb(disk)->s_feature_ro_compat,
+                          EXT2_FEATURE_RO_COMPAT_LARGE_FILE, __ATOMIC_RELAXED);
+        mark_dirty(disk, get_sb(disk), sizeof(struct ext2_super_block));
+    }
+}
+
+
+/////////////////////////////////////////
+// LOGICAL -> PHYSICAL BLOCK MAPPING
+/////////////////////////////////////////
+
+// Returns how many data blocks the direct & indirect pointers can map
+unsigned long max_file_blocks (void) {
+    unsigned long a = EXT2_ADDR_PER_BLOCK;
+    unsigned long max = EXT2_NUM_DIR_PTRS + a + a * a + a * a * a;
+    return MIN(max, 0xffffffffUL);
+}
+
+// Returns whether 'inode' keeps blocks in i_block (not a fast symlink etc.)
+int has_blocks (struct ext2_inode* inode) {
+    unsigned int fmt = inode->i_mode & EXT2_S_IFMT;
+    unsigned int ea = inode->i_file_acl ? EXT2_BLOCK_SIZE / 512 : 0;
+
+    return fmt == EXT2_S_IFREG || fmt == EXT2_S_IFDIR || !fmt ||
+           (fmt == EXT2_S_IFLNK && inode->i_blocks > ea);
+}
+
+/* Splits logical block 'lblk' into its path through the block map:
+ * path[0] is the slot in i_block, and path[1..depth] the indices into
+ * each level of indirect block. Returns the depth (0 = direct). */
+static int lblk_to_path (unsigned long lblk, unsigned int path[4]) {
+    unsigned long a = EXT2_ADDR_PER_BLOCK;
+
+    if(lblk < EXT2_NUM_DIR_PTRS) {
+        path[0] = lblk;
+        return 0;
+    }
+    lblk -= EXT2_NUM_DIR_PTRS;
+    if(lblk < a) {
+        path[0] = EXT2_IND_BLOCK;
+        path[1] = lblk;
+        return 1;
+    }
+    lblk -= a;
+    if(lblk < a * a) {
+        path[0] = EXT2_DIND_BLOCK;
+        path[1] = lblk / a;
+        path[2] = lblk % a;
+        return 2;
+    }
+    lblk -= a * a;
+    path[0] = EXT2_TIND_BLOCK;
+    path[1] = lblk / (a * a);
+    path[2] = (lblk / a) % a;
+    path[3] = lblk % a;
+    return 3;
+}
+
+/* Sets up 'it' to walk logical blocks [start, end) of 'inode'. With
+ * 'alloc' set, 0 pointers met on the way (data or indirect) are filled 
+ * with newly reserved blocks, taken as runs starting near 'it->goal'.
+ * Without it, an inode with no block pointers has nothing to walk. */
+void block_iter_init (struct block_iter* it, unsigned char* disk,
+                      struct ext2_inode* inode, unsigned long start,
+                      unsigned long end, int alloc) {
+    it->disk = disk;
+    it->inode = inode;
+    it->lblk = start;
+    it->end = (alloc || has_blocks(inode)) ? end : start;
+    it->level = 0;
+    it->alloc = alloc;
+    it->goal = 0;
+    it->run_start = it->run_len = 0;
+
+    // Roughly how many blocks the walk will allocate (sizes the runs)
+    it->to_alloc = 0;
+    if(alloc && end > start)
+        it->to_alloc = calc_blocks_needed(end * EXT2_BLOCK_SIZE) - 
+                       calc_blocks_needed(start * EXT2_BLOCK_SIZE);
+}
+
+// Hands out the next block of the iterator's current allocation run
+static unsigned int block_iter_take (struct block_iter* it) {
+    if(!it->run_len) {
+        it->run_len = alloc_block_run(it->disk, it->goal, 
+                                MAX(it->to_alloc, 1), &it->run_start);
+        exit_if(!it->run_len, ENOSPC);
+    }
+    it->run_len--;
+    if(it->to_alloc)
+        it->to_alloc--;
+    it->inode->i_blocks += EXT2_SECTORS_PER_BLOCK;
+    mark_dirty(it->disk, it->inode, sizeof(struct ext2_inode));
+    it->goal = it->run_start + 1;
+    return it->run_start++;
+}
+
+/* Advances 'it' to the next block of the file in on-disk order: each 
+ * indirect block is reported (with '*is_meta' set) just before the first
+ * data block it maps. Stores the physical block in '*bnum' (0 for a 
+ * hole) and returns 1, or returns 0 once the walk is over. */
+int block_iter_next (struct block_iter* it, unsigned int* bnum, 
+                     int* is_meta) {
+    unsigned int path[4];
+    unsigned int* slot;
+    int depth, k, j, first;
+
+    if(it->lblk >= it->end)
+        return 0;
+
+    depth = lblk_to_path(it->lblk, path);
+    slot = &it->inode->i_block[path[0]];
+
+    for(k = 0; k <= depth; k++) {
+        if(!*slot && it->alloc) {
+            *slot = block_iter_take(it);
+            mark_dirty(it->disk, slot, sizeof(*slot));
+            if(k < depth) { // Fresh indirect blocks start out with no pointers
+                memset(bnum_to_block(*slot, it->disk), 0, EXT2_BLOCK_SIZE);
+                mark_dirty(it->disk, bnum_to_block(*slot, it->disk),
+                           EXT2_BLOCK_SIZE);
+            }
+        }
+        if(k == depth)
+            break;
+
+        // An indirect block is reported on the way to its first entry
+        for(first = 1, j = k + 1; j <= depth; j++)
+            first &= (path[j] == 0);
+        if(first && k >= it->level && *slot) {
+            it->level = k + 1;
+            *bnum = *slot;
+            *is_meta = 1;
+            return 1;
+        }
+
+        // A missing indirect block maps nothing but holes
+        if(!*slot)
+            break;
+        slot = (unsigned int*)(bnum_to_block(*slot, it->disk)) + path[k + 1];
+    }
+
+    *bnum = (k == depth) ? *slot : 0;
+    *is_meta = 0;
+    it->level = 0;
+    it->lblk++;
+    return 1;
+}
+
+// Returns any blocks the iterator reserved but never handed out
+void block_iter_done (struct block_iter* it) {
+    if(it->run_len)
+        free_block_run(it->disk, it->run_start, it->run_len);
+    it->run_len = 0;
+}
+
+/* Returns the block holding logical block 'lblk' of 'inode', 
+ * or 0 if that block is a hole */
+unsigned int lblk_to_bnum (unsigned char* disk, struct ext2_inode* inode,
+                           unsigned long lblk) {
+    struct block_iter it;
+    unsigned int bnum = 0;
+    int is_meta = 0;
+
+    if(lblk >= max_file_blocks() || !has_blocks(inode))
+        return 0;
+    block_iter_init(&it, disk, inode, lblk, lblk + 1, 0);
+    while(block_iter_next(&it, &bnum, &is_meta) && is_meta)
+        ;
+    return is_meta ? 0 : bnum;
+}
+
+/* Returns the pointer (in i_block or an indirect block) mapping logical 
+ * block 'lblk' of 'inode', or NULL if an indirect block on the way to it
+ * is missing */
+static unsigned int* lblk_to_slot (unsigned char* disk, 
+                                   struct ext2_inode* inode,
+                                   unsigned long lblk) {
+    unsigned int path[4];
+    int depth = lblk_to_path(lblk, path), k;
+    unsigned int* slot = &inode->i_block[path[0]];
+
+    for(k = 0; k < depth; k++) {
+        if(!*slot)
+            return NULL;
+        slot = (unsigned int*)(bnum_to_block(*slot, disk)) + path[k + 1];
+    }
+    return slot;
+}
+
+
+/////////////////////////////////////////
+// PER-INODE PREALLOCATION
+/////////////////////////////////////////
+
+// Returns the slot an inode's window lives in
+static struct prealloc_slot* prealloc_slot (struct ext2_fs* fs,
+                                            struct ext2_inode* inode) {
+    return &fs->prealloc[((uintptr_t)inode / sizeof(struct ext2_inode)) & 
+                         (PREALLOC_SLOTS - 1)];
+}
+
+/* Hands 'it' the window set aside for its inode (if any) as its current
+ * run, and has the next run it reserves be 'extra' blocks longer, so 
+ * block_iter_keep() can set those aside in turn. */
+void block_iter_prealloc (struct block_iter* it, unsigned int extra) {
+    struct ext2_fs* fs = get_fs(it->disk);
+    struct prealloc_slot* slot = prealloc_slot(fs, it->inode);
+
+    pthread_mutex_lock(&fs->prealloc_lock);
+    if(slot->inode == it->inode) {
+        it->run_start = slot->start;
+        it->run_len = slot->len;
+        slot->inode = NULL;
+    }
+    pthread_mutex_unlock(&fs->prealloc_lock);
+    it->to_alloc += extra;
+}
+
+/* Finishes the walk like block_iter_done(), but keeps the blocks 'it' 
+ * reserved and never handed out as its inode's window. Whatever window
+ * held the slot before is released. */
+void block_iter_keep (struct block_iter* it) {
+    struct ext2_fs* fs = get_fs(it->disk);
+    struct prealloc_slot* slot = prealloc_slot(fs, it->inode);
+    struct prealloc_slot old = { NULL, 0, 0 };
+
+    if(!it->run_len)
+        return;
+    pthread_mutex_lock(&fs->prealloc_lock);
+    if(slot->inode)
+        old = *slot;
+    slot->inode = it->inode;
+    slot->start = it->run_start;
+    slot->len = it->run_len;
+    pthread_mutex_unlock(&fs->prealloc_lock);
+
+    it->run_len = 0;
+    if(old.len)
+        free_block_run(it->disk, old.start, old.len);
+}
+
+/* Releases the blocks set aside for 'inode' (or for every inode, 
+ * if it's NULL) back to the free pool */
+void prealloc_release (unsigned char* disk, struct ext2_inode* inode) {
+    struct ext2_fs* fs = get_fs(disk);
+    struct prealloc_slot old;
+    unsigned int i;
+
+    for(i = 0; i < PREALLOC_SLOTS; i++) {
+        if(inode && &fs->prealloc[i] != prealloc_slot(fs, inode))
+            continue;
+        pthread_mutex_lock(&fs->prealloc_lock);
+        old = fs->prealloc[i];
+        if(old.inode && (!inode || old.inode == inode))
+            fs->prealloc[i].inode = NULL;
+        else
+            old.inode = NULL;
+        pthread_mutex_unlock(&fs->prealloc_lock);
+        if(old.inode)
+            free_block_run(disk, old.start, old.len);
+    }
+}
+
+
+/////////////////////////////////////////
+// BRINGING BLOCKS IN AHEAD OF READS
+/////////////////////////////////////////
+
+#define FETCH_BLOCKS    256     // Blocks gathered before each fetch
+
+/* Switches the image at 'disk' to the block I/O backend called 'name'.
+ * Returns 0, or -1 (keeping the one it had) if there's no such backend
+ * or it can't be set up here. */
+int set_block_io (unsigned char* disk, const char* name) {
+    struct ext2_fs* fs = get_fs(disk);
+    struct block_io* bio = block_io_open(name, disk, fs->fd);
+
+    if(!bio)
+        return -1;
+    block_io_close(fs->bio);
+    fs->bio = bio;
+    return 0;
+}
+
+// Returns the name of the block I/O backend the image at 'disk' uses
+const char* get_block_io (unsigned char* disk) {
+    return block_io_name(get_fs(disk)->bio);
+}
+
+// Brings the 'n' runs of blocks at 'runs' into memory (only a hint)
+void fetch_blocks (unsigned char* disk, const struct block_run* runs,
+                   unsigned int n) {
+    block_io_fetch(get_fs(disk)->bio, runs, n);
+}
+
+static int cmp_bnum (const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Fetches the 'n' blocks at 'bnums' (in any order, repeats and all), 
+ * sorted and merged into runs */
+static void fetch_bnums (unsigned char* disk, unsigned int* bnums,
+                         unsigned int n) {
+    struct block_run runs[FETCH_BLOCKS];
+    unsigned int i, nruns = 0;
+
+    qsort(bnums, n, sizeof(*bnums), cmp_bnum);
+    for(i = 0; i < n; i++) {
+        if(nruns && bnums[i] <= runs[nruns-1].first + runs[nruns-1].count) {
+            runs[nruns-1].count = bnums[i] - runs[nruns-1].first + 1;
+            continue;
+        }
+        runs[nruns].first = bnums[i];
+        runs[nruns++].count = 1;
+    }
+    fetch_blocks(disk, runs, nruns);
+}
+
+/* Brings in the blocks of directory 'dir', then (with 'inodes' set) the
+ * inode table blocks of the inodes its entries name, so a scan of it that
+ * reads each one's inode waits on a few batches of reads rather than a
+ * block at a time. The caller holds the directory's lock. */
+void fetch_dir (unsigned char* disk, struct ext2_inode* dir, int inodes) {
+    unsigned int ninodes = get_sb(disk)->s_inodes_count;
+    unsigned int bnums[FETCH_BLOCKS], bnum, offset, n = 0;
+    struct ext2_dir_entry_2* d_entry;
+    struct block_iter it;
+    int is_meta;
+
+    block_iter_init(&it, disk, dir, 0, dir->i_size / EXT2_BLOCK_SIZE, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(n == FETCH_BLOCKS) {
+            fetch_bnums(disk, bnums, n);
+            n = 0;
+        }
+        if(bnum)
+            bnums[n++] = bnum;
+    }
+    fetch_bnums(disk, bnums, n);
+    if(!inodes)
+        return;
+
+    n = 0;
+    block_iter_init(&it, disk, dir, 0, dir->i_size / EXT2_BLOCK_SIZE, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(is_meta || !bnum)
+            continue;
+        for(offset = 0; offset < EXT2_BLOCK_SIZE; offset += d_entry->rec_len) {
+            d_entry = (struct ext2_dir_entry_2*)(bnum_to_block(bnum, disk)
+                                                 + offset);
+            if(!d_entry->rec_len)   // Corrupt block; don't spin on it
+                break;
+            if(!d_entry->inode || d_entry->inode > ninodes)
+                continue;
+            if(n == FETCH_BLOCKS) {
+                fetch_bnums(disk, bnums, n);
+                n = 0;
+            }
+            bnums[n++] = ((unsigned char*)inum_to_inode(d_entry->inode, disk)
+                          - disk) / EXT2_BLOCK_SIZE;
+        }
+    }
+    fetch_bnums(disk, bnums, n);
+}
+
+
+/////////////////////////////////////////
+// DENTRY CACHE
+/////////////////////////////////////////
+
+/* A remembered lookup of 'name' in the directory whose inode is at 'dir'.
+ * 'd_entry' is the entry found, or NULL if there was none (a negative 
+ * entry). Entries can move (e.g. when an indexed leaf is split), so a 
+ * positive hit only counts if the entry still holds the same name. 
+ * Slots are read without a lock: 'seq' is odd while one is being
+ * written, and a reader that sees it change reads it as a miss. */
+struct dcache_slot {
+    unsigned int seq;
+    uint64_t gen;               // Slot is live only in the current generation
+    struct ext2_inode* dir;
+    struct ext2_dir_entry_2* d_entry;
+    unsigned int hash;
+    unsigned char len;
+    char name[MAX_STR_LEN];
+};
+
+// Sets up an empty dentry cache for the image 'fs'
+static void dcache_init (struct ext2_fs* fs) {
+    fs->dcache = calloc(DCACHE_SLOTS, sizeof(*fs->dcache));
+    exit_if(!fs->dcache, ENOMEM);
+    fs->dcache_gen = 1;
+}
+
+// FNV-1a over the name, mixed with the directory
+static unsigned int dcache_hash (struct ext2_inode* dir, const char* name,
+                                 unsigned int len) {
+    unsigned int hash = 2166136261U ^ (unsigned int)((uintptr_t)dir >> 2);
+
+    while(len--) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Looks up (dir, name) in the image's cache. Returns 1 on a hit, storing
+ * the cached entry (NULL for a negative one) in '*res', or 0 on a miss. */
+static int dcache_lookup (struct ext2_fs* fs, struct ext2_inode* dir,
+                          const char* name, unsigned int len,
+                          struct ext2_dir_entry_2** res) {
+    unsigned int hash = dcache_hash(dir, name, len);
+    struct dcache_slot *slot = &fs->dcache[hash & (DCACHE_SLOTS - 1)];
+    struct ext2_dir_entry_2 *d_entry;
+    unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    int hit;
+
+    if(seq & 1)     // Being written
+        return 0;
+    hit = slot->gen == __atomic_load_n(&fs->dcache_gen, __ATOMIC_ACQUIRE) &&
+          slot->dir == dir && slot->hash == hash && slot->len == len && 
+          !memcmp(slot->name, name, len);
+    d_entry = slot->d_entry;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(!hit || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+        return 0;
+
+    if(d_entry && !(d_entry->inode && d_entry->name_len == len &&
+                    !memcmp(d_entry->name, name, len)))
+        return 0;
+    *res = d_entry;
+    return 1;
+}
+
+/* Records that (dir, name) resolves to 'd_entry' (NULL: to nothing). 
+ * Given a directory sequence count 'dir_seq', only does so if it still 
+ * reads 'seen', i.e. the directory hasn't changed since it was read. */
+static void dcache_insert (struct ext2_fs* fs, struct ext2_inode* dir,
+                           const char* name, unsigned int len,
+                           struct ext2_dir_entry_2* d_entry,
+                           const unsigned int* dir_seq, unsigned int seen) {
+    unsigned int hash = dcache_hash(dir, name, len);
+    struct dcache_slot *slot = &fs->dcache[hash & (DCACHE_SLOTS - 1)];
+    unsigned int seq;
+
+    // Takes the slot by making its count odd (writers hold it briefly)
+    do {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) & ~1U;
+    } while(!__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if(!dir_seq || __atomic_load_n(dir_seq, __ATOMIC_ACQUIRE) == seen) {
+        slot->gen = __atomic_load_n(&fs->dcache_gen, __ATOMIC_ACQUIRE);
+        slot->dir = dir;
+        slot->d_entry = d_entry;
+        slot->hash = hash;
+        slot->len = len;
+        memcpy(slot->name, name, len);
+    }
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Forgets every lookup cached for the image at 'disk' (by starting a new
+ * generation; it's 64 bits, so old slots never come back to life) */
+void dcache_flush (unsigned char* disk) {
+    __atomic_add_fetch(&get_fs(disk)->dcache_gen, 1, __ATOMIC_RELEASE);
+}
+
+
+/////////////////////////////////////////
+// FREE-SPACE SUMMARY
+/////////////////////////////////////////
+
+#define SUMMARY_LEAF_BITS   512     // Bitmap bits summarized by each leaf
+#define SUMMARY_NONE        (~0U)
+
+/* Free space in one span of a group's block bitmap: the clear bits it 
+ * starts and ends with, its longest clear run, and how many bits it has */
+struct free_span {
+    unsigned int pre, suf, max, len;
+};
+
+/* A segment tree over one group's block bitmap. Node 1 is the root and 
+ * node n has children 2n and 2n+1; leaves past the group's end are 
+ * empty. Finding the first run of some length, or the longest, only 
+ * walks down the tree. */
+struct group_summary {
+    unsigned int nleaves;       // A power of two
+    struct free_span* span;
+};
+
+// Summarizes bits [lo, hi) of 'bmap' into the leaf 's'
+static void span_leaf (struct free_span* s, const unsigned char* bmap,
+                       unsigned int lo, unsigned int hi) {
+    unsigned int bit, len;
+
+    memset(s, 0, sizeof(*s));
+    if(lo >= hi)
+        return;
+    s->len = hi - lo;
+    s->pre = bitmap_find_set(bmap, lo, hi) - lo;
+    for(bit = bitmap_find_zero_run(bmap, lo, hi, s->len, &len); bit < hi;
+        bit = bitmap_find_zero_run(bmap, bit + len, hi, s->len, &len)) {
+        s->max = MAX(s->max, len);
+        s->suf = (bit + len == hi) ? len : 0;
+    }
+}
+
+// Summarizes the span made of 'l' followed by 'r' into 's'
+static void span_join (struct free_span* s, const struct free_span* l,
+                       const struct free_span* r) {
+    s->len = l->len + r->len;
+    s->pre = (l->pre == l->len) ? l->len + r->pre : l->pre;
+    s->suf = (r->suf == r->len) ? r->len + l->suf : r->suf;
+    s->max = MAX(MAX(l->max, r->max), l->suf + r->pre);
+}
+
+// Returns group 'g's block bitmap
+static unsigned char* group_bmap (unsigned char* disk, unsigned int g) {
+    return bnum_to_block(get_gd(disk)[g].bg_block_bitmap, disk);
+}
+
+// Builds every group's summary from its block bitmap
+static void summary_build (struct ext2_fs* fs) {
+    unsigned char* disk = fs->disk;
+    unsigned int ngroups = get_groups_count(disk), g, i, nbits;
+    struct group_summary* gs;
+
+    fs->summary = calloc(ngroups, sizeof(*fs->summary));
+    exit_if(!fs->summary, ENOMEM);
+    for(g = 0; g < ngroups; g++) {
+        gs = &fs->summary[g];
+        nbits = group_blocks_count(g, disk);
+        for(gs->nleaves = 1; gs->nleaves * SUMMARY_LEAF_BITS < nbits; )
+            gs->nleaves <<= 1;
+        gs->span = calloc(2 * gs->nleaves, sizeof(struct free_span));
+        exit_if(!gs->span, ENOMEM);
+
+        for(i = 0; i < gs->nleaves; i++)
+            span_leaf(&gs->span[gs->nleaves + i], group_bmap(disk, g),
+                      i * SUMMARY_LEAF_BITS, 
+                      MIN((i + 1) * SUMMARY_LEAF_BITS, nbits));
+        for(i = gs->nleaves - 1; i; i--)
+            span_join(&gs->span[i], &gs->span[2 * i], &gs->span[2 * i + 1]);
+    }
+}
+
+// Frees the summaries made by summary_build()
+static void summary_free (struct ext2_fs* fs) {
+    unsigned int g;
+
+    if(!fs->summary)
+        return;
+    for(g = 0; g < get_groups_count(fs->disk); g++)
+        free(fs->summary[g].span);
+    free(fs->summary);
+    fs->summary = NULL;
+}
+
+/* Brings group 'g's summary up to date after bits [bit, bit + len) of its 
+ * block bitmap changed: just their leaves, and the nodes above them.
+ * The caller holds the group's lock, as for the searches below. */
+static void summary_update (unsigned char* disk, unsigned int g, 
+                            unsigned int bit, unsigned int len) {
+    struct ext2_fs* fs = get_fs(disk);
+    struct group_summary* gs;
+    unsigned int nbits = group_blocks_count(g, disk), lo, hi, i;
+
+    if(!fs->summary || !len)
+        return;
+    gs = &fs->summary[g];
+    lo = bit / SUMMARY_LEAF_BITS;
+    hi = (bit + len - 1) / SUMMARY_LEAF_BITS;
+    for(i = lo; i <= hi; i++)
+        span_leaf(&gs->span[gs->nleaves + i], group_bmap(disk, g),
+                  i * SUMMARY_LEAF_BITS, 
+                  MIN((i + 1) * SUMMARY_LEAF_BITS, nbits));
+
+    for(lo = (gs->nleaves + lo) / 2, hi = (gs->nleaves + hi) / 2; lo; 
+        lo /= 2, hi /= 2)
+        for(i = lo; i <= hi; i++)
+            span_join(&gs->span[i], &gs->span[2 * i], &gs->span[2 * i + 1]);
+}
+
+/* Finds the first free run in group 'g' at least 'count' bits long or, 
+ * failing that, the first of its longest runs. Stores the run's length 
+ * (capped at 'count') in '*run_len' and returns its first bit, or 
+ * returns SUMMARY_NONE if the group is full. */
+static unsigned int summary_find_run (unsigned char* disk, unsigned int g,
+                                      unsigned int count, 
+                                      unsigned int* run_len) {
+    struct group_summary* gs = &get_fs(disk)->summary[g];
+    struct free_span* span = gs->span;
+    unsigned char* bmap = group_bmap(disk, g);
+    unsigned int want = MIN(count, span[1].max), n = 1, lo = 0, bit, len;
+
+    *run_len = 0;
+    if(!want)
+        return SUMMARY_NONE;
+
+    // Runs in the left child come first, then one across the middle
+    while(n < gs->nleaves) {
+        if(span[2 * n].max >= want) {
+            n = 2 * n;
+        } else if(span[2 * n].suf + span[2 * n + 1].pre >= want) {
+            bit = lo + span[2 * n].len - span[2 * n].suf;
+            break;
+        } else {
+            lo += span[2 * n].len;
+            n = 2 * n + 1;
+        }
+    }
+
+    // Otherwise the run lies inside the leaf reached
+    if(n >= gs->nleaves)
+        for(bit = bitmap_find_zero_run(bmap, lo, lo + span[n].len, want, &len);
+            len < want; 
+            bit = bitmap_find_zero_run(bmap, bit + len, lo + span[n].len, 
+                                       want, &len))
+            ;
+
+    return bitmap_find_zero_run(bmap, bit, group_blocks_count(g, disk), 
+                                count, run_len);
+}
+
+/* Returns the first free bit at or after 'start' in the span under node
+ * 'n' (which starts at bit 'lo') of group 'g', or SUMMARY_NONE. Spans 
+ * with no free bits, or wholly before 'start', are skipped unread. */
+static unsigned int span_find_zero (unsigned char* disk, unsigned int g, 
+                                    unsigned int n, unsigned int lo,
+                                    unsigned int start) {
+    struct group_summary* gs = &get_fs(disk)->summary[g];
+    struct free_span* s = &gs->span[n];
+    unsigned int bit;
+
+    if(!s->max || lo + s->len <= start)
+        return SUMMARY_NONE;
+    if(n >= gs->nleaves) {
+        bit = bitmap_find_zero(group_bmap(disk, g), MAX(lo, start), 
+                               lo + s->len);
+        return (bit < lo + s->len) ? bit : SUMMARY_NONE;
+    }
+
+    bit = span_find_zero(disk, g, 2 * n, lo, start);
+    if(bit == SUMMARY_NONE)
+        bit = span_find_zero(disk, g, 2 * n + 1, lo + gs->span[2 * n].len, 
+                             start);
+    return bit;
 }
-// Returns a pointer to the start of the itable
-unsigned char* get_itbl (unsigned char* disk) {
-    return (disk + EXT2_BLOCK_SIZE * get_gd(disk)->bg_inode_table);
+
+/* Returns a goal for alloc_block_run() in the nearest group (from block
+ * 'goal's on) with a free run at least 'count' blocks long or, if none
+ * has one, in the group with the longest run: 'goal' itself if that's its
+ * group, else the group's first block. Only the summaries' roots are
+ * read. */
+static unsigned int summary_find_group (unsigned char* disk,
+                                        unsigned int goal,
+                                        unsigned int count) {
+    struct ext2_fs* fs = get_fs(disk);
+    struct ext2_super_block* sb = get_sb(disk);
+    unsigned int ngroups = get_groups_count(disk);
+    unsigned int g0 = bnum_to_group(goal, disk), g, i, max;
+    unsigned int best = g0, best_max = 0;
+
+    for(i = 0; i < ngroups; i++) {
+        g = (g0 + i) % ngroups;
+        pthread_mutex_lock(&fs->group_locks[g]);
+        max = fs->summary[g].span[1].max;
+        pthread_mutex_unlock(&fs->group_locks[g]);
+        if(max > best_max) {
+            best = g;
+            best_max = max;
+        }
+        if(max >= count)
+            break;
+    }
+    if(best == g0)
+        return goal;
+    return best * sb->s_blocks_per_group + sb->s_first_data_block;
 }
 
+
 /////////////////////////////////////////
 // FUNCTIONS FOR ALLOCATING NEW INODES & 
 // DIRECORY ENTRIES, AND WRITING DATA BLOCKS
 /////////////////////////////////////////
 
-/* Given a file size value, returns how many blocks 
- * will be needed to store a file of that size. */
+/* Given a file size value, returns how many blocks (data blocks
+ * plus the indirect blocks mapping them) a file of that size needs. */
 unsigned int calc_blocks_needed(long int f_size) {
 
-    int blocks_needed = f_size / EXT2_BLOCK_SIZE;   
+    unsigned long a = EXT2_ADDR_PER_BLOCK;
+    unsigned long data = f_size / EXT2_BLOCK_SIZE;   
+    unsigned long meta = 0, n;
     if(f_size % EXT2_BLOCK_SIZE)    // To round up
-        blocks_needed++;
-    if(blocks_needed > EXT2_NUM_DIR_PTRS) // If we'll need an indirection
-        blocks_needed++;
+        data++;
+
+    if(data > EXT2_NUM_DIR_PTRS) {  // If we'll need an indirection
+        n = data - EXT2_NUM_DIR_PTRS;
+        meta++;                     // The single indirect block
+        if(n > a) {                 // The double indirect block & its children
+            n -= a;
+            meta += 1 + (MIN(n, a * a) + a - 1) / a;
+        }
+        if(n > a * a) {             // The triple indirect block & its tree
+            n -= a * a;
+            meta += 1 + (n + a * a - 1) / (a * a) + (n + a - 1) / a;
+        }
+    }
+
+    return data + meta;
+}
 
-    return blocks_needed;
+/* Finds the first run of logical blocks at or after 'lblk' (and before
+ * 'nblocks') that the native file 'native_fd' holds data for, asking the
+ * kernel to skip its holes (SEEK_DATA / SEEK_HOLE). Stores the end of the
+ * run in '*end' and returns its start ('nblocks' once only holes are left).
+ * Without a file, or a kernel that can't tell, everything is data. */
+static unsigned long next_data_run (int native_fd, unsigned long lblk,
+                                    unsigned long nblocks, unsigned long* end) {
+    off_t data, hole;
+
+    *end = nblocks;
+    if(native_fd < 0 || lblk >= nblocks)
+        return MIN(lblk, nblocks);
+
+    data = lseek(native_fd, (off_t)lblk * EXT2_BLOCK_SIZE, SEEK_DATA);
+    if(data < 0)
+        return (errno == ENXIO) ? nblocks : lblk;
+    hole = lseek(native_fd, data, SEEK_HOLE);
+    if(hole >= 0)
+        *end = MIN((hole + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE, nblocks);
+    return MIN(data / EXT2_BLOCK_SIZE, nblocks);
 }
 
-/* Allocates & reserves a new inode and 'blocks_needed' associated data blocks.
+/* Allocates & reserves a new inode and the blocks needed for a file of
+ * 'f_size' bytes in the directory with inode number 'p_inum'. The inode 
+ * goes in (or near) the parent's group and the blocks follow it there.
+ * If 'native_fd' isn't -1, blocks are only mapped where that native file
+ * holds data; its holes stay holes (0 pointers) in the new file.
  * Marks corresponding bits in the imap & bmap. 
  * Returns the new inode's number. 
  */
-unsigned int alloc_file (unsigned char* disk,
-                        long int f_size, unsigned short i_mode) {
-    int i;
-    unsigned int* i_tbl = (unsigned int*) get_itbl(disk);
-    unsigned int blocks_needed = calc_blocks_needed(f_size);
+unsigned int alloc_file (unsigned char* disk, long int f_size, 
+                        unsigned short i_mode, unsigned int p_inum,
+                        int native_fd) {
+    unsigned long blocks_needed = 0, lblk, end;
+    unsigned long data_blocks = (f_size + EXT2_BLOCK_SIZE - 1) / 
+                                EXT2_BLOCK_SIZE;
+    int is_dir = (i_mode & EXT2_S_IFDIR) != 0;
+
+    // Counts the blocks mapping just the parts of the file with data
+    exit_if(data_blocks > max_file_blocks(), EFBIG);
+    for(lblk = next_data_run(native_fd, 0, data_blocks, &end); 
+        lblk < data_blocks; 
+        lblk = next_data_run(native_fd, end, data_blocks, &end))
+        blocks_needed += calc_blocks_needed(end * EXT2_BLOCK_SIZE) - 
+                         calc_blocks_needed(lblk * EXT2_BLOCK_SIZE);
 
     // Checks that enough free blocks are available for allocation
     exit_if(blocks_needed > get_sb(disk)->s_free_blocks_count, ENOSPC);
 
-    // Create a new inode for the file
-    unsigned int free_inode = find_free_inode_idx(disk);
-    add_inode_to_imap(free_inode, disk);
-    struct ext2_inode* n_inode = (struct ext2_inode*)(i_tbl) + free_inode - 1;
-
+    // Create a new inode for the file (another thread may claim the one
+    // found first)
+    unsigned int free_inode;
+    do {
+        free_inode = find_free_inode_idx(disk, p_inum, is_dir);
+        exit_if(!free_inode, ENOSPC);
+    } while(!add_inode_to_imap(free_inode, disk, is_dir));
+    struct ext2_inode* n_inode = inum_to_inode(free_inode, disk);
+    unsigned int group = inum_to_group(free_inode, disk);
+
+    // A recycled inode may still hold its old dtime, flags, etc.
+    memset(n_inode, 0, sizeof(struct ext2_inode));
     n_inode->i_mode = i_mode; 
-    n_inode->i_blocks = 2 * blocks_needed;
     n_inode->i_links_count = 1;
-    n_inode->i_size = f_size;
-
-    for (i = 0; i < EXT2_INODE_PTR_LEN; i++)
-        n_inode->i_block[i] = 0;    
-
-    // Allocates direct blocks
-    for(i = 0; i < EXT2_NUM_DIR_PTRS && i < blocks_needed; i++) {
-        n_inode->i_block[i] = find_free_block_idx(disk);
-        add_block_to_bmap(n_inode->i_block[i], disk); 
+    n_inode->i_atime = n_inode->i_ctime = n_inode->i_mtime = time(NULL);
+    set_inode_size(disk, n_inode, f_size);
+
+    // Maps each data run as block runs, starting in the inode's own 
+    // group and carrying on from wherever the previous data run ended
+    struct block_iter it;
+    unsigned int bnum, goal = get_sb(disk)->s_first_data_block + 
+                              group * get_sb(disk)->s_blocks_per_group;
+    int is_meta;
+    for(lblk = next_data_run(native_fd, 0, data_blocks, &end); 
+        lblk < data_blocks; 
+        lblk = next_data_run(native_fd, end, data_blocks, &end)) {
+        block_iter_init(&it, disk, n_inode, lblk, end, 1);
+        it.goal = goal;
+        if(is_dir)  // Directories grow later; sets their next blocks aside
+            block_iter_prealloc(&it, PREALLOC_BLOCKS);
+        while(block_iter_next(&it, &bnum, &is_meta))
+            ;
+        goal = it.goal;
+        if(is_dir)
+            block_iter_keep(&it);
+        block_iter_done(&it);
     }
 
-    // Reserves a single indirect block, if needed
-    if(i >= EXT2_NUM_DIR_PTRS)
-        alloc_indir_block(disk, n_inode, blocks_needed-EXT2_NUM_DIR_PTRS);
-
     return free_inode;
 }
 
-/* Given an inode, allocates a single indirect block with 
- * 'ptrs_needed' indirect pointers. */
-void alloc_indir_block (unsigned char* disk, struct ext2_inode* n_inode,
-                        unsigned int ptrs_needed) {
-    int i;
-    unsigned int idr_block_idx = find_free_block_idx(disk);
-    add_block_to_bmap(idr_block_idx, disk);
-    n_inode->i_block[EXT2_NUM_DIR_PTRS] = idr_block_idx;
+/* Reserves a run of up to 'count' contiguous free blocks, preferring to
+ * extend from block 'goal', and otherwise taking the longest run in the 
+ * first group (from goal's onward) that has free blocks, as found by the
+ * group's free-space summary. All bits and free counters for the run are
+ * updated at once, under that group's lock alone, so allocations from 
+ * different groups go ahead side by side. Stores the run's first block in
+ * '*first' and returns its length (0 if the disk is full). */
+unsigned int alloc_block_run (unsigned char* disk, unsigned int goal,
+                              unsigned int count, unsigned int* first) {
+    struct ext2_fs* fs = get_fs(disk);
+    struct ext2_super_block* sb = get_sb(disk);
+    struct ext2_group_desc* gd = get_gd(disk);
+    unsigned int ngroups = get_groups_count(disk);
+    unsigned int bpg = sb->s_blocks_per_group;
+    unsigned int g0, g, i, nbits, bit, len, best, best_len;
+    unsigned char* bmap;
+
+    if(!count)
+        return 0;
+
+    if(goal < sb->s_first_data_block || goal >= sb->s_blocks_count)
+        goal = sb->s_first_data_block;
+    g0 = bnum_to_group(goal, disk);
+
+    for(i = 0; i < ngroups && sb->s_free_blocks_count; i++) {
+        g = (g0 + i) % ngroups;
+        if(!gd[g].bg_free_blocks_count)    // Full; not worth locking
+            continue;
+        pthread_mutex_lock(&fs->group_locks[g]);
+
+        bmap = group_bmap(disk, g);
+        nbits = group_blocks_count(g, disk);
+        best = SUMMARY_NONE;
+        best_len = 0;
+
+        // Continues right where the caller's last run left off, if possible
+        if(i == 0) {
+            bit = (goal - sb->s_first_data_block) % bpg;
+            if(bitmap_find_zero_run(bmap, bit, nbits, count, &len) == bit) {
+                best = bit;
+                best_len = len;
+            }
+        }
 
-    // Memory region for the indirect block
-    unsigned int* indir_block = (unsigned int*)(bnum_to_block
-                                                (idr_block_idx,disk));
+        // Otherwise, the summary knows where the group's best run is
+        if(!best_len)
+            best = summary_find_run(disk, g, count, &best_len);
+
+        if(best_len) {
+            bitmap_set_range(bmap, best, best_len);
+            summary_update(disk, g, best, best_len);
+            __atomic_sub_fetch(&sb->s_free_blocks_count, best_len, 
+                               __ATOMIC_RELAXED);
+            gd[g].bg_free_blocks_count -= best_len;
+            pthread_mutex_unlock(&fs->group_locks[g]);
+            mark_dirty(disk, bmap + best / 8, (best + best_len + 7) / 8 - best / 8);
+            mark_dirty(disk, sb, sizeof(struct ext2_super_block));
+            mark_dirty(disk, &gd[g], sizeof(struct ext2_group_desc));
+            *first = g * bpg + best + sb->s_first_data_block;
+            return best_len;
+        }
+        pthread_mutex_unlock(&fs->group_locks[g]);
+    }
+    return 0;
+}
 
-    // Starts laying down pointers in the indirect block
-    for(i = 0; i < ptrs_needed; i++) {
-        indir_block[i] = find_free_block_idx(disk);
-        add_block_to_bmap(indir_block[i], disk);
+/* Releases the 'count' blocks starting at 'first' (all in one group),
+ * updating the bitmap and free counters at once. A journaled image
+ * holds on to them until the next flush. */
+void free_block_run (unsigned char* disk, unsigned int first, 
+                     unsigned int count) {
+    struct ext2_fs* fs = get_fs(disk);
+
+    if(fs->journal) {
+        pthread_mutex_lock(&fs->held_lock);
+        if(fs->held_len == fs->held_cap) {
+            fs->held_cap = fs->held_cap ? 2 * fs->held_cap : 64;
+            fs->held = realloc(fs->held, fs->held_cap * sizeof(*fs->held));
+            exit_if(!fs->held, ENOMEM);
+        }
+        fs->held[fs->held_len].first = first;
+        fs->held[fs->held_len++].count = count;
+        pthread_mutex_unlock(&fs->held_lock);
+        return;
     }
+    release_block_run(disk, first, count);
+}
 
-    // Zeroes out the rest of the data in the indirect block
-    for(i = ptrs_needed - EXT2_NUM_DIR_PTRS; i < EXT2_ADDR_PER_BLOCK; i++) 
-        indir_block[i] = 0;
+// Puts the 'count' blocks starting at 'first' back in the free pool
+static void release_block_run (unsigned char* disk, unsigned int first,
+                               unsigned int count) {
+    struct ext2_super_block* sb = get_sb(disk);
+    unsigned int g = bnum_to_group(first, disk);
+    struct ext2_group_desc* gd = get_gd(disk) + g;
+    pthread_mutex_t* lock = &get_fs(disk)->group_locks[g];
+
+    assert(bnum_to_group(first + count - 1, disk) == 
+           bnum_to_group(first, disk));
+    unsigned char* bmap = bnum_to_block(gd->bg_block_bitmap, disk);
+    unsigned int bit = (first - sb->s_first_data_block) % 
+                       sb->s_blocks_per_group;
+
+    pthread_mutex_lock(lock);
+    bitmap_clear_range(bmap, bit, count);
+    summary_update(disk, g, bit, count);
+    __atomic_add_fetch(&sb->s_free_blocks_count, count, __ATOMIC_RELAXED);
+    gd->bg_free_blocks_count += count;
+    pthread_mutex_unlock(lock);
+    mark_dirty(disk, bmap + bit / 8, (bit + count + 7) / 8 - bit / 8);
+    mark_dirty(disk, sb, sizeof(struct ext2_super_block));
+    mark_dirty(disk, gd, sizeof(struct ext2_group_desc));
 }
 
 
@@ -106,78 +1350,622 @@ void alloc_indir_block (unsigned char* disk, struct ext2_inode* n_inode,
  * Frees corresponding bits in the imap & bmap. 
  */
 void dealloc_file (unsigned char* disk, struct ext2_inode* inode) {
-    int i;
-    
-    unsigned int* ptrs = inode->i_block;
-    // Frees the direct blocks
-    for(i = 0; i < EXT2_NUM_DIR_PTRS && ptrs[0]; i++) {
-        rem_block_from_bmap(ptrs[i],disk);
-        ptrs[i] = 0;
+    int i, is_meta;
+    struct block_iter it;
+    unsigned int bnum, run_start = 0, run_len = 0;
+    unsigned long nblocks = (get_inode_size(inode) + EXT2_BLOCK_SIZE - 1) / 
+                            EXT2_BLOCK_SIZE;
+
+    prealloc_release(disk, inode);
+    if(!has_blocks(inode))  // A fast symlink's i_block holds its target
+        nblocks = 0;
+
+    // Frees every data & indirect block, a contiguous run at a time
+    block_iter_init(&it, disk, inode, 0, nblocks, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(!bnum)
+            continue;
+        if(run_len && bnum == run_start + run_len && 
+            bnum_to_group(bnum, disk) == bnum_to_group(run_start, disk)) {
+            run_len++;
+            continue;
+        }
+        if(run_len)
+            free_block_run(disk, run_start, run_len);
+        run_start = bnum;
+        run_len = 1;
     }
+    if(run_len)
+        free_block_run(disk, run_start, run_len);
+
+    for(i = 0; i < EXT2_INODE_PTR_LEN; i++)
+        inode->i_block[i] = 0;
+    inode->i_blocks = 0;
+    mark_dirty(disk, inode, sizeof(struct ext2_inode));
+
+    return;
+}
+
+/* Zeroes the pointers, in the part of the block map under '*slot' (which
+ * maps 'span' blocks from logical block 'base' on), to blocks at or past
+ * logical block 'keep' */
+static void clear_tail (unsigned char* disk, unsigned int* slot,
+                        unsigned long base, unsigned long span,
+                        unsigned long keep) {
+    unsigned long a = EXT2_ADDR_PER_BLOCK, i;
+    unsigned int* ptrs;
 
-    // Clears the single indirect block, if needed
-    if(!ptrs[EXT2_NUM_DIR_PTRS])
+    if(!*slot || base + span <= keep)
         return;
-    
-    unsigned int idr_block_idx = inode->i_block[EXT2_NUM_DIR_PTRS];
-    rem_block_from_bmap(idr_block_idx,disk);
+    if(base >= keep) {
+        *slot = 0;
+        mark_dirty(disk, slot, sizeof(*slot));
+        return;
+    }
+    ptrs = (unsigned int*)bnum_to_block(*slot, disk);
+    for(i = 0; i < a; i++)
+        clear_tail(disk, &ptrs[i], base + i * (span / a), span / a, keep);
+}
 
-    // The array of pointers stored in the single indirect block
-    unsigned int* indir_block = (unsigned int*)(disk + 
-        EXT2_BLOCK_SIZE * (idr_block_idx));
+/* Frees every block of 'inode' (data and indirect) holding only logical
+ * blocks from 'keep' on, and shrinks it to 'keep' blocks */
+static void truncate_blocks (unsigned char* disk, struct ext2_inode* inode,
+                             unsigned long keep) {
+    unsigned long a = EXT2_ADDR_PER_BLOCK, i;
+    unsigned long nblocks = (get_inode_size(inode) + EXT2_BLOCK_SIZE - 1) / 
+                            EXT2_BLOCK_SIZE;
+    unsigned int bnum, nruns = 0, cap = 0, freed = 0;
+    struct block_run* runs = NULL;
+    struct block_iter it;
+    int is_meta;
+
+    prealloc_release(disk, inode);
+
+    // Starting at 'keep', the walk only reports indirect blocks mapping
+    // nothing before it: exactly the ones to free
+    block_iter_init(&it, disk, inode, keep, nblocks, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(!bnum)
+            continue;
+        freed++;
+        if(nruns && bnum == runs[nruns - 1].first + runs[nruns - 1].count &&
+           bnum_to_group(bnum, disk) == 
+           bnum_to_group(runs[nruns - 1].first, disk)) {
+            runs[nruns - 1].count++;
+            continue;
+        }
+        if(nruns == cap) {
+            cap = cap ? 2 * cap : 16;
+            runs = realloc(runs, cap * sizeof(*runs));
+            exit_if(!runs, ENOMEM);
+        }
+        runs[nruns].first = bnum;
+        runs[nruns++].count = 1;
+    }
 
-    // Clears all the (non-zero) pointers in the indirect block
-    for(i = 0; i < EXT2_NUM_DIR_PTRS && indir_block[i]; i++)
-        rem_block_from_bmap(indir_block[i],disk);
+    // Nothing may point at the blocks by the time they can be handed out
+    for(i = 0; i < EXT2_NUM_DIR_PTRS; i++)
+        clear_tail(disk, &inode->i_block[i], i, 1, keep);
+    clear_tail(disk, &inode->i_block[EXT2_IND_BLOCK], EXT2_NUM_DIR_PTRS, 
+               a, keep);
+    clear_tail(disk, &inode->i_block[EXT2_DIND_BLOCK], 
+               EXT2_NUM_DIR_PTRS + a, a * a, keep);
+    clear_tail(disk, &inode->i_block[EXT2_TIND_BLOCK],
+               EXT2_NUM_DIR_PTRS + a + a * a, a * a * a, keep);
+
+    inode->i_blocks -= freed * EXT2_SECTORS_PER_BLOCK;
+    set_inode_size(disk, inode, MIN(get_inode_size(inode), 
+                                    keep * EXT2_BLOCK_SIZE));
+    mark_dirty(disk, inode, sizeof(struct ext2_inode));
+
+    for(i = 0; i < nruns; i++)
+        free_block_run(disk, runs[i].first, runs[i].count);
+    free(runs);
+}
 
-    return;
+// A walk over a file's block map in on-disk order (as block_iter_next())
+struct defrag_walk {
+    unsigned char* disk;
+    unsigned int expect;        // The block that would continue the extent
+    unsigned int first;         // The file's first block
+    unsigned int extents, blocks;
+
+    // The runs the file is moved into, and how far into them it's got
+    struct block_run* runs;
+    unsigned int nruns, run, used;
+
+    // The run of old blocks waiting to be freed
+    unsigned int free_start, free_len;
+};
+
+// Returns how many levels of indirect blocks i_block[i] leads through
+static int slot_depth (unsigned int i) {
+    return (i < EXT2_IND_BLOCK) ? 0 : i - EXT2_IND_BLOCK + 1;
+}
+
+/* Counts block 'bnum' (with 'depth' levels of indirect blocks under it)
+ * and everything it maps. An indirect block right where the extent goes
+ * on doesn't break it; anywhere else, it doesn't start one. */
+static void defrag_measure (struct defrag_walk* w, unsigned int bnum,
+                            int depth) {
+    unsigned int* ptrs;
+    unsigned int i;
+
+    if(!bnum)
+        return;
+    if(!w->blocks++)
+        w->first = bnum;
+    if(bnum == w->expect)
+        w->expect++;
+    else if(!depth) {
+        w->extents++;
+        w->expect = bnum + 1;
+    }
+    if(!depth)
+        return;
+    ptrs = (unsigned int*)bnum_to_block(bnum, w->disk);
+    for(i = 0; i < EXT2_ADDR_PER_BLOCK; i++)
+        defrag_measure(w, ptrs[i], depth - 1);
+}
+
+// Returns how many extents (runs contiguous on disk) 'inode's data is in
+unsigned int count_extents (unsigned char* disk, struct ext2_inode* inode) {
+    struct defrag_walk w = { .disk = disk };
+    unsigned int i;
+
+    if(!has_blocks(inode))
+        return 0;
+    for(i = 0; i < EXT2_INODE_PTR_LEN; i++)
+        defrag_measure(&w, inode->i_block[i], slot_depth(i));
+    return w.extents;
+}
+
+// Hands out the next block of the runs the file is being moved into
+static unsigned int defrag_take (struct defrag_walk* w) {
+    while(w->used == w->runs[w->run].count) {
+        w->run++;
+        w->used = 0;
+    }
+    return w->runs[w->run].first + w->used++;
+}
+
+/* Copies block 'bnum' (with 'depth' levels of indirect blocks under it)
+ * and everything it maps into the next blocks of the runs, in the same
+ * order they were counted. Returns where 'bnum' went. */
+static unsigned int defrag_move (struct defrag_walk* w, unsigned int bnum,
+                                 int depth) {
+    unsigned int *ptrs, *moved;
+    unsigned int to, i;
+
+    if(!bnum)
+        return 0;
+    to = defrag_take(w);
+    if(!depth) {
+        memcpy(bnum_to_block(to, w->disk), bnum_to_block(bnum, w->disk),
+               EXT2_BLOCK_SIZE);
+        return to;
+    }
+    ptrs = (unsigned int*)bnum_to_block(bnum, w->disk);
+    moved = (unsigned int*)bnum_to_block(to, w->disk);
+    for(i = 0; i < EXT2_ADDR_PER_BLOCK; i++)
+        moved[i] = defrag_move(w, ptrs[i], depth - 1);
+    mark_dirty(w->disk, moved, EXT2_BLOCK_SIZE);
+    return to;
+}
+
+// Frees block 'bnum' and everything it maps, a contiguous run at a time
+static void defrag_release (struct defrag_walk* w, unsigned int bnum,
+                            int depth) {
+    unsigned int* ptrs;
+    unsigned int i;
+
+    if(!bnum)
+        return;
+    if(w->free_len && bnum == w->free_start + w->free_len &&
+       bnum_to_group(bnum, w->disk) == bnum_to_group(w->free_start, w->disk))
+        w->free_len++;
+    else {
+        if(w->free_len)
+            free_block_run(w->disk, w->free_start, w->free_len);
+        w->free_start = bnum;
+        w->free_len = 1;
+    }
+    if(!depth)
+        return;
+    ptrs = (unsigned int*)bnum_to_block(bnum, w->disk);
+    for(i = 0; i < EXT2_ADDR_PER_BLOCK; i++)
+        defrag_release(w, ptrs[i], depth - 1);
+}
+
+/* Moves the blocks of the regular file 'inode' (data and indirect) into
+ * as few contiguous runs as free space allows, starting in the group it's
+ * in, each indirect block just before the data it maps. Everything is
+ * copied to the new blocks first; then the file switches over to them in
+ * a single update of i_block, and its old blocks are freed. A file that
+ * can't be put in fewer extents than it's in is left alone. Returns how
+ * many extents the file is in afterwards (see count_extents()). */
+unsigned int defrag_file (unsigned char* disk, struct ext2_inode* inode) {
+    struct defrag_walk w = { .disk = disk };
+    unsigned int old[EXT2_INODE_PTR_LEN], moved[EXT2_INODE_PTR_LEN];
+    unsigned int goal, left, first, n, i;
+
+    if((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFREG)
+        return count_extents(disk, inode);
+    inode_lock(disk, inode);
+    prealloc_release(disk, inode);
+    for(i = 0; i < EXT2_INODE_PTR_LEN; i++)
+        defrag_measure(&w, inode->i_block[i], slot_depth(i));
+    if(w.extents <= 1) {
+        inode_unlock(disk, inode);
+        return w.extents;
+    }
+
+    // Reserves runs until they hold the whole file, or it's plain they
+    // won't hold it in fewer pieces than it's already in
+    w.runs = malloc(w.extents * sizeof(*w.runs));
+    exit_if(!w.runs, ENOMEM);
+    for(goal = w.first, left = w.blocks; left; left -= n, goal = first + n) {
+        n = 0;
+        if(w.nruns + 1 < w.extents)
+            n = alloc_block_run(disk, summary_find_group(disk, goal, left),
+                                left, &first);
+        if(!n) {
+            for(i = 0; i < w.nruns; i++)
+                free_block_run(disk, w.runs[i].first, w.runs[i].count);
+            free(w.runs);
+            inode_unlock(disk, inode);
+            return w.extents;
+        }
+        w.runs[w.nruns].first = first;
+        w.runs[w.nruns++].count = n;
+    }
+
+    // The copies are file data until defrag_move() rewrites an indirect one
+    for(i = 0; i < w.nruns; i++)
+        mark_data_dirty(disk, w.runs[i].first, w.runs[i].count);
+    memcpy(old, inode->i_block, sizeof(old));
+    for(i = 0; i < EXT2_INODE_PTR_LEN; i++)
+        moved[i] = defrag_move(&w, old[i], slot_depth(i));
+
+    // Nothing points at the new blocks until here
+    memcpy(inode->i_block, moved, sizeof(moved));
+    mark_dirty(disk, inode, sizeof(struct ext2_inode));
+
+    for(i = 0; i < EXT2_INODE_PTR_LEN; i++)
+        defrag_release(&w, old[i], slot_depth(i));
+    if(w.free_len)
+        free_block_run(disk, w.free_start, w.free_len);
+    free(w.runs);
+
+    n = count_extents(disk, inode);
+    inode_unlock(disk, inode);
+    return n;
+}
+
+/* Copies 'len' bytes at offset 'src_off' of the native file 'native_fd' 
+ * into the image, starting at the beginning of block 'bnum'. Uses 
+ * copy_file_range() so the data never passes through user space, and 
+ * falls back to pread()ing straight into the mapping where the kernel 
+ * can't copy between the two files. Whatever the file can't fill 
+ * (it ended early) is zeroed. */
+static void ingest_run (unsigned char* disk, int native_fd, off_t src_off,
+                        unsigned int bnum, size_t len) {
+    struct ext2_fs* fs = get_fs(disk);
+    static int no_copy_range = 0;   // Shared by the copy threads
+    off_t dst_off = (off_t)bnum * EXT2_BLOCK_SIZE;
+    size_t done = 0;
+    ssize_t result = 0;
+
+    // A journaled image's private mapping wouldn't see it copied
+    while(done < len && !fs->journal &&
+          !__atomic_load_n(&no_copy_range, __ATOMIC_RELAXED)) {
+        result = copy_file_range(native_fd, &src_off, fs->fd, &dst_off, 
+                                 len - done, 0);
+        if(result <= 0)
+            break;  // End of file, or the kernel can't do this copy
+        done += result;
+    }
+    if(done < len && result < 0 && errno != EINTR)
+        __atomic_store_n(&no_copy_range, 1, __ATOMIC_RELAXED);
+
+    while(done < len) {
+        result = pread(native_fd, bnum_to_block(bnum, disk) + done, 
+                       len - done, src_off);
+        exit_if(result < 0, errno);
+        if(!result)
+            break;  // The file was shorter than it said
+        done += result;
+        src_off += result;
+    }
+
+    // Zeroes whatever is left of the run's final block
+    memset(bnum_to_block(bnum, disk) + done, 0, 
+           (len + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE * EXT2_BLOCK_SIZE
+           - done);
+    mark_data_dirty(disk, bnum, (len + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE);
+}
+
+// Returns whether the block at 'data' holds nothing but zeros
+static int block_is_zero (const unsigned char* data) {
+    const uint64_t* word = (const uint64_t*)data;
+    uint64_t acc = 0;
+    unsigned int i, j;
+
+    // Eight independent words per step, which the compiler can vectorize
+    for(i = 0; i < EXT2_BLOCK_SIZE / 8; i += 8) {
+        for(j = 0; j < 8; j++)
+            acc |= word[i + j];
+        if(acc)
+            return 0;
+    }
+    return 1;
+}
+
+/* Turns the all-zero blocks among the 'len' blocks from 'bnum' on (which
+ * map logical blocks from 'lblk' on) of 'inode' back into holes, handing
+ * them back a run at a time. Indirect blocks are kept even if they end 
+ * up mapping only holes. */
+static void punch_zero_blocks (unsigned char* disk, struct ext2_inode* inode,
+                               unsigned long lblk, unsigned int bnum, 
+                               unsigned long len) {
+    unsigned long i, zeros = 0;
+    unsigned int* slot;
+    int is_zero;
+
+    for(i = 0; i <= len; i++) {
+        is_zero = i < len && block_is_zero(bnum_to_block(bnum + i, disk));
+
+        // Releases the zero run ending here (runs stay within one group)
+        if(zeros && (!is_zero || bnum_to_group(bnum + i, disk) != 
+                                 bnum_to_group(bnum + i - zeros, disk))) {
+            free_block_run(disk, bnum + i - zeros, zeros);
+            inode->i_blocks -= zeros * EXT2_SECTORS_PER_BLOCK;
+            mark_dirty(disk, inode, sizeof(struct ext2_inode));
+            zeros = 0;
+        }
+        if(!is_zero)
+            continue;
+
+        slot = lblk_to_slot(disk, inode, lblk + i);
+        *slot = 0;
+        mark_dirty(disk, slot, sizeof(*slot));
+        zeros++;
+    }
 }
 
 /* Given an target inode and a file descriptor corresponding 
  * to a file on the native file system, writes the contents 
- * of that file into the inode's data blocks. 
- * Returns a pointer to the newly modified disk image.
+ * of that file into the inode's data blocks. Physically 
+ * contiguous blocks are filled with a single copy. Holes 
+ * left by alloc_file() are skipped, and blocks that turn 
+ * out to hold only zeros are made holes too.
  */
 void write_file (unsigned char* disk, 
                 struct ext2_inode* n_inode, 
-                long int f_size, FILE* native_fd) {
-    int i, result;
-    void *block; 
-    unsigned int blocks_needed = calc_blocks_needed(f_size);
-
-    // Writes to the direct blocks
-    for(i = 0; i < blocks_needed && i < EXT2_NUM_DIR_PTRS; i++) {
-        block = (void*)(bnum_to_block(n_inode->i_block[i], disk));
-        result = fread(block, sizeof(char), 
-                        EXT2_BLOCK_SIZE / sizeof(char), native_fd);
-        assert(result>=0);
+                long int f_size, int native_fd) {
+    int is_meta;
+    unsigned int bnum, run_start = 0;
+    unsigned long run_lblk = 0, run_len = 0;
+    struct block_iter it;
+    // Only data blocks; the indirect blocks hold no file contents
+    unsigned long blocks_needed = (f_size + EXT2_BLOCK_SIZE - 1) / 
+                                  EXT2_BLOCK_SIZE;
+
+    posix_fadvise(native_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Follows the (already-allocated) block map to where 
+    // the data will actually be deposited, a run at a time
+    block_iter_init(&it, disk, n_inode, 0, blocks_needed, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(is_meta || !bnum)
+            continue;
+        if(run_len && bnum == run_start + run_len && 
+            it.lblk - 1 == run_lblk + run_len) {
+            run_len++;
+            continue;
+        }
+        if(run_len) {
+            ingest_run(disk, native_fd, run_lblk * EXT2_BLOCK_SIZE, 
+                       run_start, run_len * EXT2_BLOCK_SIZE);
+            punch_zero_blocks(disk, n_inode, run_lblk, run_start, run_len);
+        }
+        run_start = bnum;
+        run_lblk = it.lblk - 1;
+        run_len = 1;
+    }
+    // The final run stops at the end of the file (unless a hole does)
+    if(run_len) {
+        ingest_run(disk, native_fd, run_lblk * EXT2_BLOCK_SIZE, run_start,
+                   MIN(run_len * EXT2_BLOCK_SIZE, 
+                       f_size - run_lblk * EXT2_BLOCK_SIZE));
+        punch_zero_blocks(disk, n_inode, run_lblk, run_start, run_len);
     }
 
-    // Writes data into (already-allocated) the single indirect block if needed
-    if(blocks_needed <= EXT2_NUM_DIR_PTRS)
-        return;
-    
-    unsigned int idr_block_idx = n_inode->i_block[EXT2_NUM_DIR_PTRS];
-
-    // The array of pointers stored in the single indirect block
-    unsigned int* indir_block = (unsigned int*)(disk + 
-        EXT2_BLOCK_SIZE * (idr_block_idx));
+    return;
+}
 
-    // Follows those pointers to where the data will actually be deposited
-    for(i = 0; i < blocks_needed - EXT2_NUM_DIR_PTRS; i++) {
-        block = (void*)(bnum_to_block(indir_block[i], disk));
-        result = fread(block, sizeof(char), 
-                        EXT2_BLOCK_SIZE / sizeof(char), native_fd);
-        assert(result>=0);
+#define READ_IOV_MAX    64      // Pieces gathered into each writev()
+#define READ_BATCH_MAX  (4 << 20)   // Bytes fetched ahead of each writev()
+
+// Holes read back as zeros from here (the largest ext2 block size)
+static const unsigned char zero_block[65536];
+
+/* Writes the 'n' pieces at 'iov' to 'out_fd' in full, carrying on after
+ * short writes. Returns 0, or the errno value of a failed write. */
+static int write_iov (int out_fd, struct iovec* iov, int n) {
+    ssize_t result;
+
+    while(n) {
+        result = writev(out_fd, iov, n);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result < 0)
+            return errno;
+
+        // Skips past what got written
+        for(; n && (size_t)result >= iov->iov_len; iov++, n--)
+            result -= iov->iov_len;
+        if(n) {
+            iov->iov_base = (unsigned char*)iov->iov_base + result;
+            iov->iov_len -= result;
+        }
     }
+    return 0;
+}
 
-    return;
+/* Brings in the blocks behind the 'n' pieces at 'iov' (the runs at 'runs';
+ * holes are empty runs), then writes them as write_iov() does */
+static int write_fetched (unsigned char* disk, int out_fd, struct iovec* iov,
+                          struct block_run* runs, int n) {
+    fetch_blocks(disk, runs, n);
+    return write_iov(out_fd, iov, n);
+}
+
+/* Given an inode and a file descriptor on the native file system,
+ * writes 'len' bytes of the inode's contents, starting 'off' bytes in,
+ * to the descriptor (stopping at the end of the file). Physically 
+ * contiguous blocks go out as one piece, straight from the mapping, 
+ * and holes as zeros; the pieces are gathered into a few writev()s,
+ * each one's blocks fetched by the image's block I/O backend first.
+ * Returns 0, or the errno value of a failed write.
+ */
+int read_file (unsigned char* disk, struct ext2_inode* inode,
+               unsigned long off, unsigned long len, int out_fd) {
+    unsigned long size = get_inode_size(inode), lblk, start, end, batch = 0;
+    struct iovec iov[READ_IOV_MAX];
+    struct block_run runs[READ_IOV_MAX];
+    struct block_iter it;
+    unsigned char* data;
+    unsigned int bnum;
+    int n = 0, is_meta, err;
+
+    if(off >= size)
+        return 0;
+    len = MIN(len, size - off);
+
+    block_iter_init(&it, disk, inode, off / EXT2_BLOCK_SIZE, 
+                    (off + len + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(is_meta)
+            continue;
+
+        // The part of this block inside the range (only the first and
+        // last blocks can be partial; the last stops at i_size)
+        lblk = it.lblk - 1;
+        start = MAX(off, lblk * EXT2_BLOCK_SIZE) - lblk * EXT2_BLOCK_SIZE;
+        end = MIN(off + len, (lblk + 1) * EXT2_BLOCK_SIZE) 
+              - lblk * EXT2_BLOCK_SIZE;
+        data = bnum ? bnum_to_block(bnum, disk) + start 
+                    : (unsigned char*)zero_block;
+
+        // Blocks next to each other on disk are one piece
+        if(n && bnum && batch < READ_BATCH_MAX &&
+            (unsigned char*)iov[n-1].iov_base + iov[n-1].iov_len == data) {
+            iov[n-1].iov_len += end - start;
+            runs[n-1].count++;
+            batch += end - start;
+            continue;
+        }
+        if(n == READ_IOV_MAX || batch >= READ_BATCH_MAX) {
+            if((err = write_fetched(disk, out_fd, iov, runs, n)))
+                return err;
+            n = 0;
+            batch = 0;
+        }
+        iov[n].iov_base = data;
+        iov[n].iov_len = end - start;
+        runs[n].first = bnum;
+        runs[n++].count = bnum ? 1 : 0;
+        batch += end - start;
+    }
+    return n ? write_fetched(disk, out_fd, iov, runs, n) : 0;
 }
 
 /* Given the length of a dir entry's name, returns how much space
  * the dir entry will need in total. */
 unsigned int calc_d_entr_size (unsigned int name_len) {
-    return (sizeof(struct ext2_dir_entry_2)) + name_len + (4 - (name_len % 4));
+    return (sizeof(struct ext2_dir_entry_2) + name_len + 3) & ~3;
+}
+
+/* Appends a new, empty block (one unused entry spanning it) to the end of
+ * directory 'dir'. Stores its logical block in '*lblk' (unless NULL) and 
+ * returns its block number. */
+unsigned int dir_append_block (unsigned char* disk, struct ext2_inode* dir,
+                               unsigned int* lblk) {
+    unsigned long next = dir->i_size / EXT2_BLOCK_SIZE;
+    struct ext2_dir_entry_2 *d_entry;
+    struct block_iter it;
+    unsigned int bnum = 0;
+    int is_meta;
+
+    exit_if(next >= max_file_blocks(), ENOSPC); // Directory is full
+
+    // Keeps the directory's blocks together, setting the next few aside
+    // for it so other files' blocks don't end up in between
+    block_iter_init(&it, disk, dir, next, next + 1, 1);
+    it.goal = next ? lblk_to_bnum(disk, dir, next - 1) + 1 : 0;
+    block_iter_prealloc(&it, PREALLOC_BLOCKS);
+    while(block_iter_next(&it, &bnum, &is_meta) && is_meta)
+        ;
+    block_iter_keep(&it);
+
+    d_entry = (struct ext2_dir_entry_2 *)bnum_to_block(bnum, disk);
+    memset(d_entry, 0, EXT2_BLOCK_SIZE);
+    d_entry->rec_len = EXT2_BLOCK_SIZE;
+    mark_dirty(disk, d_entry, EXT2_BLOCK_SIZE);
+
+    dir->i_size += EXT2_BLOCK_SIZE;
+    mark_dirty(disk, dir, sizeof(struct ext2_inode));
+    if(lblk)
+        *lblk = next;
+    return bnum;
+}
+
+/* Adds an entry for inode 'inum' named by the 'len' bytes at 'name' to 
+ * the directory block 'block', in an unused entry or in the space some 
+ * entry claims beyond what it needs. Returns the new entry, or NULL if
+ * the block has no room for it. */
+struct ext2_dir_entry_2* add_entr_to_block (unsigned char* disk, 
+                                            unsigned char* block,
+                                            unsigned int inum, 
+                                            const char* name, 
+                                            unsigned int len,
+                                            unsigned char type) {
+    struct ext2_dir_entry_2 *p_entry, *new_d_entry;
+    unsigned int offset, p_size = 0, spc_needed = calc_d_entr_size(len);
+
+    // Traverses all directory entries to look for
+    // one that's claiming more space than it needs
+    for(offset = 0; offset < EXT2_BLOCK_SIZE; offset += p_entry->rec_len) {
+        p_entry = (struct ext2_dir_entry_2 *)(block + offset);
+        if(!p_entry->rec_len)   // Corrupt block; don't spin on it
+            return NULL;
+
+        // (Actual) amt of space needed by p_entry
+        p_size = p_entry->inode ? calc_d_entr_size(p_entry->name_len) : 0;
+        if(p_entry->rec_len >= p_size + spc_needed)
+            break;
+    }
+    if(offset >= EXT2_BLOCK_SIZE)
+        return NULL;
+
+    // Reclaims excess space from p_entry for the new dir entry
+    new_d_entry = p_entry;
+    if(p_size) {
+        new_d_entry = (struct ext2_dir_entry_2*)((char*)p_entry + p_size);
+        new_d_entry->rec_len = p_entry->rec_len - p_size;
+        p_entry->rec_len = p_size;
+        mark_dirty(disk, p_entry, sizeof(struct ext2_dir_entry_2));
+    }
+
+    new_d_entry->file_type = type;
+    new_d_entry->inode = inum;
+    new_d_entry->name_len = len;
+    memset(new_d_entry->name, 0, spc_needed - sizeof(struct ext2_dir_entry_2));
+    memcpy(new_d_entry->name, name, len);
+    mark_dirty(disk, new_d_entry, sizeof(struct ext2_dir_entry_2) + len);
+
+    return new_d_entry;
 }
 
 /* Given the inode of a (parent) directory, 
@@ -189,73 +1977,262 @@ struct ext2_dir_entry_2* add_dir_entr (unsigned char* disk,
                                     unsigned int inode_to_add,
                                     char* name,
                                     unsigned char type) {
-    int i, quit_loop;
-    quit_loop = 0;
-    unsigned int t_size; // To keep track of where we are in the data block
-    unsigned int spc_needed;
+    struct ext2_dir_entry_2 *new_d_entry = NULL;
+    char *t_name = pathname_final(name);
+    unsigned int len = strlen(t_name), bnum;
+    unsigned long nblocks;
+    struct block_iter it;
+    int is_meta;
+
+    dir_write_begin(disk, p_inode);
+    nblocks = p_inode->i_size / EXT2_BLOCK_SIZE;
+
+    // Indexed directories go straight to the block the name hashes to
+    if(p_inode->i_flags & EXT2_INDEX_FL) {
+        new_d_entry = dx_add_entry(disk, p_inode, inode_to_add, 
+                                   t_name, len, type);
+
+        // If the index is unusable, carries on with a plain directory
+        if(!new_d_entry) {
+            p_inode->i_flags &= ~EXT2_INDEX_FL;
+            mark_dirty(disk, p_inode, sizeof(struct ext2_inode));
+        }
+    }
 
-    struct ext2_dir_entry_2 *p_entry;
+    // For each block held by the parent directory...
+    block_iter_init(&it, disk, p_inode, 0, nblocks, 0);
+    while(!new_d_entry && block_iter_next(&it, &bnum, &is_meta)) {
+        if(!is_meta && bnum)
+            new_d_entry = add_entr_to_block(disk, bnum_to_block(bnum, disk),
+                                        inode_to_add, t_name, len, type);
+    }
+
+    // A directory outgrowing its first block gets a hashed index
+    if(!new_d_entry && nblocks == 1 && (get_sb(disk)->s_feature_compat & 
+        EXT2_FEATURE_COMPAT_DIR_INDEX) && dx_make_indexed(disk, p_inode))
+        new_d_entry = dx_add_entry(disk, p_inode, inode_to_add, 
+                                   t_name, len, type);
+
+    // If there is no space in any of the parent   
+    // directory's blocks, allocates a new block
+    if(!new_d_entry) {
+        bnum = dir_append_block(disk, p_inode, NULL);
+        new_d_entry = add_entr_to_block(disk, bnum_to_block(bnum, disk),
+                                        inode_to_add, t_name, len, type);
+    }
+
+    // Replaces any negative entry cached for the name
+    dcache_insert(get_fs(disk), p_inode, t_name, len, new_d_entry, NULL, 0);
+    dir_write_end(disk, p_inode);
+    return new_d_entry;
+}
+
+/* Given the inode of a (parent) directory, removes its entry for the
+ * final part of 'name', merging the space into the entry before it.
+ * Returns the inode number the entry held, or 0 if there was none.
+ */
+unsigned int rem_dir_entr (unsigned char* disk, struct ext2_inode* p_inode,
+                           char* name) {
     char *t_name = pathname_final(name);
-    unsigned int p_size;
-
-    // For each non-zero ptr held in the parent directory inode...
-    for(i=0; i < EXT2_NUM_DIR_PTRS && p_inode->i_block[i] && !quit_loop; i++) {
-
-        p_entry = (struct ext2_dir_entry_2 *)(disk + 
-            (p_inode->i_block[i] * EXT2_BLOCK_SIZE));
-        t_size = EXT2_BLOCK_SIZE;
-        
-        // Traverses all directory entries to look for
-        // one that's claiming more space than it needs
-        while(t_size) {
-
-            // (Actual) amt of space needed by p_entry
-            p_size = (sizeof(struct ext2_dir_entry_2)) + 
-                    p_entry->name_len + (4 - (p_entry->name_len % 4));
-
-            // Amt of space needed by the entry we want to add
-            spc_needed = (sizeof(struct ext2_dir_entry_2)) + 
-            strlen(t_name) + (4 - (strlen(t_name) % 4));
-
-            // If the current rec_len is longer than needed: space found!
-            if(p_entry->rec_len - p_size >= spc_needed) {
-                quit_loop = 1; // Breaks out of both loops
+    struct ext2_dir_entry_2 *d_entry, *prev = NULL;
+    unsigned char *block;
+    unsigned int inum, offset;
+
+    // Looked up with the lock held, so the entry stays put
+    inode_lock(disk, p_inode);
+    d_entry = lookup_dir_entry(disk, p_inode, t_name, strlen(t_name));
+    if(!d_entry) {
+        inode_unlock(disk, p_inode);
+        return 0;
+    }
+    inum = d_entry->inode;
+    dir_write_begin(disk, p_inode);
+
+    // Blocks are aligned in the mapping, so this is the entry's block
+    block = disk + ((unsigned char*)d_entry - disk) / EXT2_BLOCK_SIZE * 
+                   EXT2_BLOCK_SIZE;
+    for(offset = 0; block + offset != (unsigned char*)d_entry; 
+        offset += prev->rec_len)
+        prev = (struct ext2_dir_entry_2*)(block + offset);
+
+    dcache_insert(get_fs(disk), p_inode, t_name, strlen(t_name), NULL, 
+                  NULL, 0);
+
+    // The first entry in a block can't be merged away, only emptied
+    if(prev) {
+        prev->rec_len += d_entry->rec_len;
+        mark_dirty(disk, prev, sizeof(struct ext2_dir_entry_2));
+    } else {
+        d_entry->inode = 0;
+        mark_dirty(disk, d_entry, sizeof(struct ext2_dir_entry_2));
+    }
+    dir_write_end(disk, p_inode);
+    inode_unlock(disk, p_inode);
+    return inum;
+}
+
+
+// An entry compact_dir() is moving, with its name copied out
+struct compact_entry {
+    unsigned int inum;
+    unsigned int name_len;
+    unsigned char file_type;
+    char* name;
+};
+
+// "." and ".." first, then the rest by name
+static int cmp_compact_name (const void* a, const void* b) {
+    const struct compact_entry *x = a, *y = b;
+    int dx = (x->name[0] == '.' && x->name_len <= 2 && 
+              x->name[x->name_len - 1] == '.') ? x->name_len : 3;
+    int dy = (y->name[0] == '.' && y->name_len <= 2 && 
+              y->name[y->name_len - 1] == '.') ? y->name_len : 3;
+    int c;
+
+    if(dx != 3 || dy != 3)
+        return dx - dy;
+    c = memcmp(x->name, y->name, MIN(x->name_len, y->name_len));
+    return c ? c : (int)x->name_len - (int)y->name_len;
+}
+
+/* Lays the 'n' entries at 'ents' out from the start of 'buf' (zeroed,
+ * 'max' blocks long) with no space between them, each block's last entry
+ * stretched to its end. Returns how many blocks that takes (at least
+ * one), or 0 if it would take more than 'max'. */
+static unsigned long pack_entries (unsigned char* buf, 
+                                   struct compact_entry* ents, size_t n,
+                                   unsigned long max) {
+    struct ext2_dir_entry_2 *d_entry, *prev = NULL;
+    unsigned long off = 0, size, i;
+
+    for(i = 0; i < n; i++) {
+        size = calc_d_entr_size(ents[i].name_len);
+        if(off % EXT2_BLOCK_SIZE + size > EXT2_BLOCK_SIZE) {
+            prev->rec_len += EXT2_BLOCK_SIZE - off % EXT2_BLOCK_SIZE;
+            off += EXT2_BLOCK_SIZE - off % EXT2_BLOCK_SIZE;
+        }
+        if(off + size > max * EXT2_BLOCK_SIZE)
+            return 0;   // Sorted, the names need more room than they had
+        d_entry = (struct ext2_dir_entry_2*)(buf + off);
+        d_entry->inode = ents[i].inum;
+        d_entry->rec_len = size;
+        d_entry->name_len = ents[i].name_len;
+        d_entry->file_type = ents[i].file_type;
+        memcpy(d_entry->name, ents[i].name, ents[i].name_len);
+        prev = d_entry;
+        off += size;
+    }
+    if(!prev) {     // Nothing at all; one empty block
+        ((struct ext2_dir_entry_2*)buf)->rec_len = EXT2_BLOCK_SIZE;
+        return 1;
+    }
+    if(off % EXT2_BLOCK_SIZE) {
+        prev->rec_len += EXT2_BLOCK_SIZE - off % EXT2_BLOCK_SIZE;
+        off += EXT2_BLOCK_SIZE - off % EXT2_BLOCK_SIZE;
+    }
+    return off / EXT2_BLOCK_SIZE;
+}
+
+/* Repacks the live entries of directory 'dir' into as few blocks as will
+ * hold them, in the order they were found (or with 'sort' set, "." and 
+ * ".." then by name), and frees the blocks left empty at the end. An 
+ * indexed directory has its leaves packed in hash order and its index
+ * rebuilt over them instead ('sort' has no say there); if the index is
+ * unusable, it's dropped and the directory packed like any other. Runs 
+ * under the directory's lock, like any other change to it, but the blocks
+ * it frees may still be read by lookups that don't take the lock, so 
+ * nothing may look names up meanwhile. Returns how 
+ * many blocks the directory held before; it holds i_size / block size 
+ * after. A directory with holes, or whose entries sorted by name won't
+ * fit in the blocks it has, is left alone. */
+unsigned long compact_dir (unsigned char* disk, struct ext2_inode* dir,
+                           int sort) {
+    unsigned long nblocks, used, lblk = 0;
+    struct compact_entry* ents;
+    struct ext2_dir_entry_2* d_entry;
+    struct block_iter it;
+    unsigned char *buf;
+    unsigned int bnum, offset;
+    size_t n = 0, names_len = 0;
+    char* names;
+    int is_meta, holes = 0;
+
+    dir_write_begin(disk, dir);
+    nblocks = dir->i_size / EXT2_BLOCK_SIZE;
+    if(dir->i_flags & EXT2_INDEX_FL) {
+        if((used = dx_compact(disk, dir))) {
+            truncate_blocks(disk, dir, used);
+            dcache_flush(disk); // Entries moved, so what's cached is stale
+            dir_write_end(disk, dir);
+            return nblocks;
+        }
+        dir->i_flags &= ~EXT2_INDEX_FL;
+        mark_dirty(disk, dir, sizeof(struct ext2_inode));
+    }
+
+    // Copies every live entry out (index blocks hold none)
+    ents = malloc((nblocks * EXT2_BLOCK_SIZE / 12 + 1) * sizeof(*ents));
+    names = malloc(nblocks * EXT2_BLOCK_SIZE + 1);
+    buf = calloc(MAX(nblocks, 1), EXT2_BLOCK_SIZE);
+    exit_if(!ents || !names || !buf, ENOMEM);
+    block_iter_init(&it, disk, dir, 0, nblocks, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(is_meta)
+            continue;
+        holes |= !bnum;
+        for(offset = 0; bnum && offset < EXT2_BLOCK_SIZE; 
+            offset += d_entry->rec_len) {
+            d_entry = (struct ext2_dir_entry_2*)(bnum_to_block(bnum, disk)
+                                                 + offset);
+            if(!d_entry->rec_len)   // Corrupt block; don't spin on it
                 break;
-            }
-            t_size -= p_entry->rec_len;
-            p_entry = (struct ext2_dir_entry_2*)((char*)p_entry + 
-                p_entry->rec_len);
+            if(!d_entry->inode || !d_entry->name_len)
+                continue;
+            ents[n].inum = d_entry->inode;
+            ents[n].name_len = d_entry->name_len;
+            ents[n].file_type = d_entry->file_type;
+            ents[n].name = names + names_len;
+            memcpy(ents[n++].name, d_entry->name, d_entry->name_len);
+            names_len += d_entry->name_len;
         }
-    } // TODO STILL: what if the parent inode takes up multiple data blocks?
+    }
+    if(holes || !nblocks) {
+        dir_write_end(disk, dir);
+        free(ents);
+        free(names);
+        free(buf);
+        return nblocks;
+    }
 
-    // Reclaims excess space from p_entry for the new dir entry
-    i--; 
-    struct ext2_dir_entry_2 *new_d_entry;
-    if(p_inode->i_block[i]) { // New dir entry goes in parent dir's data block
+    if(sort)
+        qsort(ents, n, sizeof(*ents), cmp_compact_name);
+    used = pack_entries(buf, ents, n, nblocks);
+    if(!used) {     // Left as it was
+        dir_write_end(disk, dir);
+        free(ents);
+        free(names);
+        free(buf);
+        return nblocks;
+    }
 
-        new_d_entry = (struct ext2_dir_entry_2*)((char*)p_entry + p_size);
-        new_d_entry->rec_len = p_entry->rec_len - p_size;
-        p_entry->rec_len = p_size;
+    // Copies the packed blocks over the first 'used' of the directory's
+    block_iter_init(&it, disk, dir, 0, used, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(is_meta)
+            continue;
+        memcpy(bnum_to_block(bnum, disk), buf + lblk++ * EXT2_BLOCK_SIZE,
+               EXT2_BLOCK_SIZE);
+        mark_dirty(disk, bnum_to_block(bnum, disk), EXT2_BLOCK_SIZE);
     }
-    // If there is no space in any of the parent   
-    // directory's blocks, allocates a new block
-    else {
-        p_inode->i_block[i] = find_free_block_idx(disk);
-        add_block_to_bmap(p_inode->i_block[i], disk);
-        
-        new_d_entry = (struct ext2_dir_entry_2 *)(disk + 
-                                (p_inode->i_block[i] * EXT2_BLOCK_SIZE));
-        new_d_entry->rec_len = EXT2_BLOCK_SIZE;
-        p_inode->i_blocks += 2;
-        p_inode->i_size += EXT2_BLOCK_SIZE;
-    }   
+    truncate_blocks(disk, dir, used);
 
-    new_d_entry->file_type = type;
-    new_d_entry->inode = inode_to_add;
-    new_d_entry->name_len = strlen(t_name);
-    strncpy(new_d_entry->name, t_name, new_d_entry->name_len);
+    dcache_flush(disk); // Entries moved, so what's cached is stale
+    dir_write_end(disk, dir);
 
-    return new_d_entry;
+    free(ents);
+    free(names);
+    free(buf);
+    return nblocks;
 }
 
 
@@ -268,7 +2245,7 @@ struct ext2_dir_entry_2* add_dir_entr (unsigned char* disk,
  */
 char *get_pdir_name(char *dir_name) {
     
-    char *p_path = malloc(sizeof(char)*strlen(dir_name));
+    char *p_path = calloc(strlen(dir_name)+1, sizeof(char));
     strncpy(p_path, dir_name, strlen(dir_name));
     int i;
 
@@ -279,6 +2256,9 @@ char *get_pdir_name(char *dir_name) {
         }
 
     }
+    // A bare name (e.g. "..") has no parent part
+    if (i < 0)
+        p_path[0] = '\0';
     return p_path;
 }
 
@@ -286,7 +2266,25 @@ char *get_pdir_name(char *dir_name) {
  * of the path after the last "/".
  */
 char* pathname_final(char *path){
-    return &(path[strlen(get_pdir_name(path))]);
+    int i;
+
+    // Same split as get_pdir_name(), without copying the path
+    for (i = strlen(path)-2; i>=0 && path[i] != '/'; i--)
+        ;
+    return &(path[i+1]);
+}
+
+/* Returns a newly allocated "dir/name" for the 'len' bytes at 'name',
+ * not doubling up a trailing '/' on 'dir'
+ */
+char* join_path(const char* dir, const char* name, size_t len){
+    size_t d_len = strlen(dir);
+    char* path = malloc(d_len + len + 2);
+
+    exit_if(!path, ENOMEM);
+    sprintf(path, "%s%s%.*s", dir, (d_len && dir[d_len-1] == '/') ? "" : "/",
+            (int)len, name);
+    return path;
 }
 
 
@@ -294,95 +2292,173 @@ char* pathname_final(char *path){
 // INODE, DIRECTORY ENTRY, & DATA BLOCK LOOKUP
 /////////////////////////////////////////
 
+/* Returns the entry of the directory block 'block' named by the 'len' 
+ * bytes at 'name', or NULL if it has none */
+struct ext2_dir_entry_2* find_in_dir_block(unsigned char* block,
+                                           const char* name, unsigned int len) {
+    struct ext2_dir_entry_2 *d_entry;
+    unsigned int offset;
+
+    for(offset = 0; offset < EXT2_BLOCK_SIZE; offset += d_entry->rec_len) {
+        d_entry = (struct ext2_dir_entry_2 *)(block + offset);
+        if(!d_entry->rec_len)   // Corrupt block; don't spin on it
+            break;
+        if(d_entry->inode && d_entry->name_len == len && 
+            !memcmp(d_entry->name, name, len))
+            return d_entry;
+    }
+    return NULL;
+}
+
+// Searches directory 'dir' for the entry lookup_dir_entry() returns
+static struct ext2_dir_entry_2* search_dir (unsigned char* disk,
+                                            struct ext2_inode* dir,
+                                            const char* name, 
+                                            unsigned int len) {
+    struct block_iter it;
+    struct ext2_dir_entry_2 *d_entry = NULL;
+    unsigned int bnum;
+    int is_meta;
+
+    // Indexed directories only need the block(s) the name hashes to
+    if((dir->i_flags & EXT2_INDEX_FL) && 
+        dx_lookup(disk, dir, name, len, &d_entry))
+        return d_entry;
+
+    // Otherwise, looks through every data block in turn
+    block_iter_init(&it, disk, dir, 0, dir->i_size / EXT2_BLOCK_SIZE, 0);
+    while(block_iter_next(&it, &bnum, &is_meta) && !d_entry) {
+        if(!is_meta && bnum)
+            d_entry = find_in_dir_block(bnum_to_block(bnum, disk), 
+                                        name, len);
+    }
+    return d_entry;
+}
+
+/* Given a directory inode, returns its entry named by the 'len' bytes 
+ * at 'name' (which need not be NUL-terminated), or NULL if it has none. 
+ * Names are compared in place; nothing is allocated. The directory is
+ * read without its lock, and read again if its sequence count shows it
+ * changed meanwhile; after SEQ_RETRIES tries (or in the thread changing
+ * it) the lock is taken instead. The entry returned only stays put while
+ * the directory's lock is held. */
+struct ext2_dir_entry_2* lookup_dir_entry(unsigned char* disk, 
+                                          struct ext2_inode* dir,
+                                          const char* name, unsigned int len) {
+    struct ext2_fs* fs = get_fs(disk);
+    unsigned int* seq = &fs->dir_seq[inode_stripe(dir)];
+    struct ext2_dir_entry_2 *d_entry = NULL;
+    unsigned int seen, tries;
+
+    if(!(dir->i_mode & EXT2_S_IFDIR) || !len || len > MAX_STR_LEN)
+        return NULL;
+    if(dcache_lookup(fs, dir, name, len, &d_entry))
+        return d_entry;
+
+    for(tries = 0; ; tries++) {
+        if(tries == SEQ_RETRIES)
+            inode_lock(disk, dir);
+        seen = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if((seen & 1) && tries < SEQ_RETRIES)
+            continue;   // Being changed right now
+        d_entry = search_dir(disk, dir, name, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(tries == SEQ_RETRIES || 
+            __atomic_load_n(seq, __ATOMIC_RELAXED) == seen)
+            break;
+    }
+
+    // Not cached if this thread is partway through changing the directory
+    if(!(seen & 1))
+        dcache_insert(fs, dir, name, len, d_entry, seq, seen);
+    if(tries == SEQ_RETRIES)
+        inode_unlock(disk, dir);
+    return d_entry;
+}
+
 /* Given an absolute path 'dir_name', 
  * returns the corresponding directory entry */
 struct ext2_dir_entry_2* find_dir_entry(char* dir_name, unsigned char* disk) {
 
-    char *spl="/";
+    // The inode and directory entry currently being looked at 
+    struct ext2_inode *cur_inode = inum_to_inode(EXT2_ROOT_INO, disk); // @ root
+    struct ext2_dir_entry_2 *d_entry = NULL; 
 
-    struct ext2_inode* i_tbl = (struct ext2_inode*) get_itbl(disk);
+    // The path component being resolved: 'len' bytes at 'comp'
+    const char *comp = dir_name;
+    unsigned int len;
 
-    char *p_path = malloc(sizeof(char)*(strlen(dir_name)+1));
-    strncpy(p_path, dir_name, strlen(dir_name));
+    for(;;) {
+        while(*comp == '/')     // Skips (repeated) separators
+            comp++;
+        if(!*comp)
+            break;
+        len = strcspn(comp, "/");
 
-    // The inode and directory entry currently being looked at 
-    struct ext2_inode *cur_inode = &(i_tbl[EXT2_ROOT_INO-1]); // starts @ root
-    struct ext2_dir_entry_2 *d_entry; 
-
-    char *spl_path = strtok(p_path, spl); // splits the path string by '/'
-    unsigned int b_num=0;   // loop counter traversing each inode's pointers
-    int offset=0;   // offset into data block, for when we traverse dir entries
-
-    // For each DIRECTORY inode, looks at each inode it points to
-    while (spl_path != NULL && b_num < EXT2_INODE_PTR_LEN && 
-        (cur_inode->i_mode & EXT2_S_IFDIR) && cur_inode->i_block[b_num]) {  
-
-        d_entry = (struct ext2_dir_entry_2 *)(disk+
-            (cur_inode->i_block[b_num]*EXT2_BLOCK_SIZE));
-        offset=0;
-
-        // In the current data block, looks for 
-        // a directory entry that matches in name
-        while (offset < EXT2_BLOCK_SIZE) {
-            if(!strncmp(spl_path, extract_name(d_entry), MAX_STR_LEN)) {
-                cur_inode = &(i_tbl[d_entry->inode - 1]);
-                b_num=0;
-                spl_path = strtok(NULL, spl);
-                offset=0;
-                break;
-            }
-            offset += d_entry->rec_len;
-            d_entry = (struct ext2_dir_entry_2 *)((char *)d_entry+
-                d_entry->rec_len);
-        }
-        // The directory entry was not found, so increment b_num
-        if(offset >= EXT2_BLOCK_SIZE)
-            b_num++;
+        d_entry = lookup_dir_entry(disk, cur_inode, comp, len);
+        if(!d_entry)
+            return NULL;
+        cur_inode = inum_to_inode(d_entry->inode, disk);
+        comp += len;
     }
-    // Directory entry was found
-    if(!spl_path)
-       return d_entry;
 
-    return NULL;
+    // Directory entry was found (NULL if the path named no entry at all)
+    return d_entry;
 }
 
 /* Given an inode number, returns a pointer to the corresponding inode struct */
 struct ext2_inode* inum_to_inode(unsigned int inum, unsigned char* disk) {
    
-    assert(inum<=EXT2_NUM_INODES);
+    struct ext2_super_block* sb = get_sb(disk);
+    assert(inum && inum<=sb->s_inodes_count);
 
-    struct ext2_inode* i_tbl = (struct ext2_inode*) get_itbl(disk);
-    return &(i_tbl[inum - 1]);
+    // Inodes may be larger on disk than 'struct ext2_inode'
+    unsigned int idx = (inum - 1) % sb->s_inodes_per_group;
+    return (struct ext2_inode*)(get_itbl(disk, inum_to_group(inum, disk)) + 
+                                (size_t)idx * EXT2_INODE_SIZE(sb));
 }
 
-/* Given an absolute path 'dir_name', returns the corresponding inode */
-struct ext2_inode* find_inode(char* dir_name, unsigned char* disk) {
+/* Given an absolute path 'dir_name', returns the corresponding 
+ * inode number, or 0 if there is no such file */
+unsigned int find_inum(char* dir_name, unsigned char* disk) {
 
     // Root inode case
     if (!strncmp(dir_name,"/",strlen(dir_name)))
-        return inum_to_inode(EXT2_ROOT_INO, disk);
+        return EXT2_ROOT_INO;
 
     struct ext2_dir_entry_2 *d_entry = find_dir_entry(dir_name,disk);
 
     if(!d_entry)
+        return 0;
+
+    return d_entry->inode;
+}
+
+/* Given an absolute path 'dir_name', returns the corresponding inode */
+struct ext2_inode* find_inode(char* dir_name, unsigned char* disk) {
+
+    unsigned int inum = find_inum(dir_name, disk);
+
+    if(!inum)
         return NULL;
 
-    return inum_to_inode(d_entry->inode, disk);
+    return inum_to_inode(inum, disk);
 }
 
-/* Given a directory entry 'd_entry', returns a
- * correct end-truncated name (based on the name_len field)
+/* Given a directory entry 'd_entry', returns a newly allocated, 
+ * NUL-terminated copy of its name (based on the name_len field)
  */
 char* extract_name(struct ext2_dir_entry_2* d_entry){
     int name_len = d_entry->name_len;
-    char *fname = malloc(name_len*(sizeof(char)));
+    char *fname = malloc((name_len+1)*(sizeof(char)));
     strncpy(fname, d_entry->name, name_len);
+    fname[name_len] = '\0';
     return fname;
 }
 
 /* Given an block number, returns a pointer to the the block */
 unsigned char* bnum_to_block(unsigned int bnum, unsigned char *disk) {
-    assert(bnum<=EXT2_BLOCKS_PER_BG);
+    assert(bnum<get_sb(disk)->s_blocks_count);
     return disk + bnum * EXT2_BLOCK_SIZE;
 }
 
@@ -390,133 +2466,347 @@ unsigned char* bnum_to_block(unsigned int bnum, unsigned char *disk) {
 // BITMAP SEARCHING & MANIPULATION
 /////////////////////////////////////////
 
-// Returns the index of the lowest-numbered free inode available
-unsigned int find_free_inode_idx(unsigned char *disk) {
-    int i = 1;
-    int j = (EXT2_GOOD_OLD_FIRST_INO-1)%8;
-    
+/* Loads the 64 bitmap bits starting at bit 'w * 64' as a word whose bit k is 
+ * bitmap bit w*64+k. Bytes past the end of an 'nbits'-bit map read as 0. */
+static inline uint64_t bitmap_word(const unsigned char *bmap, 
+                                   unsigned int w, unsigned int nbits) {
+    uint64_t word = 0;
+    unsigned int nbytes = (nbits + 7) / 8;
+    unsigned int off = w * 8;
+
+    memcpy(&word, bmap + off, (nbytes - off < 8) ? nbytes - off : 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/* Returns the lowest clear bit at or after bit 'start' of the 
+ * 'nbits'-bit bitmap 'bmap', or 'nbits' if every such bit is set. 
+ * Scans a 64-bit word at a time, skipping full words outright. */
+unsigned int bitmap_find_zero(const unsigned char *bmap, 
+                              unsigned int start, unsigned int nbits) {
+    unsigned int w = start / 64;
+    uint64_t free_bits;
+
+    if(start >= nbits)
+        return nbits;
+
+    // Ignores the bits below 'start' in its word
+    free_bits = ~bitmap_word(bmap, w, nbits) & (~0ULL << (start % 64));
+    while(!free_bits) {
+        if(++w * 64 >= nbits)
+            return nbits;
+        free_bits = ~bitmap_word(bmap, w, nbits);
+    }
+
+    start = w * 64 + __builtin_ctzll(free_bits);
+    return (start < nbits) ? start : nbits;
+}
+
+/* Returns the lowest set bit at or after bit 'start' of the 
+ * 'nbits'-bit bitmap 'bmap', or 'nbits' if every such bit is clear. */
+unsigned int bitmap_find_set(const unsigned char *bmap, 
+                             unsigned int start, unsigned int nbits) {
+    unsigned int w = start / 64;
+    uint64_t used_bits;
+
+    if(start >= nbits)
+        return nbits;
+
+    used_bits = bitmap_word(bmap, w, nbits) & (~0ULL << (start % 64));
+    while(!used_bits) {
+        if(++w * 64 >= nbits)
+            return nbits;
+        used_bits = bitmap_word(bmap, w, nbits);
+    }
+
+    start = w * 64 + __builtin_ctzll(used_bits);
+    return (start < nbits) ? start : nbits;
+}
+
+/* Finds the first run of clear bits at or after bit 'start' of the 
+ * 'nbits'-bit bitmap 'bmap'. Stores the run's length, capped at 
+ * 'max_len', in '*run_len' and returns its first bit ('nbits' if the 
+ * map has no clear bits past 'start'). */
+unsigned int bitmap_find_zero_run(const unsigned char *bmap, 
+                                  unsigned int start, unsigned int nbits,
+                                  unsigned int max_len, 
+                                  unsigned int *run_len) {
+    unsigned int end;
+
+    start = bitmap_find_zero(bmap, start, nbits);
+    if(start >= nbits) {
+        *run_len = 0;
+        return nbits;
+    }
+
+    // Stops looking for the run's end once it is long enough
+    end = (nbits - start > max_len) ? start + max_len : nbits;
+    *run_len = bitmap_find_set(bmap, start, end) - start;
+    return start;
+}
+
+/* Returns how many of the first 'nbits' bits of 'bmap' are set */
+unsigned int bitmap_count_set(const unsigned char *bmap, unsigned int nbits) {
+    unsigned int w, count = 0;
+    uint64_t word;
+
+    for(w = 0; w * 64 < nbits; w++) {
+        word = bitmap_word(bmap, w, nbits);
+        if(nbits - w * 64 < 64) // Masks off the tail of the last word
+            word &= (1ULL << (nbits - w * 64)) - 1;
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+/* Sets / clears the 'len' bits of 'bmap' starting at bit 'start', 
+ * whole bytes at a time where possible. */
+void bitmap_set_range(unsigned char *bmap, unsigned int start, 
+                      unsigned int len) {
+    for(; len && start % 8; start++, len--)
+        bmap[start / 8] |= 1 << (start % 8);
+    memset(bmap + start / 8, 0xff, len / 8);
+    for(start += len & ~7u, len %= 8; len; start++, len--)
+        bmap[start / 8] |= 1 << (start % 8);
+}
+void bitmap_clear_range(unsigned char *bmap, unsigned int start, 
+                        unsigned int len) {
+    for(; len && start % 8; start++, len--)
+        bmap[start / 8] &= ~(1 << (start % 8));
+    memset(bmap + start / 8, 0, len / 8);
+    for(start += len & ~7u, len %= 8; len; start++, len--)
+        bmap[start / 8] &= ~(1 << (start % 8));
+}
+
+/* Picks the group a new inode should live in. Regular files go in their
+ * parent directory's group (falling back to a quadratic probe, then a
+ * linear scan); directories are spread Orlov-style into a group with
+ * an above-average share of free inodes and the most free blocks. */
+static unsigned int find_inode_group(unsigned char *disk, 
+                                     unsigned int p_inum, int is_dir) {
     struct ext2_super_block* sb = get_sb(disk);
     struct ext2_group_desc* gd = get_gd(disk);
-    int max_pos_inodes = sb->s_inodes_count / 8;
- 
-    if(sb->s_free_inodes_count) {
-        char *bmap = (char *)(disk + (gd->bg_inode_bitmap*EXT2_BLOCK_SIZE));
-        
-        while (i < max_pos_inodes) {
-            while(j < 8) {
-                if((int)((bmap[i] >> j)&1)==0) {
-                    break;
-                } 
-                j++;
-            } 
-            if (j < 8) {
-                break;
-            }
-            
-            j = 0;
-            i++;
+    unsigned int ngroups = get_groups_count(disk);
+    unsigned int p_group = inum_to_group(p_inum, disk);
+    unsigned int g, i, best = ngroups;
+
+    if(is_dir) {
+        unsigned int avg_free_inodes = sb->s_free_inodes_count / ngroups;
+        for(i = 0; i < ngroups; i++) {
+            g = (p_group + i) % ngroups;
+            if(!gd[g].bg_free_inodes_count || 
+                gd[g].bg_free_inodes_count < avg_free_inodes)
+                continue;
+            if(best == ngroups || 
+                gd[g].bg_free_blocks_count > gd[best].bg_free_blocks_count)
+                best = g;
         }
-        return (i*8)+j+1;   
+        if(best != ngroups)
+            return best;
     }
 
-    return 0;
+    // Tries the parent's group first...
+    if(gd[p_group].bg_free_inodes_count && gd[p_group].bg_free_blocks_count)
+        return p_group;
+
+    // ...then hops through the groups quadratically...
+    for(i = 1, g = p_group; i < ngroups; i <<= 1) {
+        g = (g + i) % ngroups;
+        if(gd[g].bg_free_inodes_count && gd[g].bg_free_blocks_count)
+            return g;
+    }
+
+    // ...and finally settles for any group with a free inode
+    for(i = 0; i < ngroups; i++) {
+        g = (p_group + i) % ngroups;
+        if(gd[g].bg_free_inodes_count)
+            return g;
+    }
+    return p_group;
 }
 
-// Returns the index of the lowest-numbered data block available
-unsigned int find_free_block_idx(unsigned char *disk) {
-    int i = 0;
-    int j = 0;
-    
+/* Returns the number of a free inode for a new file in directory 
+ * 'p_inum', or 0 if there are no free inodes left. */
+unsigned int find_free_inode_idx(unsigned char *disk, 
+                                 unsigned int p_inum, int is_dir) {
     struct ext2_super_block* sb = get_sb(disk);
-    struct ext2_group_desc *gd = get_gd(disk);
-    char *bitmap = (char *)(disk + (gd->bg_block_bitmap * EXT2_BLOCK_SIZE));
-    int max_pos_blocks = sb->s_blocks_count / 8;
-    
-    if(sb->s_free_blocks_count) {
-        while (i < max_pos_blocks) {
-            while(j < 8){
-                if((int)((bitmap[i] >> j)&1) == 0){
-                    break;
-                }
-                j++;
-            }
-            if (j < 8)
-                break;
-
-            j = 0;
-            i++;
-        }
+    struct ext2_group_desc* gd = get_gd(disk);
+    unsigned int ngroups = get_groups_count(disk);
+    unsigned int ipg = sb->s_inodes_per_group;
+    unsigned int first_ino = (sb->s_rev_level == EXT2_GOOD_OLD_REV) ?
+                                EXT2_GOOD_OLD_FIRST_INO : sb->s_first_ino;
+    unsigned int g0, g, i, start, bit;
+ 
+    if(!sb->s_free_inodes_count)
+        return 0;
+
+    g0 = find_inode_group(disk, p_inum, is_dir);
+    for(i = 0; i < ngroups; i++) {
+        g = (g0 + i) % ngroups;
+        if(!gd[g].bg_free_inodes_count)
+            continue;
+
+        // Skips over the reserved inodes at the front of the table
+        start = (g * ipg + 1 < first_ino) ? first_ino - 1 - g * ipg : 0;
+        bit = bitmap_find_zero(bnum_to_block(gd[g].bg_inode_bitmap, disk), 
+                            start, ipg);
+        if(bit < ipg)
+            return g * ipg + bit + 1;
+    }
+    return 0;
+}
 
-        return (i*8)+j+1;
+/* Returns the number of a free data block, searching forward from 
+ * block 'goal' (wrapping around), or 0 if there are none left. Parts
+ * of the bitmap the free-space summary knows to be full are skipped. */
+unsigned int find_free_block_idx(unsigned char *disk, unsigned int goal) {
+    struct ext2_fs* fs = get_fs(disk);
+    struct ext2_super_block* sb = get_sb(disk);
+    struct ext2_group_desc* gd = get_gd(disk);
+    unsigned int ngroups = get_groups_count(disk);
+    unsigned int bpg = sb->s_blocks_per_group;
+    unsigned int g0, g, i, start, nbits, bit;
+
+    if(!sb->s_free_blocks_count)
+        return 0;
+
+    if(goal < sb->s_first_data_block || goal >= sb->s_blocks_count)
+        goal = sb->s_first_data_block;
+    g0 = bnum_to_group(goal, disk);
+
+    // The goal's group is visited twice: from the goal, then from its start
+    for(i = 0; i <= ngroups; i++) {
+        g = (g0 + i) % ngroups;
+        if(!gd[g].bg_free_blocks_count)
+            continue;
+
+        start = (i == 0) ? (goal - sb->s_first_data_block) % bpg : 0;
+        nbits = group_blocks_count(g, disk);
+        pthread_mutex_lock(&fs->group_locks[g]);
+        if(fs->summary)
+            bit = span_find_zero(disk, g, 1, 0, start);
+        else
+            bit = bitmap_find_zero(group_bmap(disk, g), start, nbits);
+        pthread_mutex_unlock(&fs->group_locks[g]);
+        if(bit < nbits)
+            return g * bpg + bit + sb->s_first_data_block;
     }
     return 0;
 }
 
 
-// Updates inode bitmap upon the allocation of a new inode
-void add_inode_to_imap(unsigned int i_num, unsigned char *disk) {
+/* Updates inode bitmap upon the allocation of a new inode (counting it
+ * as a directory if 'is_dir' is set). Returns 0, changing nothing, if 
+ * the inode was taken in the meantime. */
+int add_inode_to_imap(unsigned int i_num, unsigned char *disk, int is_dir) {
 
     struct ext2_super_block* sb = get_sb(disk);
-    struct ext2_group_desc *gd = get_gd(disk);
-
-    // decrease free inode count
-    sb->s_free_inodes_count--;
+    unsigned int g = inum_to_group(i_num, disk);
+    struct ext2_group_desc *gd = get_gd(disk) + g;
+    pthread_mutex_t* lock = &get_fs(disk)->group_locks[g];
 
     // get inode bitmap ptr and update
-    char *bmap = (char *)(disk + (gd->bg_inode_bitmap * EXT2_BLOCK_SIZE));
-    char bt = bmap[(i_num-1)/8];
-    int place = (i_num-1)%8;
+    char *bmap = (char *)(bnum_to_block(gd->bg_inode_bitmap, disk));
+    i_num = (i_num-1) % sb->s_inodes_per_group;
+    int place = i_num%8;
+
+    pthread_mutex_lock(lock);
+    char bt = bmap[i_num/8];
+    if(bt & (1<<place)) {
+        pthread_mutex_unlock(lock);
+        return 0;
+    }
+    bmap[i_num/8] = bt | (1<<place);
 
-    bmap[(i_num-1)/8] = bt | (1<<place);
+    // decrease free inode count
+    __atomic_sub_fetch(&sb->s_free_inodes_count, 1, __ATOMIC_RELAXED);
+    gd->bg_free_inodes_count--;
+    if(is_dir)
+        gd->bg_used_dirs_count++;
+    pthread_mutex_unlock(lock);
+
+    mark_dirty(disk, &bmap[i_num/8], 1);
+    mark_dirty(disk, sb, sizeof(struct ext2_super_block));
+    mark_dirty(disk, gd, sizeof(struct ext2_group_desc));
+    return 1;
 }
 
 // Updates inode bitmap upon the deallocation of an inode
 void rem_inode_from_imap(unsigned int i_num, unsigned char *disk) {
 
     struct ext2_super_block* sb = get_sb(disk);
-    struct ext2_group_desc *gd = get_gd(disk);
-
-    sb->s_free_inodes_count++;
+    unsigned int g = inum_to_group(i_num, disk);
+    struct ext2_group_desc *gd = get_gd(disk) + g;
+    pthread_mutex_t* lock = &get_fs(disk)->group_locks[g];
 
     // get inode bitmap ptr and update
-    char *bmap = (char *)(disk + (gd->bg_inode_bitmap * EXT2_BLOCK_SIZE));
-    char bt = bmap[(i_num-1)/8];
-    int place = (i_num-1)%8;
-
-    bmap[(i_num-1)/8] = bt & ~(1 << place);
+    char *bmap = (char *)(bnum_to_block(gd->bg_inode_bitmap, disk));
+    i_num = (i_num-1) % sb->s_inodes_per_group;
+    int place = i_num%8;
+
+    pthread_mutex_lock(lock);
+    __atomic_add_fetch(&sb->s_free_inodes_count, 1, __ATOMIC_RELAXED);
+    gd->bg_free_inodes_count++;
+    bmap[i_num/8] &= ~(1 << place);
+    pthread_mutex_unlock(lock);
+
+    mark_dirty(disk, &bmap[i_num/8], 1);
+    mark_dirty(disk, sb, sizeof(struct ext2_super_block));
+    mark_dirty(disk, gd, sizeof(struct ext2_group_desc));
 }
-
 // Updates data block bitmap upon the allocation of a new data block
 void add_block_to_bmap(unsigned int b_num, unsigned char *disk) {
  
     struct ext2_super_block* sb = get_sb(disk);
-    struct ext2_group_desc *gd = get_gd(disk);
+    unsigned int g = bnum_to_group(b_num, disk);
+    struct ext2_group_desc *gd = get_gd(disk) + g;
+    pthread_mutex_t* lock = &get_fs(disk)->group_locks[g];
     
     // decrease free block count
-    sb->s_free_blocks_count--;
+    pthread_mutex_lock(lock);
+    __atomic_sub_fetch(&sb->s_free_blocks_count, 1, __ATOMIC_RELAXED);
+    gd->bg_free_blocks_count--;
 
     // get block bitmap ptr and update
-    char *bitmap = (char *)(disk + (gd->bg_block_bitmap * EXT2_BLOCK_SIZE));
-    char bt = bitmap[(b_num-1)/8];
-    int place = (b_num-1)%8;
-
-    bitmap[(b_num-1)/8] = bt | (1<<place);
+    char *bitmap = (char *)(bnum_to_block(gd->bg_block_bitmap, disk));
+    b_num = (b_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+    char bt = bitmap[b_num/8];
+    int place = b_num%8;
+
+    bitmap[b_num/8] = bt | (1<<place);
+    summary_update(disk, g, b_num, 1);
+    pthread_mutex_unlock(lock);
+    mark_dirty(disk, &bitmap[b_num/8], 1);
+    mark_dirty(disk, sb, sizeof(struct ext2_super_block));
+    mark_dirty(disk, gd, sizeof(struct ext2_group_desc));
 }
 
 // Updates data block bitmap upon the deallocation of a new data block
 void rem_block_from_bmap(unsigned int b_num, unsigned char *disk) {
  
     struct ext2_super_block* sb = get_sb(disk);
-    struct ext2_group_desc *gd = get_gd(disk);
+    unsigned int g = bnum_to_group(b_num, disk);
+    struct ext2_group_desc *gd = get_gd(disk) + g;
+    pthread_mutex_t* lock = &get_fs(disk)->group_locks[g];
     
-    sb->s_free_blocks_count++;
+    pthread_mutex_lock(lock);
+    __atomic_add_fetch(&sb->s_free_blocks_count, 1, __ATOMIC_RELAXED);
+    gd->bg_free_blocks_count++;
 
     // get block bitmap ptr and update
-    char *bitmap = (char *)(disk + (gd->bg_block_bitmap * EXT2_BLOCK_SIZE));
-    char bt = bitmap[(b_num-1)/8];
-    int place = (b_num-1)%8;
-
-    bitmap[(b_num-1)/8] = bt & ~(1 << place);
+    char *bitmap = (char *)(bnum_to_block(gd->bg_block_bitmap, disk));
+    b_num = (b_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+    char bt = bitmap[b_num/8];
+    int place = b_num%8;
+
+    bitmap[b_num/8] = bt & ~(1 << place);
+    summary_update(disk, g, b_num, 1);
+    pthread_mutex_unlock(lock);
+    mark_dirty(disk, &bitmap[b_num/8], 1);
+    mark_dirty(disk, sb, sizeof(struct ext2_super_block));
+    mark_dirty(disk, gd, sizeof(struct ext2_group_desc));
 }
 
 
@@ -1,53 +1,251 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "ext2.h"
+#include "ext2_blockio.h"
 
 #define MAX_STR_LEN	255
 
+// Blocks set aside for a directory each time it grows
+#define PREALLOC_BLOCKS	8
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+
+/////////////////////////////////////////
+// OPENING & CLOSING THE DISK IMAGE
+/////////////////////////////////////////
+
+/* Opens the image file 'path' with the given open(2) flags, maps the
+ * whole file, and reads the filesystem geometry from its superblock.
+ * Returns a pointer to the start of the mapping, which is the handle the
+ * functions below take for the image: several images (of one block size)
+ * may be open at once, and each keeps its own dirty blocks, journal, 
+ * allocator state and locks.
+ *
+ * The functions below may be called from several threads at once. Block
+ * and inode allocation lock only the group they work in; directories are
+ * changed under their inode's lock (see inode_lock()), and looked up 
+ * without it, which relies on their blocks never being freed. So 
+ * compact_dir(), which frees them, must not run alongside lookups, and
+ * flush_image() and close_image() must not run alongside anything else 
+ * on the same image.
+ */
+unsigned char* open_image (char* path, int flags);
+
+/* Records that the 'len' bytes at 'ptr' (inside the mapping) have been
+ * changed, so the blocks holding them get written out on the next flush.
+ * Every helper below marks what it changes; callers that modify inodes 
+ * or directory entries directly must mark those themselves. Safe to 
+ * call from several threads at once. */
+void mark_dirty (unsigned char* disk, void* ptr, size_t len);
+
+/* Writes back only the blocks marked dirty since the last flush, 
+ * one msync() per contiguous run of them. */
+void flush_image (unsigned char* disk);
+
+/* Flushes every change made through the mapping back 
+ * to the image file, then unmaps and closes it. */
+void close_image (unsigned char* disk);
+
+/* Takes / drops the lock on 'inode'. Whoever changes an inode (its size,
+ * link count or block map) or a directory's entries must hold it; the
+ * directory helpers below take it themselves, and the thread holding it
+ * may take it again. Locks are shared by inodes that hash alike, so a 
+ * thread should hold at most one inode's lock at a time. */
+void inode_lock (unsigned char* disk, struct ext2_inode* inode);
+void inode_unlock (unsigned char* disk, struct ext2_inode* inode);
+
 // Returns a pointer to the superblock
 struct ext2_super_block* get_sb (unsigned char* disk); 
 
-// Returns a pointer to the group descriptor block
+// Returns a pointer to the group descriptor table (indexed by group number)
 struct ext2_group_desc* get_gd (unsigned char* disk);
 
-// Returns a pointer to the start of the itable
-unsigned char* get_itbl (unsigned char* disk);
+// Returns a pointer to the start of the given group's itable
+unsigned char* get_itbl (unsigned char* disk, unsigned int group);
+
+// Returns the number of block groups on the disk
+unsigned int get_groups_count (unsigned char* disk);
+
+// Returns the number of blocks in the given group (the last may be short)
+unsigned int group_blocks_count (unsigned int group, unsigned char* disk);
+
+// Returns the group holding the given inode / block
+unsigned int inum_to_group (unsigned int inum, unsigned char* disk);
+unsigned int bnum_to_group (unsigned int bnum, unsigned char* disk);
+
+// Returns an inode's full size (i_dir_acl holds the high half for files)
+unsigned long get_inode_size (struct ext2_inode* inode);
+
+// Sets an inode's full size, flagging the disk as holding large files
+void set_inode_size (unsigned char* disk, struct ext2_inode* inode, 
+                     unsigned long size);
+
+/////////////////////////////////////////
+// LOGICAL -> PHYSICAL BLOCK MAPPING
+/////////////////////////////////////////
+
+/* Walks an inode's logical blocks through its direct, single, double and
+ * triple indirect pointers. Only the current path down the block map is
+ * looked at, so memory use does not grow with the file. */
+struct block_iter {
+    unsigned char* disk;
+    struct ext2_inode* inode;
+    unsigned long lblk;         // Next logical block to visit
+    unsigned long end;          // Logical block the walk stops at
+    int level;                  // Levels of lblk's path already reported
+    int alloc;                  // Whether to fill 0 pointers with new blocks
+    unsigned int goal;          // Where the next allocation run should start
+    unsigned int run_start;     // Reserved blocks not yet handed out
+    unsigned int run_len;
+    unsigned int to_alloc;      // Blocks the walk still expects to allocate
+};
+
+// Returns how many data blocks the direct & indirect pointers can map
+unsigned long max_file_blocks (void);
+
+/* Returns whether 'inode' keeps block pointers in i_block: not a fast
+ * symlink (its target is stored there) or a device, FIFO or socket */
+int has_blocks (struct ext2_inode* inode);
+
+/* Sets up 'it' to walk logical blocks [start, end) of 'inode'. With
+ * 'alloc' set, 0 pointers met on the way (data or indirect) are filled 
+ * with newly reserved blocks, taken as runs starting near 'it->goal'.
+ * Without it, an inode with no block pointers (see has_blocks()) has
+ * nothing to walk. */
+void block_iter_init (struct block_iter* it, unsigned char* disk,
+                      struct ext2_inode* inode, unsigned long start,
+                      unsigned long end, int alloc);
+
+/* Advances 'it' to the next block of the file in on-disk order: each 
+ * indirect block is reported (with '*is_meta' set) just before the first
+ * data block it maps. Stores the physical block in '*bnum' (0 for a 
+ * hole) and returns 1, or returns 0 once the walk is over. */
+int block_iter_next (struct block_iter* it, unsigned int* bnum, 
+                     int* is_meta);
+
+// Returns any blocks the iterator reserved but never handed out
+void block_iter_done (struct block_iter* it);
+
+/* Hands 'it' the blocks set aside for its inode by an earlier walk (if
+ * any), and has the next run it reserves be 'extra' blocks longer. Used
+ * with block_iter_keep() by inodes that grow a block at a time. */
+void block_iter_prealloc (struct block_iter* it, unsigned int extra);
+
+/* Like block_iter_done(), but sets the blocks 'it' reserved and never 
+ * handed out aside for its inode's next walk (a preallocation window) */
+void block_iter_keep (struct block_iter* it);
+
+/* Releases the blocks set aside for 'inode' (for every inode if NULL).
+ * flush_image() releases them all, so they never reach the disk. */
+void prealloc_release (unsigned char* disk, struct ext2_inode* inode);
+
+/* Returns the block holding logical block 'lblk' of 'inode', 
+ * or 0 if that block is a hole */
+unsigned int lblk_to_bnum (unsigned char* disk, struct ext2_inode* inode,
+                           unsigned long lblk);
+
+/////////////////////////////////////////
+// BRINGING BLOCKS IN AHEAD OF READS
+/////////////////////////////////////////
+
+/* Switches the image at 'disk' to the block I/O backend called 'name'
+ * ("io_uring" or "mmap"; see ext2_blockio.h). open_image() picks
+ * io_uring where the kernel has it. Call it before other threads use the
+ * image. Returns 0, or -1 (keeping the backend it had) if there's no such
+ * backend or it can't be set up here. */
+int set_block_io (unsigned char* disk, const char* name);
+
+// Returns the name of the block I/O backend the image at 'disk' uses
+const char* get_block_io (unsigned char* disk);
+
+// Brings the 'n' runs of blocks at 'runs' into memory (only a hint)
+void fetch_blocks (unsigned char* disk, const struct block_run* runs,
+                   unsigned int n);
+
+/* Brings in the blocks of directory 'dir', then (with 'inodes' set) the
+ * inode table blocks of the inodes its entries name. The caller holds
+ * the directory's lock. */
+void fetch_dir (unsigned char* disk, struct ext2_inode* dir, int inodes);
 
 /////////////////////////////////////////
 // FUNCTIONS FOR ALLOCATING NEW INODES & 
 // DIRECORY ENTRIES, AND WRITING DATA BLOCKS
 /////////////////////////////////////////
 
-/* Given a file size value, returns how many blocks 
- * will be needed to store a file of that size. */
+/* Given a file size value, returns how many blocks (data blocks plus
+ * the indirect blocks mapping them) a file of that size will need. */
 unsigned int calc_blocks_needed(long int f_size);
 
-/* Allocates & reserves a new inode and associated data block.
+/* Allocates & reserves a new inode and associated data blocks for a file 
+ * in directory 'p_inum', keeping both in (or near) the parent's group.
+ * Unless 'native_fd' is -1, only the parts that native file holds data 
+ * for get blocks; its holes are left as holes.
  * Marks both as used in the imap & bmap. 
  * Returns the new inode's number. 
  */
-unsigned int alloc_file (unsigned char* disk, 
-						long int f_size, unsigned short i_mode);
+unsigned int alloc_file (unsigned char* disk, long int f_size, 
+						unsigned short i_mode, unsigned int p_inum,
+						int native_fd);
 
-/* Given an inode, allocates a single indirect block with 
- * 'ptrs_needed' indirect pointers. */
-void alloc_indir_block (unsigned char* disk, struct ext2_inode* n_inode,
-                        unsigned int ptrs_needed);
+/* Reserves a run of up to 'count' contiguous free blocks, preferring to
+ * extend from block 'goal', else the longest run in the nearest group with
+ * free blocks. Bitmap bits and free counters are updated once per run,
+ * under the lock of just the group the run is in. Stores the run's first
+ * block in '*first' and returns its length (0 if the disk is full). */
+unsigned int alloc_block_run (unsigned char* disk, unsigned int goal,
+                              unsigned int count, unsigned int* first);
+
+/* Releases the 'count' blocks starting at 'first' (all in one group),
+ * updating the bitmap and free counters once. */
+void free_block_run (unsigned char* disk, unsigned int first, 
+                     unsigned int count);
 
 /* Given an target inode and a file descriptor corresponding 
  * to a file on the native file system, writes the contents 
- * of that file into the inode's data blocks.
+ * of that file into the inode's data blocks, copying each
+ * physically contiguous run of blocks in one go. Blocks that
+ * hold only zeros are released and left as holes. Allocates 
+ * nothing, so it can run for several inodes at once.
  */
 void write_file(unsigned char* disk, 
 				struct ext2_inode* n_inode, 
-				long int f_size, FILE* native_fd);
+				long int f_size, int native_fd);
+
+/* Given an inode and a file descriptor on the native file system,
+ * writes 'len' bytes of the inode's contents, starting 'off' bytes in,
+ * to the descriptor (stopping at the end of the file). Physically 
+ * contiguous blocks are written out in one piece, a few MiB at a time,
+ * each batch fetched by the image's block I/O backend first. Returns 0,
+ * or the errno value of a failed write.
+ */
+int read_file (unsigned char* disk, struct ext2_inode* inode,
+               unsigned long off, unsigned long len, int out_fd);
 
 /* Given the length of a dir entry's name, returns how much space
  * the dir entry will need in total. */
 unsigned int calc_d_entr_size (unsigned int name_len);
 
+/* Appends a new, empty block (one unused entry spanning it) to the end of
+ * directory 'dir'. Stores its logical block in '*lblk' (unless NULL) and 
+ * returns its block number. */
+unsigned int dir_append_block (unsigned char* disk, struct ext2_inode* dir,
+                               unsigned int* lblk);
+
+/* Adds an entry for inode 'inum' named by the 'len' bytes at 'name' to 
+ * the directory block 'block'. Returns the new entry, or NULL if the
+ * block has no room for it. */
+struct ext2_dir_entry_2* add_entr_to_block (unsigned char* disk, 
+                                            unsigned char* block,
+                                            unsigned int inum, 
+                                            const char* name, 
+                                            unsigned int len,
+                                            unsigned char type);
+
 /* Given the inode of a (parent) directory, 
  * adds a new directory entry in its data block.
+ * Hashed (htree) directories are kept indexed, and one-block directories
+ * that fill up are given an index when the disk supports them.
  * Returns a pointer to the directory entry just created.
  */
 struct ext2_dir_entry_2* add_dir_entr(unsigned char* disk,
@@ -55,11 +253,41 @@ struct ext2_dir_entry_2* add_dir_entr(unsigned char* disk,
                                     unsigned int inode_to_add,
                                     char* name, unsigned char type);
 
+/* Given the inode of a (parent) directory, removes its entry for the
+ * final part of 'name'. Returns the inode number the entry held, 
+ * or 0 if there was none.
+ */
+unsigned int rem_dir_entr(unsigned char* disk, struct ext2_inode* p_inode,
+                          char* name);
+
+/* Repacks the live entries of directory 'dir' into as few blocks as will
+ * hold them, in the order they were found (or with 'sort' set, "." and 
+ * ".." then by name), and frees the blocks left empty at the end, 
+ * updating i_size and i_blocks. An indexed directory has its index 
+ * rebuilt instead of being sorted. Returns how many blocks the directory
+ * held before; a directory with holes, or whose entries sorted by name
+ * wouldn't fit in the blocks it has, is left alone. Must not run while
+ * other threads look names up (see open_image()). */
+unsigned long compact_dir (unsigned char* disk, struct ext2_inode* dir,
+                           int sort);
+
 /* De-allocates & frees the given inode and all associated data blocks.
  * Frees corresponding bits in the imap & bmap. 
  */
 void dealloc_file(unsigned char* disk, struct ext2_inode* inode);
 
+/* Returns how many extents 'inode's data is in: runs of blocks contiguous
+ * on disk, in file order. Holes don't break a run, and an indirect block
+ * sitting right where one goes on doesn't either. */
+unsigned int count_extents (unsigned char* disk, struct ext2_inode* inode);
+
+/* Moves the blocks of the regular file 'inode' into as few contiguous
+ * runs as free space allows, copying them all before switching the file
+ * over to them in one update of its block pointers, then freeing the old
+ * ones. A file that can't be put in fewer extents is left alone. Returns
+ * how many extents it's in afterwards. */
+unsigned int defrag_file (unsigned char* disk, struct ext2_inode* inode);
+
 /////////////////////////////////////////
 // PATHNAME MANIPULATION FUNCTIONS
 /////////////////////////////////////////
@@ -74,23 +302,57 @@ char* get_pdir_name(char* dir_nam);
  */
 char* pathname_final(char *path);
 
+/* Returns a newly allocated "dir/name" for the 'len' bytes at 'name',
+ * not doubling up a trailing '/' on 'dir'
+ */
+char* join_path(const char* dir, const char* name, size_t len);
+
 
 /////////////////////////////////////////
 // INODE, DIRECTORY ENTRY, & DATA BLOCK LOOKUP
 /////////////////////////////////////////
 
-/* Given an absolute path 'dir_name', 
- * returns the corresponding directory entry */
+/* Returns the entry of the directory block 'block' named by the 'len' 
+ * bytes at 'name', or NULL if it has none */
+struct ext2_dir_entry_2* find_in_dir_block(unsigned char* block,
+                                           const char* name, unsigned int len);
+
+/* Given a directory inode, returns its entry named by the 'len' bytes 
+ * at 'name' (which need not be NUL-terminated), or NULL if it has none. 
+ * Names are compared in place; nothing is allocated. Results (including
+ * misses) are remembered in a dentry cache keyed by (directory, name),
+ * which add_dir_entr() and rem_dir_entr() keep up to date; otherwise
+ * indexed directories are searched through their hash index. Lookups
+ * don't wait for the directory's lock: they read it again if it changed
+ * meanwhile (a sequence lock), and count on its blocks staying allocated,
+ * which holds unless compact_dir() runs. The entry returned only stays
+ * put while the caller holds the directory's lock. */
+struct ext2_dir_entry_2* lookup_dir_entry(unsigned char* disk, 
+                                          struct ext2_inode* dir,
+                                          const char* name, unsigned int len);
+
+/* Forgets every lookup held in the image's dentry cache. Needed only by
+ * code that moves directory entries around other than through the
+ * helpers here. */
+void dcache_flush (unsigned char* disk);
+
+/* Given an absolute path 'dir_name', returns the corresponding directory 
+ * entry. Resolves the path in place, so it allocates nothing and is safe 
+ * to call from several threads at once. */
 struct ext2_dir_entry_2* find_dir_entry(char *dir_name, unsigned char *disk);
 
 /* Given an inode number, returns a pointer to the corresponding inode struct */
 struct ext2_inode* inum_to_inode(unsigned int inum, unsigned char *disk);
 
+/* Given an absolute path 'dir_name', returns the corresponding 
+ * inode number, or 0 if there is no such file */
+unsigned int find_inum(char *dir_name, unsigned char *disk);
+
 /* Given an absolute path 'dir_name', returns the corresponding inode */
 struct ext2_inode* find_inode(char *dir_name, unsigned char *disk);
 
-/* Given a directory entry 'd_entry', returns a 
- * correct end-truncated name (based on the name_len field) */
+/* Given a directory entry 'd_entry', returns a newly allocated, 
+ * NUL-terminated copy of its name (based on the name_len field) */
 char* extract_name(struct ext2_dir_entry_2* d_entry);
 
 /* Given an block number, returns a pointer to the the block */
@@ -101,12 +363,41 @@ unsigned char* bnum_to_block(unsigned int inum, unsigned char *disk);
 // BITMAP SEARCHING & MANIPULATION
 /////////////////////////////////////////
 
-// Returns the index of the lowest-numbered free inode or disk block available
-unsigned int find_free_inode_idx(unsigned char *disk);
-unsigned int find_free_block_idx(unsigned char *disk);
+/* Returns the number of a free inode for a new file in directory 'p_inum'
+ * (Orlov-style spreading for directories), or 0 if none are left */
+unsigned int find_free_inode_idx(unsigned char *disk, 
+                                 unsigned int p_inum, int is_dir);
+
+/* Returns the number of a free data block, searching forward from 
+ * block 'goal' (wrapping around), or 0 if none are left */
+unsigned int find_free_block_idx(unsigned char *disk, unsigned int goal);
+
+/* Word-at-a-time bitmap scanning over an 'nbits'-bit bitmap. The find 
+ * functions return the lowest matching bit at or after 'start', or 
+ * 'nbits' when there is none. bitmap_find_zero_run() also stores the 
+ * length of the clear run found (capped at 'max_len') in '*run_len'. */
+unsigned int bitmap_find_zero(const unsigned char *bmap, 
+                              unsigned int start, unsigned int nbits);
+unsigned int bitmap_find_set(const unsigned char *bmap, 
+                             unsigned int start, unsigned int nbits);
+unsigned int bitmap_find_zero_run(const unsigned char *bmap, 
+                                  unsigned int start, unsigned int nbits,
+                                  unsigned int max_len, 
+                                  unsigned int *run_len);
+
+// Returns how many of the first 'nbits' bits of 'bmap' are set
+unsigned int bitmap_count_set(const unsigned char *bmap, unsigned int nbits);
+
+// Sets / clears the 'len' bits of 'bmap' starting at bit 'start'
+void bitmap_set_range(unsigned char *bmap, unsigned int start, 
+                      unsigned int len);
+void bitmap_clear_range(unsigned char *bmap, unsigned int start, 
+                        unsigned int len);
 
-// Updates inode and block bitmaps upon the allocation of inodes/blocks
-void add_inode_to_imap(unsigned int i_num, unsigned char *disk);
+/* Updates inode and block bitmaps upon the allocation of inodes/blocks.
+ * add_inode_to_imap() counts a directory if 'is_dir' is set, and returns
+ * 0 (changing nothing) if another thread took the inode first. */
+int add_inode_to_imap(unsigned int i_num, unsigned char *disk, int is_dir);
 void add_block_to_bmap(unsigned int b_num, unsigned char *disk);
 
 // Updates inode and block bitmaps upon the deallocation of inodes/blocks
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "ext2_utils.h"
+#include "ext2_walk.h"
+
+#define WALK_DEQUE_INIT 64
+
+// A thread's queue of directories waiting to be scanned
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_dir** items;
+    size_t head, tail, cap;     // Queued items are [head, tail)
+};
+
+// What the walking threads share
+struct walk_state {
+    unsigned char* disk;
+    struct walk_deque* deques;  // One per thread
+    int nthreads;
+    int listing;
+    unsigned char* seen;        // A bit per inode: multi-link files counted
+    long active;                // Directories queued or being scanned
+};
+
+struct walk_thread {
+    struct walk_state* st;
+    int id;
+};
+
+/////////////////////////////////////////
+// WORK-STEALING QUEUES
+/////////////////////////////////////////
+
+/* Each thread pushes and pops the newest directories at the tail of
+ * its own queue (depth first, staying near the blocks it just read),
+ * while idle threads steal the oldest, highest-up ones from the head. */
+
+// Queues 'dir' at the tail of 'dq'
+static void deque_push (struct walk_deque* dq, struct walk_dir* dir) {
+    pthread_mutex_lock(&dq->lock);
+    if(dq->tail == dq->cap) {
+        if(dq->head) {      // Slides the live items back to the front
+            memmove(dq->items, dq->items + dq->head,
+                    (dq->tail - dq->head) * sizeof(*dq->items));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            dq->cap = dq->cap ? 2 * dq->cap : WALK_DEQUE_INIT;
+            dq->items = realloc(dq->items, dq->cap * sizeof(*dq->items));
+            exit_if(!dq->items, ENOMEM);
+        }
+    }
+    dq->items[dq->tail++] = dir;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+// Takes the newest directory off 'dq' (its owner's end), or NULL
+static struct walk_dir* deque_pop (struct walk_deque* dq) {
+    struct walk_dir* dir = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->tail > dq->head)
+        dir = dq->items[--dq->tail];
+    pthread_mutex_unlock(&dq->lock);
+    return dir;
+}
+
+// Takes the oldest directory off 'dq' (the thieves' end), or NULL
+static struct walk_dir* deque_steal (struct walk_deque* dq) {
+    struct walk_dir* dir = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->tail > dq->head)
+        dir = dq->items[dq->head++];
+    pthread_mutex_unlock(&dq->lock);
+    return dir;
+}
+
+
+/////////////////////////////////////////
+// SCANNING DIRECTORIES
+/////////////////////////////////////////
+
+/* Drops one pending count from 'dir'. Once a directory and all its
+ * subdirectories are done, its totals are added into its parent's,
+ * and so on up the tree. */
+static void walk_finish (struct walk_dir* dir) {
+    while(dir && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        if(dir->parent) {
+            __atomic_fetch_add(&dir->parent->blocks, dir->blocks,
+                               __ATOMIC_RELAXED);
+            __atomic_fetch_add(&dir->parent->size, dir->size,
+                               __ATOMIC_RELAXED);
+        }
+        dir = dir->parent;
+    }
+}
+
+// Returns a new, unscanned node for directory 'inum' at 'path'
+static struct walk_dir* walk_new_dir (struct walk_dir* parent, char* path,
+                                      unsigned int inum) {
+    struct walk_dir* dir = calloc(1, sizeof(*dir));
+
+    exit_if(!dir, ENOMEM);
+    dir->parent = parent;
+    dir->path = path;
+    dir->inum = inum;
+    dir->pending = 1;   // Itself, until scanned
+    return dir;
+}
+
+// Appends the 'len'-byte name at 'name' and a newline to dir's listing
+static void walk_list (struct walk_dir* dir, size_t* cap,
+                       const char* name, unsigned int len) {
+    if(dir->listing_len + len + 1 > *cap) {
+        *cap = MAX(2 * *cap, dir->listing_len + len + 1);
+        dir->listing = realloc(dir->listing, *cap);
+        exit_if(!dir->listing, ENOMEM);
+    }
+    memcpy(dir->listing + dir->listing_len, name, len);
+    dir->listing_len += len;
+    dir->listing[dir->listing_len++] = '\n';
+}
+
+/* Reads every entry of 'dir': files are added to its totals, and
+ * subdirectories queued on 'dq' for whichever thread gets to them */
+static void walk_scan (struct walk_state* st, struct walk_deque* dq,
+                       struct walk_dir* dir) {
+    struct ext2_inode *inode = inum_to_inode(dir->inum, st->disk), *c_inode;
+    unsigned long blocks = inode->i_blocks, size = inode->i_size;
+    struct ext2_dir_entry_2 *d_entry;
+    struct walk_dir *child;
+    struct block_iter it;
+    unsigned int bnum, offset, inum;
+    size_t cap = 0;
+    int is_meta;
+
+    // Directories may be changing as they're walked
+    inode_lock(st->disk, inode);
+    fetch_dir(st->disk, inode, 1);
+    block_iter_init(&it, st->disk, inode, 0,
+                    inode->i_size / EXT2_BLOCK_SIZE, 0);
+    while(block_iter_next(&it, &bnum, &is_meta)) {
+        if(is_meta || !bnum)
+            continue;
+        for(offset = 0; offset < EXT2_BLOCK_SIZE; offset += d_entry->rec_len) {
+            d_entry = (struct ext2_dir_entry_2*)(bnum_to_block(bnum, st->disk)
+                                                 + offset);
+            if(!d_entry->rec_len)   // Corrupt block; don't spin on it
+                break;
+            if(!(inum = d_entry->inode))
+                continue;
+            if(st->listing)
+                walk_list(dir, &cap, d_entry->name, d_entry->name_len);
+            if(d_entry->name[0] == '.' && (d_entry->name_len == 1 ||
+                (d_entry->name_len == 2 && d_entry->name[1] == '.')))
+                continue;
+
+            c_inode = inum_to_inode(inum, st->disk);
+            if(c_inode->i_mode & EXT2_S_IFDIR) {
+                child = walk_new_dir(dir, join_path(dir->path, d_entry->name,
+                                     d_entry->name_len), inum);
+                if(dir->last_child)
+                    dir->last_child->next_sibling = child;
+                else
+                    dir->first_child = child;
+                dir->last_child = child;
+
+                __atomic_fetch_add(&dir->pending, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&st->active, 1, __ATOMIC_RELAXED);
+                deque_push(dq, child);
+                continue;
+            }
+
+            // A file with other links is counted where it's first seen
+            if(c_inode->i_links_count > 1 &&
+                (__atomic_fetch_or(&st->seen[inum / 8], 1 << (inum % 8),
+                                   __ATOMIC_RELAXED) & (1 << (inum % 8))))
+                continue;
+            blocks += c_inode->i_blocks;
+            size += get_inode_size(c_inode);
+        }
+    }
+    inode_unlock(st->disk, inode);
+
+    __atomic_fetch_add(&dir->blocks, blocks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dir->size, size, __ATOMIC_RELAXED);
+    walk_finish(dir);
+    __atomic_fetch_sub(&st->active, 1, __ATOMIC_RELEASE);
+}
+
+/* Scans directories from this thread's own queue, else stolen from the
+ * others', until none are queued or being scanned anywhere */
+static void* walk_worker (void* arg) {
+    struct walk_thread* self = arg;
+    struct walk_state* st = self->st;
+    struct walk_dir* dir;
+    int i;
+
+    for(;;) {
+        dir = deque_pop(&st->deques[self->id]);
+        for(i = 1; !dir && i < st->nthreads; i++)
+            dir = deque_steal(&st->deques[(self->id + i) % st->nthreads]);
+
+        if(dir)
+            walk_scan(st, &st->deques[self->id], dir);
+        else if(!__atomic_load_n(&st->active, __ATOMIC_ACQUIRE))
+            return NULL;
+        else    // Others are still scanning; more may turn up
+            sched_yield();
+    }
+}
+
+/* Walks the tree under the directory 'path' with 'nthreads' threads,
+ * each taking directories from its own queue and stealing from the
+ * others' when it runs dry. With 'listing' set, records every
+ * directory's entry names too. Returns the root of the walked tree
+ * (NULL if 'path' isn't a directory), to be freed with walk_free(). */
+struct walk_dir* walk_tree (unsigned char* disk, char* path, int nthreads,
+                            int listing) {
+    unsigned int inum = find_inum(path, disk);
+    struct walk_state st = { .disk = disk, .listing = listing, .active = 1 };
+    struct walk_thread* threads;
+    pthread_t* tids;
+    struct walk_dir* root;
+    int i;
+
+    if(!inum || !(inum_to_inode(inum, disk)->i_mode & EXT2_S_IFDIR))
+        return NULL;
+
+    st.nthreads = MAX(nthreads, 1);
+    st.deques = calloc(st.nthreads, sizeof(*st.deques));
+    st.seen = calloc(get_sb(disk)->s_inodes_count / 8 + 1, 1);
+    threads = calloc(st.nthreads, sizeof(*threads));
+    tids = calloc(st.nthreads, sizeof(*tids));
+    exit_if(!st.deques || !st.seen || !threads || !tids, ENOMEM);
+    for(i = 0; i < st.nthreads; i++) {
+        pthread_mutex_init(&st.deques[i].lock, NULL);
+        threads[i].st = &st;
+        threads[i].id = i;
+    }
+
+    root = walk_new_dir(NULL, copy_arg(path), inum);
+    deque_push(&st.deques[0], root);
+
+    // This thread takes part as thread 0
+    for(i = 1; i < st.nthreads; i++)
+        exit_if(pthread_create(&tids[i], NULL, walk_worker, &threads[i]),
+                EAGAIN);
+    walk_worker(&threads[0]);
+    for(i = 1; i < st.nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    for(i = 0; i < st.nthreads; i++) {
+        pthread_mutex_destroy(&st.deques[i].lock);
+        free(st.deques[i].items);
+    }
+    free(st.deques);
+    free(st.seen);
+    free(threads);
+    free(tids);
+    return root;
+}
+
+// Frees a tree returned by walk_tree()
+void walk_free (struct walk_dir* dir) {
+    struct walk_dir *child, *next;
+
+    for(child = dir->first_child; child; child = next) {
+        next = child->next_sibling;
+        walk_free(child);
+    }
+    free(dir->listing);
+    free(dir->path);
+    free(dir);
+}
@@ -0,0 +1,43 @@
+#ifndef EXT2_WALK_H
+#define EXT2_WALK_H
+
+#include "ext2.h"
+
+/////////////////////////////////////////
+// PARALLEL DIRECTORY TREE WALK
+/////////////////////////////////////////
+
+/* One directory of a walked tree. Children are kept in the order their
+ * entries appear in the directory, so the tree can be printed the same
+ * way every time however the walk was split between threads. */
+struct walk_dir {
+    struct walk_dir* parent;
+    struct walk_dir* first_child;
+    struct walk_dir* last_child;
+    struct walk_dir* next_sibling;
+    char* path;
+    unsigned int inum;
+
+    char* listing;              // Entry names, one per line (if asked for)
+    size_t listing_len;
+
+    /* Totals for the whole subtree: 512-byte sectors (i_blocks) and
+     * bytes (i_size). Files with several links are counted once. */
+    unsigned long blocks;
+    unsigned long size;
+
+    int pending;                // This directory & its unfinished subdirs
+};
+
+/* Walks the tree under the directory 'path' with 'nthreads' threads,
+ * each taking directories from its own queue and stealing from the
+ * others' when it runs dry. With 'listing' set, records every
+ * directory's entry names too. Returns the root of the walked tree
+ * (NULL if 'path' isn't a directory), to be freed with walk_free(). */
+struct walk_dir* walk_tree (unsigned char* disk, char* path, int nthreads,
+                            int listing);
+
+// Frees a tree returned by walk_tree()
+void walk_free (struct walk_dir* dir);
+
+#endif
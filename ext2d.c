@@ -0,0 +1,279 @@
+/*
+ * ============================================================================================
+ * File Name : ext2d.c
+ * Description  : This program takes the name of an ext2 formatted virtual disk and a path
+ *                for a Unix domain socket. It opens the disk once, then serves requests from
+ *                any number of local clients connected to the socket, one per line:
+ *                    ls [-R | -u | -l | -f json|csv] <absolute path on the disk>
+ *                    stat <absolute path on the disk>
+ *                    cat <absolute path on the disk> [<offset> <length>]
+ *                    cp <path on native file system> <absolute path on the disk>
+ *                    mkdir <absolute path on the disk>
+ *                    ln <link target> <link storage location>
+ *                    rm <absolute path on the disk>
+ *                    compact [-s] <absolute path on the disk>
+ *                Each works like the ext2_* program of the same name (native paths are
+ *                the daemon's). Every request gets back a header line "<status> <length>",
+ *                where status is 0 or an errno value, followed by exactly <length> bytes of
+ *                output. Requests are served concurrently, those that change the disk
+ *                included (but compact, which runs alone); each change is written back
+ *                to the image (with nothing else running) before it is answered. SIGINT or SIGTERM shut the daemon down.
+ * ============================================================================================
+ */
+
+#define _GNU_SOURCE     // PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ext2_utils.h"
+#include "ext2_ops.h"
+
+#define MAX_ARGS    4   // Command name included
+
+unsigned char *disk;
+
+/* Held shared by every request (the library locks what each one touches),
+ * and exclusively to compact a directory (freeing blocks that lookups may
+ * be reading) or write changes back, which need the disk to themselves.
+ * A waiting writer holds back new requests, so a stream of cats can't put
+ * off a change's write-back for good. */
+static pthread_rwlock_t disk_lock = 
+    PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+static char* sock_path;
+
+static void usage (void) {
+    fprintf(stderr, "Usage: ext2d <image file name> <socket path>\n");
+    exit(1);
+}
+
+// Writes the 'len' bytes at 'buf' to the client on 'fd' in full
+static int send_all (int fd, const void* buf, size_t len) {
+    ssize_t result;
+
+    while(len) {
+        result = write(fd, buf, len);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+            return -1;  // The client went away
+        buf = (const char*)buf + result;
+        len -= result;
+    }
+    return 0;
+}
+
+// Sends a reply header: the status, and how many bytes of output follow
+static int send_header (int fd, int status, unsigned long len) {
+    char header[48];
+    int n = snprintf(header, sizeof(header), "%d %lu\n", status, len);
+
+    return send_all(fd, header, n);
+}
+
+/* Runs a read-only request whose output is printed to a FILE, collecting
+ * it so its length can go in the header */
+static int reply_printed (int fd, int argc, char** argv) {
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* out = open_memstream(&buf, &len);
+    int err = EINVAL, result;
+
+    exit_if(!out, ENOMEM);
+    if(!strcmp(argv[0], "ls") && argc == 2)
+        err = do_ls(disk, argv[1], out);
+    else if(!strcmp(argv[0], "ls") && argc == 3 &&
+            (!strcmp(argv[1], "-R") || !strcmp(argv[1], "-u")))
+        err = do_ls_tree(disk, argv[2], out, 1, argv[1][1] == 'u');
+    else if(!strcmp(argv[0], "ls") && argc == 3 && !strcmp(argv[1], "-l"))
+        err = do_ls_long(disk, argv[2], out, LS_LONG);
+    else if(!strcmp(argv[0], "ls") && argc == 4 && !strcmp(argv[1], "-f") &&
+            (!strcmp(argv[2], "json") || !strcmp(argv[2], "csv")))
+        err = do_ls_long(disk, argv[3], out, 
+                         argv[2][0] == 'j' ? LS_JSON : LS_CSV);
+    else if(!strcmp(argv[0], "stat") && argc == 2)
+        err = do_stat(disk, argv[1], out);
+    fclose(out);
+
+    if(err)
+        len = 0;
+    result = send_header(fd, err, len);
+    if(!result)
+        result = send_all(fd, buf, len);
+    free(buf);
+    return result;
+}
+
+/* Sends (part of) a file straight from the image to the client, after a
+ * header giving its length. The file's inode stays locked from the lookup
+ * to the last byte sent, so an rm can't free (and a cp reuse) its blocks
+ * part way through. */
+static int reply_cat (int fd, int argc, char** argv) {
+    unsigned long off = 0, len = (unsigned long)-1, size;
+    struct ext2_inode* inode = find_inode(argv[1], disk);
+    int result;
+
+    if(argc == 4) {
+        off = strtoul(argv[2], NULL, 10);
+        len = strtoul(argv[3], NULL, 10);
+    } else if(argc != 2)
+        return send_header(fd, EINVAL, 0);
+    if(!inode)
+        return send_header(fd, ENOENT, 0);
+
+    // Removed between the lookup and the lock
+    inode_lock(disk, inode);
+    if(find_inode(argv[1], disk) != inode) {
+        inode_unlock(disk, inode);
+        return send_header(fd, ENOENT, 0);
+    }
+
+    if((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR)
+        result = send_header(fd, EISDIR, 0);
+    else if((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFREG)
+        result = send_header(fd, EINVAL, 0);
+    else {
+        size = get_inode_size(inode);
+        off = MIN(off, size);
+        result = send_header(fd, 0, MIN(len, size - off));
+        if(!result)
+            result = read_file(disk, inode, off, len, fd);
+    }
+    inode_unlock(disk, inode);
+    return result;
+}
+
+/* Runs a request that changes the disk (alongside any others, unless it
+ * compacts), then writes the change back */
+static int reply_write (int fd, int argc, char** argv) {
+    int err = EINVAL;
+
+    if(!strcmp(argv[0], "compact"))
+        pthread_rwlock_wrlock(&disk_lock);
+    else
+        pthread_rwlock_rdlock(&disk_lock);
+    if(!strcmp(argv[0], "cp") && argc == 3)
+        err = do_cp(disk, argv[1], argv[2]);
+    else if(!strcmp(argv[0], "mkdir") && argc == 2)
+        err = do_mkdir(disk, argv[1]);
+    else if(!strcmp(argv[0], "ln") && argc == 3)
+        err = do_ln(disk, argv[1], argv[2]);
+    else if(!strcmp(argv[0], "rm") && argc == 2)
+        err = do_rm(disk, argv[1]);
+    else if(!strcmp(argv[0], "compact") && argc == 2)
+        err = do_compact(disk, argv[1], 0, 0, NULL);
+    else if(!strcmp(argv[0], "compact") && argc == 3 && 
+            !strcmp(argv[1], "-s"))
+        err = do_compact(disk, argv[2], 1, 0, NULL);
+    pthread_rwlock_unlock(&disk_lock);
+
+    if(!err) {
+        pthread_rwlock_wrlock(&disk_lock);
+        flush_image(disk);
+        pthread_rwlock_unlock(&disk_lock);
+    }
+    return send_header(fd, err, 0);
+}
+
+// Returns whether the command 'name' only reads the disk
+static int is_read (const char* name) {
+    return !strcmp(name, "ls") || !strcmp(name, "stat") ||
+           !strcmp(name, "cat");
+}
+
+// Answers one client's requests until it hangs up
+static void* serve_client (void* arg) {
+    int fd = (int)(long)arg, nwords, result;
+    FILE* in = fdopen(fd, "r");
+    char *line = NULL, *word, *save;
+    char* words[MAX_ARGS];
+    size_t line_cap = 0;
+
+    exit_if(!in, ENOMEM);
+    while(getline(&line, &line_cap, in) != -1) {
+        // Splits the line into words
+        nwords = 0;
+        for(word = strtok_r(line, " \t\r\n", &save);
+            word && nwords < MAX_ARGS; word = strtok_r(NULL, " \t\r\n", &save))
+            words[nwords++] = word;
+        if(!nwords)
+            continue;
+
+        if(word)    // Too many words
+            result = send_header(fd, EINVAL, 0);
+        else if(is_read(words[0])) {
+            pthread_rwlock_rdlock(&disk_lock);
+            result = !strcmp(words[0], "cat") ?
+                     reply_cat(fd, nwords, words) :
+                     reply_printed(fd, nwords, words);
+            pthread_rwlock_unlock(&disk_lock);
+        } else
+            result = reply_write(fd, nwords, words);
+        if(result)
+            break;
+    }
+    free(line);
+    fclose(in);
+    return NULL;
+}
+
+/* Waits for SIGINT or SIGTERM, then writes everything back and exits
+ * once no request is in progress */
+static void* wait_for_exit (void* arg) {
+    sigset_t* set = arg;
+    int sig;
+
+    sigwait(set, &sig);
+    pthread_rwlock_wrlock(&disk_lock);
+    close_image(disk);
+    unlink(sock_path);
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    pthread_t tid;
+    sigset_t set;
+    int listen_fd, fd;
+
+    if(argc != 3)
+        usage();
+    sock_path = argv[2];
+    exit_if(strlen(sock_path) >= sizeof(addr.sun_path), ENAMETOOLONG);
+    strcpy(addr.sun_path, sock_path);
+
+    // Signals are taken by one thread alone; a client hanging up is not one
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    disk = open_image(argv[1], O_RDWR);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    exit_if(listen_fd < 0, errno);
+    unlink(sock_path);  // Left behind by an earlier run
+    exit_if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0, errno);
+    exit_if(listen(listen_fd, SOMAXCONN) < 0, errno);
+    exit_if(pthread_create(&tid, NULL, wait_for_exit, &set), EAGAIN);
+
+    // A thread per client
+    for(;;) {
+        fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) {
+            exit_if(errno != EINTR && errno != ECONNABORTED, errno);
+            continue;
+        }
+        exit_if(pthread_create(&tid, NULL, serve_client, (void*)(long)fd),
+                EAGAIN);
+        pthread_detach(tid);
+    }
+}